@@ -0,0 +1,164 @@
+/**
+ * @brief Deterministic Synthetic Corpus
+ */
+
+#include "corpus.h"
+
+#include <stdlib.h>
+
+static const char *names[CORPUS_KINDS] = {"photo", "screenshot", "gradient",
+                                          "noise"};
+
+const char *corpus_name(corpus_kind kind) { return names[kind]; }
+
+// xorshift64*, seeded per kind & size
+static uint64_t next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Value noise lattice with cells of size pixels, bilinearly interpolated
+static void add_octave(image_t *im, uint64_t *rng, uint32_t cell, int weight) {
+  uint32_t gw = im->width / cell + 2, gh = im->height / cell + 2;
+  unsigned char *grid = malloc((size_t)gw * gh * 3);
+  if (!grid)
+    return;
+
+  for (size_t i = 0; i < (size_t)gw * gh * 3; i++)
+    grid[i] = next(rng) >> 56;
+
+  for (uint32_t y = 0; y < im->height; y++) {
+    uint32_t gy = y / cell, fy = (y % cell) * 256 / cell;
+
+    for (uint32_t x = 0; x < im->width; x++) {
+      uint32_t gx = x / cell, fx = (x % cell) * 256 / cell;
+      unsigned char *px = &im->data[((size_t)y * im->width + x) * 3];
+
+      for (int c = 0; c < 3; c++) {
+        int a = grid[(gy * gw + gx) * 3 + c];
+        int b = grid[(gy * gw + gx + 1) * 3 + c];
+        int d = grid[((gy + 1) * gw + gx) * 3 + c];
+        int e = grid[((gy + 1) * gw + gx + 1) * 3 + c];
+
+        int top = a * (256 - fx) + b * fx, bottom = d * (256 - fx) + e * fx;
+        int v = (top * (256 - fy) + bottom * fy) >> 16;
+
+        int out = px[c] + (v - 128) * weight / 16;
+        px[c] = out < 0 ? 0 : out > 255 ? 255 : out;
+      }
+    }
+  }
+
+  free(grid);
+}
+
+static void photo(image_t *im, uint64_t *rng) {
+  for (size_t i = 0; i < (size_t)im->width * im->height * 3; i++)
+    im->data[i] = 128;
+
+  // large soft shapes down to fine texture, plus sensor noise
+  uint32_t size = im->width > im->height ? im->width : im->height;
+  int weight = 16;
+  for (uint32_t cell = size / 4; cell >= 2; cell /= 4, weight /= 2)
+    add_octave(im, rng, cell, weight ? weight : 1);
+
+  for (size_t i = 0; i < (size_t)im->width * im->height * 3; i++) {
+    int v = im->data[i] + (int)(next(rng) >> 61) - 4;
+    im->data[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+  }
+}
+
+static void fill_rect(image_t *im, uint32_t x, uint32_t y, uint32_t w,
+                      uint32_t h, const unsigned char *color) {
+  for (uint32_t j = y; j < y + h && j < im->height; j++)
+    for (uint32_t i = x; i < x + w && i < im->width; i++)
+      for (int c = 0; c < 3; c++)
+        im->data[((size_t)j * im->width + i) * 3 + c] = color[c];
+}
+
+static void screenshot(image_t *im, uint64_t *rng) {
+  static const unsigned char background[3] = {236, 236, 236};
+  fill_rect(im, 0, 0, im->width, im->height, background);
+
+  // windows with title bars and lines of "text"
+  uint32_t windows = 2 + im->width / 256;
+  for (uint32_t n = 0; n < windows; n++) {
+    uint32_t w = im->width / 4 + next(rng) % (im->width / 2 + 1);
+    uint32_t h = im->height / 4 + next(rng) % (im->height / 2 + 1);
+    uint32_t x = next(rng) % (im->width - w / 2);
+    uint32_t y = next(rng) % (im->height - h / 2);
+
+    unsigned char title[3] = {next(rng) >> 56, next(rng) >> 56, 200};
+    static const unsigned char white[3] = {255, 255, 255};
+    static const unsigned char ink[3] = {30, 30, 30};
+
+    fill_rect(im, x, y, w, h, white);
+    fill_rect(im, x, y, w, 24, title);
+
+    if (w < 32)
+      continue;
+
+    for (uint32_t line = y + 32; line + 12 < y + h; line += 16) {
+      uint32_t cx = x + 8;
+      while (cx + 8 < x + w - 8) {
+        uint32_t word = 3 + next(rng) % 8;
+        for (uint32_t k = 0; k < word && cx + 6 < x + w - 8; k++, cx += 7) {
+          uint64_t glyph = next(rng);
+          for (int gy = 0; gy < 10; gy++)
+            for (int gx = 0; gx < 6; gx++)
+              if ((glyph >> (gy * 6 + gx) % 64) & 1)
+                fill_rect(im, cx + gx, line + gy, 1, 1, ink);
+        }
+        cx += 7;
+      }
+    }
+  }
+}
+
+static void gradient(image_t *im) {
+  for (uint32_t y = 0; y < im->height; y++) {
+    for (uint32_t x = 0; x < im->width; x++) {
+      unsigned char *px = &im->data[((size_t)y * im->width + x) * 3];
+      px[0] = (uint64_t)x * 255 / (im->width > 1 ? im->width - 1 : 1);
+      px[1] = (uint64_t)y * 255 / (im->height > 1 ? im->height - 1 : 1);
+      px[2] = ((uint64_t)x + y) * 255 / (im->width + im->height);
+    }
+  }
+}
+
+static void noise(image_t *im, uint64_t *rng) {
+  size_t size = (size_t)im->width * im->height * 3;
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t v = next(rng);
+    for (size_t k = 0; k < 8 && i + k < size; k++)
+      im->data[i + k] = v >> (k * 8);
+  }
+}
+
+image_t *corpus_generate(corpus_kind kind, uint32_t width, uint32_t height) {
+  image_t *im = image_allocate(width, height, 3);
+  if (!im)
+    return NULL;
+
+  uint64_t rng = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)kind << 48) ^
+                 ((uint64_t)width << 24) ^ height;
+
+  switch (kind) {
+  case CORPUS_PHOTO:
+    photo(im, &rng);
+    break;
+  case CORPUS_SCREENSHOT:
+    screenshot(im, &rng);
+    break;
+  case CORPUS_GRADIENT:
+    gradient(im);
+    break;
+  default:
+    noise(im, &rng);
+    break;
+  }
+
+  return im;
+}
@@ -0,0 +1,24 @@
+/**
+ * @brief Deterministic Synthetic Corpus
+ */
+
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+
+#include <image.h>
+
+typedef enum {
+  CORPUS_PHOTO,      // smooth multi-octave noise
+  CORPUS_SCREENSHOT, // flat areas, hard edges, text-like strokes
+  CORPUS_GRADIENT,   // linear ramps
+  CORPUS_NOISE,      // uniform random (incompressible)
+  CORPUS_KINDS
+} corpus_kind;
+
+// Name of kind
+const char *corpus_name(corpus_kind kind);
+
+// Generate RGB image; same kind & size always give the same pixels
+image_t *corpus_generate(corpus_kind kind, uint32_t width, uint32_t height);
+
+#endif // _CORPUS_H_
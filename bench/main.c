@@ -0,0 +1,457 @@
+/**
+ * @brief Codec & Operation Benchmarks
+ *
+ * Generates the synthetic corpus, then times every load/save, convert,
+ * resize, rotate, fill and filter path single threaded and with one copy per
+ * thread (library threads per call set apart), printing one JSON object per
+ * measurement (JSON lines) so runs of different versions can be diffed.
+ */
+
+#define _GNU_SOURCE
+
+#include "corpus.h"
+#include <image.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *usage =
+    "usage: bench [options]\n"
+    "  -s <list>   sizes (square), default 64,256,1024,4096 (up to 16384)\n"
+    "  -k <list>   kinds: photo,screenshot,gradient,noise (default: all)\n"
+    "  -j <n>      threads of the multi-threaded runs (default: cores)\n"
+    "  -p <n>      library threads per call (default: 1, 0 for one per core)\n"
+    "  -t <sec>    minimum time per measurement (default: 0.25)\n"
+    "  -d <dir>    corpus directory (default: bench-corpus)\n"
+    "  -o <file>   results (default: stdout)\n";
+
+static const char *codecs[] = {"qoi", "bmp", "png", "tiff"};
+#define CODECS (sizeof(codecs) / sizeof(*codecs))
+
+typedef enum {
+  OP_LOAD,
+  OP_SAVE,
+  OP_CONVERT_RGBA,
+  OP_CONVERT_GRAY,
+  OP_RESIZE_HALF,
+  OP_RESIZE_THUMB,
+  OP_ROTATE_90,
+  OP_ROTATE_180,
+  OP_FILL,
+  OP_BLUR_SMALL,
+  OP_BLUR_LARGE,
+  OP_SHARPEN,
+  OP_PYRAMID,
+  OP_QUANTIZE,
+  OP_HISTOGRAM,
+  OP_MSE,
+  OP_SSIM,
+  OP_HASH,
+  OP_LUT,
+  OP_TEXT,
+  OPS
+} op_t;
+
+static const char *op_names[OPS] = {
+    "load",        "save",         "convert_rgba", "convert_gray",
+    "resize_half", "resize_thumb", "rotate_90",    "rotate_180",
+    "fill",        "blur_small",   "blur_large",   "sharpen",
+    "pyramid",     "quantize",     "histogram",    "mse",
+    "ssim",        "hash",         "lut",          "text"};
+
+static struct {
+  const char *dir;
+  double min_time;
+  unsigned threads;
+  unsigned pool; // library threads per call
+  FILE *out;
+} options = {"bench-corpus", 0.25, 0, 1, NULL};
+
+// One measurement
+typedef struct {
+  op_t op;
+  const char *codec; // load / save only
+  const char *kind;
+  const image_t *source;
+  char path[512]; // encoded corpus file
+  size_t bytes;   // moved per iteration (encoded or raw)
+  unsigned iterations;
+} bench_t;
+
+// Per thread
+typedef struct {
+  bench_t *bench;
+  unsigned index;
+  pthread_barrier_t *start;
+  double seconds; // timed part only
+  int failed;
+} worker_t;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static image_t *copy(const image_t *source) {
+  image_t *im = image_allocate(source->width, source->height, source->channels);
+  if (im)
+    memcpy(im->data, source->data,
+           (size_t)source->width * source->height * source->channels);
+  return im;
+}
+
+// Run one iteration, returning the seconds spent in the measured call
+static double run_once(bench_t *b, unsigned index, int *failed) {
+  const image_t *src = b->source;
+  image_t *work = NULL;
+  double start, end;
+
+  switch (b->op) {
+  case OP_LOAD: {
+    start = now();
+    image_t *im = image_load(b->path);
+    end = now();
+    *failed |= !im;
+    image_free(im);
+    return end - start;
+  }
+
+  case OP_SAVE: {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/save-%u.%s", options.dir, index, b->codec);
+    start = now();
+    *failed |= image_save(*src, path);
+    end = now();
+    return end - start;
+  }
+
+  case OP_PYRAMID: {
+    start = now();
+    image_pyramid_t *pyramid = image_build_pyramid(*src, 0, IMAGE_PYRAMID_BOX);
+    end = now();
+    *failed |= !pyramid;
+    image_pyramid_free(pyramid);
+    return end - start;
+  }
+
+  case OP_QUANTIZE: {
+    start = now();
+    image_indexed_t *indexed = image_quantize(*src, 256, IMAGE_DITHER_NONE);
+    end = now();
+    *failed |= !indexed;
+    image_indexed_free(indexed);
+    return end - start;
+  }
+
+  case OP_HISTOGRAM: {
+    image_histogram_t histogram;
+    start = now();
+    *failed |= image_histogram(*src, &histogram);
+    end = now();
+    return end - start;
+  }
+
+  case OP_HASH: {
+    uint64_t hash;
+    start = now();
+    *failed |= image_hash(*src, IMAGE_HASH_DCT, &hash);
+    end = now();
+    return end - start;
+  }
+
+  // against a copy, as a round trip check would
+  case OP_MSE:
+  case OP_SSIM: {
+    work = copy(src);
+    double mse, psnr, ssim;
+    start = now();
+    *failed |= !work || (b->op == OP_MSE ? image_mse(*src, *work, &mse, &psnr)
+                                         : image_ssim(*src, *work, &ssim));
+    end = now();
+    image_free(work);
+    return end - start;
+  }
+
+  case OP_FILL: {
+    static const unsigned char color[4] = {12, 34, 56, 255};
+    work = copy(src);
+    start = now();
+    image_draw_fill(*work, color, 4);
+    end = now();
+    break;
+  }
+
+  // a levels & curve chain, applied in one pass
+  case OP_LUT: {
+    static const uint8_t points[][2] = {{0, 0}, {64, 48}, {192, 208},
+                                        {255, 255}};
+    image_lut_t lut;
+    work = copy(src);
+    start = now();
+    image_lut_identity(&lut);
+    image_lut_levels(&lut, IMAGE_LUT_COLOR, 8, 248, 1.1f, 0, 255);
+    image_lut_curve(&lut, IMAGE_LUT_COLOR, points, 4);
+    *failed |= !work || image_lut_apply(*work, &lut);
+    end = now();
+    break;
+  }
+
+  // a timestamp every 16 rows, laid out & drawn as one batch
+  case OP_TEXT: {
+    uint32_t count = src->height / 16;
+    image_text_t texts[count];
+    char labels[count][32];
+    for (uint32_t i = 0; i < count; i++) {
+      snprintf(labels[i], sizeof(labels[i]), "2026-01-01 00:%02u:%02u.%03u",
+               i / 60 % 60, i % 60, i);
+      texts[i] = (image_text_t){labels[i], 8, (int)i * 16, {255, 255, 0, 255},
+                                1 + i % 2};
+    }
+
+    work = copy(src);
+    start = now();
+    *failed |= !work || (src->channels >= 3 &&
+                         image_draw_text(*work, image_font_default(), texts,
+                                         count));
+    end = now();
+    break;
+  }
+
+  default:
+    work = copy(src);
+    start = now();
+    switch (b->op) {
+    case OP_CONVERT_RGBA:
+      image_resize(work, src->width, src->height, 4);
+      break;
+    case OP_CONVERT_GRAY:
+      image_resize(work, src->width, src->height, 1);
+      break;
+    case OP_RESIZE_HALF:
+      image_resize(work, (src->width + 1) / 2, (src->height + 1) / 2,
+                   src->channels);
+      break;
+    case OP_RESIZE_THUMB:
+      image_resize(work, 256, (uint64_t)src->height * 256 / src->width,
+                   src->channels);
+      break;
+    case OP_ROTATE_90:
+      image_rotate(work, 1);
+      break;
+    case OP_ROTATE_180:
+      image_rotate(work, 2);
+      break;
+    case OP_BLUR_SMALL: // 5x5 kernel
+      image_blur_gaussian(*work, 0.6);
+      break;
+    case OP_BLUR_LARGE: // box blurs
+      image_blur_gaussian(*work, 8);
+      break;
+    default:
+      image_sharpen(*work, 1, 0.5, 2);
+      break;
+    }
+    end = now();
+    break;
+  }
+
+  *failed |= !work;
+  image_free(work);
+  return end - start;
+}
+
+static void *worker(void *arg) {
+  worker_t *w = arg;
+
+  pthread_barrier_wait(w->start);
+  for (unsigned i = 0; i < w->bench->iterations; i++)
+    w->seconds += run_once(w->bench, w->index, &w->failed);
+
+  return NULL;
+}
+
+static void report(bench_t *b, unsigned threads, double seconds) {
+  double pixels = (double)b->source->width * b->source->height;
+  double total = (double)b->iterations * threads;
+
+  fprintf(options.out,
+          "{\"op\":\"%s\",\"codec\":\"%s\",\"kind\":\"%s\",\"width\":%u,"
+          "\"height\":%u,\"channels\":%u,\"threads\":%u,\"pool\":%u,"
+          "\"iterations\":%u,\"bytes\":%zu,\"seconds\":%.6f,\"mp_per_s\":%.3f,"
+          "\"mb_per_s\":%.3f}\n",
+          op_names[b->op], b->codec ? b->codec : "", b->kind,
+          b->source->width, b->source->height, b->source->channels, threads,
+          image_parallel_count(), b->iterations, b->bytes, seconds,
+          seconds > 0 ? total * pixels / 1e6 / seconds : 0,
+          seconds > 0 ? total * b->bytes / 1e6 / seconds : 0);
+  fflush(options.out);
+
+  fprintf(stderr, "%-12s %-4s %-10s %5ux%-5u %2ut %10.1f MP/s %10.1f MB/s\n",
+          op_names[b->op], b->codec ? b->codec : "", b->kind,
+          b->source->width, b->source->height, threads,
+          seconds > 0 ? total * pixels / 1e6 / seconds : 0,
+          seconds > 0 ? total * b->bytes / 1e6 / seconds : 0);
+}
+
+// Single threaded run (calibrating the iteration count), then one copy per
+// thread running concurrently
+static void measure(bench_t *b) {
+  int failed = 0;
+  double spent = 0;
+
+  b->iterations = 0;
+  run_once(b, 0, &failed); // warm up
+  while (spent < options.min_time || b->iterations < 3) {
+    spent += run_once(b, 0, &failed);
+    b->iterations++;
+  }
+
+  if (failed) {
+    fprintf(stderr, "%s %s failed\n", op_names[b->op],
+            b->codec ? b->codec : "");
+    return;
+  }
+
+  report(b, 1, spent);
+
+  unsigned threads = options.threads;
+  if (threads <= 1)
+    return;
+
+  pthread_t ids[threads];
+  worker_t workers[threads];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, threads + 1);
+
+  for (unsigned i = 0; i < threads; i++) {
+    workers[i] = (worker_t){b, i, &start, 0, 0};
+    pthread_create(&ids[i], NULL, worker, &workers[i]);
+  }
+
+  // wall time across all threads
+  pthread_barrier_wait(&start);
+  double begin = now();
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(ids[i], NULL);
+  double wall = now() - begin;
+
+  pthread_barrier_destroy(&start);
+  report(b, threads, wall);
+}
+
+static void bench_image(const image_t *source, const char *kind) {
+  size_t raw = (size_t)source->width * source->height * source->channels;
+
+  for (unsigned c = 0; c < CODECS; c++) {
+    bench_t b = {OP_SAVE, codecs[c], kind, source};
+    snprintf(b.path, sizeof(b.path), "%s/%s-%u.%s", options.dir, kind,
+             source->width, codecs[c]);
+
+    if (image_save(*source, b.path)) {
+      fprintf(stderr, "failed to write corpus file %s\n", b.path);
+      continue;
+    }
+
+    struct stat st;
+    b.bytes = stat(b.path, &st) ? 0 : st.st_size;
+
+    measure(&b);
+    b.op = OP_LOAD;
+    measure(&b);
+  }
+
+  for (op_t op = OP_CONVERT_RGBA; op < OPS; op++) {
+    bench_t b = {op, NULL, kind, source};
+    b.bytes = raw;
+    measure(&b);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *sizes = "64,256,1024,4096";
+  const char *kinds = NULL;
+  const char *output = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:k:j:p:t:d:o:h")) != -1) {
+    switch (opt) {
+    case 's':
+      sizes = optarg;
+      break;
+    case 'k':
+      kinds = optarg;
+      break;
+    case 'j':
+      options.threads = atoi(optarg);
+      break;
+    case 'p':
+      options.pool = atoi(optarg);
+      break;
+    case 't':
+      options.min_time = atof(optarg);
+      break;
+    case 'd':
+      options.dir = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      fputs(usage, stderr);
+      return opt != 'h';
+    }
+  }
+
+  if (options.threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    options.threads = cores > 0 ? cores : 1;
+  }
+
+  image_parallel_threads(options.pool);
+
+  options.out = output ? fopen(output, "w") : stdout;
+  if (!options.out) {
+    fprintf(stderr, "failed to open %s\n", output);
+    return 1;
+  }
+
+  mkdir(options.dir, 0755);
+
+  char *list = strdup(sizes);
+  for (char *save, *token = strtok_r(list, ",", &save); token;
+       token = strtok_r(NULL, ",", &save)) {
+    uint32_t size = atoi(token);
+    if (size < 16 || size > 16384) {
+      fprintf(stderr, "invalid size %s\n", token);
+      continue;
+    }
+
+    for (corpus_kind k = 0; k < CORPUS_KINDS; k++) {
+      const char *name = corpus_name(k);
+      if (kinds && !strstr(kinds, name))
+        continue;
+
+      image_t *source = corpus_generate(k, size, size);
+      if (!source) {
+        fprintf(stderr, "failed to generate %s %u\n", name, size);
+        continue;
+      }
+
+      bench_image(source, name);
+      image_free(source);
+    }
+  }
+  free(list);
+
+  if (options.out != stdout)
+    fclose(options.out);
+
+  return 0;
+}
@@ -9,6 +9,7 @@ extern "C" {
  * @brief C/C++ Image Manipulation Library
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 // Uncompressed R-G-B-A (channel dependent) Image
@@ -30,23 +31,103 @@ image_t *image_allocate(uint32_t width, uint32_t height, uint32_t channels);
 // Free Image
 void image_free(image_t *image);
 
-// Resize image to desired size
+// Resize image to desired size (and convert between 1-4 channels)
 void image_resize(image_t *image, uint32_t width, uint32_t height,
                   uint32_t channels);
 
-// Rotate image by amount * 90 degrees
+// Edge of the square tiles that rotations and frame sequences work in
+#define IMAGE_TILE 64
+
+// Rotate image by amount * 90 degrees (clockwise)
 void image_rotate(image_t *image, int amount);
 
 // TODO copy, resize, crop, rotate, etc
 
+//////////////////////////////// Shared Memory
+
+// Allocate Image with its pixels in a memfd (after a small header), for
+// other processes to map without a copy (Linux); free with image_free.
+// The size & channels are fixed: rotations & resizes that would change them
+// fail, others write the result back to the shared memory
+image_t *image_allocate_shared(uint32_t width, uint32_t height,
+                               uint32_t channels);
+
+// File descriptor to send to another process (-1 when image is not shared)
+int image_shared_fd(image_t image);
+
+// Map an image shared by another process (fd stays owned by the caller),
+// pixels are the same memory; free with image_free
+image_t *image_map_shared(int fd);
+
+//////////////////////////////// Palettes
+
+// Dithering of quantized images
+typedef enum {
+  IMAGE_DITHER_NONE,
+  IMAGE_DITHER_ORDERED,   // 8x8 Bayer matrix
+  IMAGE_DITHER_DIFFUSION, // Floyd-Steinberg
+} image_dither_t;
+
+// Palette image, one index byte per pixel
+typedef struct {
+  uint32_t width, height;
+  uint16_t colors;               // palette entries in use
+  unsigned char palette[256][4]; // R-G-B-A (R = G = B for gray images)
+
+  unsigned char *data;
+} image_indexed_t;
+
+// Reduce image to a palette of at most colors (2-256) entries, from median
+// cut & k-means on a sampled histogram
+image_indexed_t *image_quantize(image_t image, uint32_t colors,
+                                image_dither_t dither);
+
+// Free Indexed Image
+void image_indexed_free(image_indexed_t *indexed);
+
 //////////////////////////////// File I/O
 
+// ---- Any
+
+// Load Image (format picked by file extension)
+image_t *image_load(const char *path);
+
+// Load Image at 1/scale resolution (format picked by file extension)
+image_t *image_load_scaled(const char *path, uint8_t scale);
+
+// Size of the image a file decodes to, from its header only (format picked
+// by signature); palette PNGs count as RGBA
+int image_info(const char *path, uint32_t *width, uint32_t *height,
+               uint8_t *channels);
+
+// Save Image (format picked by file extension)
+int image_save(image_t image, const char *path);
+
+// Decode Image from memory (format picked by signature) at 1/scale resolution
+image_t *image_decode(const void *data, size_t size, uint8_t scale);
+
+// Save Indexed Image as 8 bit BMP or PNG (format picked by file extension)
+int image_save_indexed(const image_indexed_t *image, const char *path);
+
+// Load many Images at once (reads are batched through io_uring on Linux and
+// decoded in parallel, the calling thread decoding too, so it can be used
+// from inside executor tasks); images[i] is NULL when paths[i] failed,
+// returns the number loaded
+int image_load_batch(const char *const *paths, size_t count, image_t **images,
+                     uint8_t scale);
+
 // ---- QOI
 
 // Load QOI Image
 image_t *image_load_qoi(const char *path);
 
-// Save QOI Image
+// Load QOI Image at 1/scale resolution (scale = 1, 2, 4 or 8)
+image_t *image_load_qoi_scaled(const char *path, uint8_t scale);
+
+// Decode QOI Image from memory at 1/scale resolution
+image_t *image_decode_qoi(const void *data, size_t size, uint8_t scale);
+
+// Save QOI Image (gray is stored as RGB, gray-alpha as RGBA)
 int image_save_qoi(image_t image, const char *path);
 
 // ---- BMP
@@ -54,9 +135,18 @@ int image_save_qoi(image_t image, const char *path);
 // Load BMP Image
 image_t *image_load_bmp(const char *path);
 
+// Load BMP Image at 1/scale resolution (scale = 1, 2, 4 or 8)
+image_t *image_load_bmp_scaled(const char *path, uint8_t scale);
+
+// Decode BMP Image from memory at 1/scale resolution
+image_t *image_decode_bmp(const void *data, size_t size, uint8_t scale);
+
 // Save BMP Image
 int image_save_bmp(image_t image, const char *path);
 
+// Save Indexed Image as 8 bit BMP (alpha composited onto black)
+int image_save_bmp_indexed(const image_indexed_t *image, const char *path);
+
 // ---- TIFF
 
 // Load a batch of TIFF Images (one file may contain multiple images)
@@ -65,8 +155,109 @@ int image_load_tiff_batch(image_t **image, const char *path);
 // Load TIFF Image
 image_t *image_load_tiff(const char *path);
 
-// image_t *image_load_png(const char *path);
-// TODO png, jpg, qoi
+// Load TIFF Image at 1/scale resolution (scale = 1, 2, 4 or 8)
+image_t *image_load_tiff_scaled(const char *path, uint8_t scale);
+
+// Decode TIFF Image from memory at 1/scale resolution
+image_t *image_decode_tiff(const void *data, size_t size, uint8_t scale);
+
+// Save TIFF Image (uncompressed)
+int image_save_tiff(image_t image, const char *path);
+
+// ---- PNG
+
+// Load PNG Image
+image_t *image_load_png(const char *path);
+
+// Load PNG Image at 1/scale resolution (scale = 1, 2, 4 or 8)
+image_t *image_load_png_scaled(const char *path, uint8_t scale);
+
+// Decode PNG Image from memory at 1/scale resolution
+image_t *image_decode_png(const void *data, size_t size, uint8_t scale);
+
+// Save PNG Image
+int image_save_png(image_t image, const char *path);
+
+// Save Indexed Image as 8 bit palette PNG
+int image_save_png_indexed(const image_indexed_t *image, const char *path);
+
+// TODO jpg
+
+// ---- Frame Sequences
+
+// Same-size frames in one file, cut into IMAGE_TILE square tiles coded with
+// QOI chunks: keyframes code every tile, the frames between them only the
+// tiles changed since the previous frame, as differences to it
+typedef struct image_sequence_writer image_sequence_writer_t;
+typedef struct image_sequence image_sequence_t;
+
+// Create Frame Sequence, with a keyframe every keyframes frames (0 for only
+// the first one)
+image_sequence_writer_t *image_sequence_create(const char *path,
+                                               uint32_t width, uint32_t height,
+                                               uint8_t channels,
+                                               uint32_t keyframes);
+
+// Append frame (of the sequence size & channels)
+int image_sequence_append(image_sequence_writer_t *writer, image_t frame);
+
+// Write the frame index & close the file (writer is freed either way)
+int image_sequence_finish(image_sequence_writer_t *writer);
+
+// Open Frame Sequence (the index of an unfinished one is rebuilt)
+image_sequence_t *image_sequence_open(const char *path);
+
+// Number of frames
+uint32_t image_sequence_count(const image_sequence_t *sequence);
+
+// Decode frame index, from its keyframe or on from the frame decoded last
+// when that is closer; the image belongs to the sequence & changes on the
+// next call (NULL on failure)
+const image_t *image_sequence_frame(image_sequence_t *sequence,
+                                    uint32_t index);
+
+// Tiles the last image_sequence_frame call changed, one byte per tile (in
+// row-major order), to redraw only those
+const uint8_t *image_sequence_changed(const image_sequence_t *sequence);
+
+// Close & free Frame Sequence
+void image_sequence_free(image_sequence_t *sequence);
+
+//////////////////////////////// Decode Cache
+
+// Decoded images by path, file identity (device, inode, modification time
+// & size, so a changed file decodes again) & variant
+typedef struct image_cache image_cache_t;
+
+typedef struct {
+  uint64_t hits;      // loads copied from memory
+  uint64_t disk_hits; // read back from the directory
+  uint64_t misses;    // decoded
+  uint64_t evictions;
+  size_t entries, bytes; // in memory (pixel bytes)
+} image_cache_stats_t;
+
+// Create Cache keeping up to budget bytes of pixels in memory (least
+// recently used ones dropped first); with a directory, decoded images are
+// also stored there as raw pixels (or QOI chunks when compress) & mapped
+// instead of decoded, the directory is never trimmed
+image_cache_t *image_cache_create(size_t budget, const char *directory,
+                                  int compress);
+
+// Free Cache
+void image_cache_free(image_cache_t *cache);
+
+// Load Image at 1/scale resolution through the cache, concurrent loads of
+// one key wait for a single decode (the image is the caller's copy)
+image_t *image_cache_load(image_cache_t *cache, const char *path,
+                          uint8_t scale);
+
+// Load Image reduced to fit size x size through the cache
+image_t *image_cache_thumbnail(image_cache_t *cache, const char *path,
+                               uint32_t size);
+
+// Counters since the cache was created
+void image_cache_stats(image_cache_t *cache, image_cache_stats_t *stats);
 
 //////////////////////////////// Drawing
 
@@ -74,6 +265,9 @@ image_t *image_load_tiff(const char *path);
 void image_draw_fill(image_t image, const unsigned char *color,
                      uint8_t channels);
 
+// Draw src at x, y (blended when src is R-G-B-A, copied when channels match)
+void image_draw_blend(image_t image, image_t src, int x, int y);
+
 // Draw Pixel
 // void image_draw_pixel(image_t image, int x, int y, int size);
 
@@ -83,8 +277,309 @@ void image_draw_fill(image_t image, const unsigned char *color,
 // void image_draw_rect_center(image_t image, int x, int y, int w, int h,
 // const unsigned char *color, uint8_t channels);
 
+// Font of same-size glyphs for consecutive code points
+typedef struct image_font image_font_t;
+
+// Text to draw, top left of its first glyph at x, y; lines break at '\n'
+typedef struct {
+  const char *text; // UTF-8
+  int x, y;
+  unsigned char color[4]; // R-G-B-A
+  uint8_t scale;          // glyph pixels are scale x scale (1-16)
+} image_text_t;
+
+// Built-in 8x8 ASCII font (not to be freed)
+image_font_t *image_font_default(void);
+
+// Font from 1 bit glyphs, rows of (width + 7) / 8 bytes with the leftmost
+// pixel in the lowest bit, glyph after glyph from code point first on
+image_font_t *image_font_bitmap(const uint8_t *bits, uint32_t width,
+                                uint32_t height, uint32_t first,
+                                uint32_t count);
+
+// Font from a sheet of pre-rasterized glyphs, a row-major grid of width x
+// height cells from code point first on, coverage from the alpha channel
+// (or the first one without alpha)
+image_font_t *image_font_sheet(image_t sheet, uint32_t width, uint32_t height,
+                               uint32_t first, uint32_t count);
+
+// Free Font
+void image_font_free(image_font_t *font);
+
+// Size of text in pixels at scale
+void image_text_size(const image_font_t *font, const char *text,
+                     uint8_t scale, uint32_t *width, uint32_t *height);
+
+// Draw count texts onto an RGB(A) image in one pass, each glyph rendered
+// once per color & scale & kept with the font (code points the font lacks
+// are left blank)
+int image_draw_text(image_t image, image_font_t *font,
+                    const image_text_t *texts, size_t count);
+
 // TODO rendering, etc
 
+//////////////////////////////// Filtering
+
+// Convolve with a separable kernel, horizontal then vertical weights (odd
+// sizes up to 255, edges repeat); 3 and 5 taps take a fast path
+int image_convolve(image_t image, const float *horizontal, uint32_t h_size,
+                   const float *vertical, uint32_t v_size);
+
+// Average of the (2 * radius + 1)^2 pixels around each one, same cost for
+// any radius
+int image_blur_box(image_t image, uint32_t radius);
+
+// Gaussian blur (exact kernel of up to 13 taps up to sigma 2, three box
+// blurs above)
+int image_blur_gaussian(image_t image, float sigma);
+
+// Unsharp mask: add amount times the difference to the Gaussian blurred
+// image, where it is at least threshold
+int image_sharpen(image_t image, float sigma, float amount,
+                  uint8_t threshold);
+
+//////////////////////////////// Tone Curves
+
+// Channel masks of the operations below
+#define IMAGE_LUT_COLOR 0x7 // R-G-B (gray images use R)
+#define IMAGE_LUT_ALPHA 0x8
+#define IMAGE_LUT_ALL 0xF
+
+// R-G-B-A lookup tables; operations compose onto them, so a whole chain is
+// applied to the image in one pass
+typedef struct {
+  unsigned char tables[4][256];
+} image_lut_t;
+
+// Reset LUT to leave every value as is
+void image_lut_identity(image_lut_t *lut);
+
+// Follow the channels (mask, bit c for table c) of LUT with table
+int image_lut_map(image_lut_t *lut, uint8_t channels,
+                  const unsigned char table[256]);
+
+// Stretch in_black to in_white onto out_black to out_white, with gamma on
+// the midtones (1 -> linear, above 1 brightens)
+int image_lut_levels(image_lut_t *lut, uint8_t channels, uint8_t in_black,
+                     uint8_t in_white, float gamma, uint8_t out_black,
+                     uint8_t out_white);
+
+// Gamma correction, v^(1 / gamma) on 0-1 (above 1 brightens)
+int image_lut_gamma(image_lut_t *lut, uint8_t channels, float gamma);
+
+// Scale around the middle by contrast (1 -> as is), then add brightness
+// (-255 to 255)
+int image_lut_brightness_contrast(image_lut_t *lut, uint8_t channels,
+                                  float brightness, float contrast);
+
+// Smooth curve through count (2-256) points {in, out}, ins increasing; it
+// keeps monotone where the points are and is flat past the ends
+int image_lut_curve(image_lut_t *lut, uint8_t channels,
+                    const uint8_t (*points)[2], uint32_t count);
+
+// Map every pixel of image through LUT
+int image_lut_apply(image_t image, const image_lut_t *lut);
+
+//////////////////////////////// Pyramids
+
+// Reduction from one level to the next
+typedef enum {
+  IMAGE_PYRAMID_BOX,  // 2x2 average
+  IMAGE_PYRAMID_TENT, // 4x4 tent (1 3 3 1), smoother
+} image_pyramid_filter_t;
+
+// Successive half resolution levels (sizes rounded up), in one allocation
+typedef struct {
+  uint32_t count;
+  image_t *levels; // levels[0] is half the source size
+} image_pyramid_t;
+
+// Build levels (0 -> down to 1x1) in a single pass over the image rows
+image_pyramid_t *image_build_pyramid(image_t image, uint32_t levels,
+                                     image_pyramid_filter_t filter);
+
+// Free Pyramid
+void image_pyramid_free(image_pyramid_t *pyramid);
+
+// Save every level in parallel as prefix + level number (from 1) + "." +
+// extension, e.g. "tiles/z", "png" -> tiles/z1.png, tiles/z2.png, ...
+int image_save_pyramid(const image_pyramid_t *pyramid, const char *prefix,
+                       const char *extension);
+
+//////////////////////////////// Statistics
+
+// Pixels per value of each channel
+typedef struct {
+  uint64_t counts[4][256];
+} image_histogram_t;
+
+// Per channel summary
+typedef struct {
+  uint8_t min[4], max[4];
+  double mean[4], stddev[4];
+} image_statistics_t;
+
+// Count the values of every channel
+int image_histogram(image_t image, image_histogram_t *histogram);
+
+// Minimum, maximum, mean & standard deviation of every channel
+int image_statistics(image_t image, image_statistics_t *statistics);
+
+// Mean squared error between two images of the same size over all channels,
+// and the PSNR in dB (INFINITY when equal); either output may be NULL
+int image_mse(image_t a, image_t b, double *mse, double *psnr);
+
+// Mean SSIM of 8x8 windows (every 4 pixels) over all channels, the images
+// being the same size and at least 8x8
+int image_ssim(image_t a, image_t b, double *ssim);
+
+//////////////////////////////// Perceptual Hashing
+
+// 64 bit hashes of the image reduced to gray, bit y * 8 + x for cell x, y of
+// an 8x8 grid
+typedef enum {
+  IMAGE_HASH_AVERAGE,    // cell brighter than the mean (aHash)
+  IMAGE_HASH_DIFFERENCE, // cell brighter than its right neighbour (dHash)
+  IMAGE_HASH_DCT,        // frequency above the median of the lowest 64
+                         // after DC, of a 32x32 DCT (pHash)
+} image_hash_t;
+
+// Hash Image
+int image_hash(image_t image, image_hash_t type, uint64_t *hash);
+
+// Hash encoded Image, decoded at the lowest resolution that still covers the
+// hash (format picked by signature)
+int image_hash_decode(const void *data, size_t size, image_hash_t type,
+                      uint64_t *hash);
+
+// Bits that differ between two hashes
+uint32_t image_hash_distance(uint64_t a, uint64_t b);
+
+// Near-duplicate index of hashes (multi-index hashing: every 16 bit quarter
+// of a hash keys its own table); adds must not overlap other calls, finds
+// may run concurrently
+typedef struct image_hash_index image_hash_index_t;
+
+// Create empty Hash Index
+image_hash_index_t *image_hash_index_create(void);
+
+// Free Hash Index
+void image_hash_index_free(image_hash_index_t *index);
+
+// Add hash under id (ids need not be unique)
+int image_hash_index_add(image_hash_index_t *index, uint64_t hash,
+                         uint64_t id);
+
+// Number of hashes added
+size_t image_hash_index_count(const image_hash_index_t *index);
+
+// Ids of up to max hashes within radius differing bits of hash, returns the
+// number written to ids
+size_t image_hash_index_find(const image_hash_index_t *index, uint64_t hash,
+                             uint32_t radius, uint64_t *ids, size_t max);
+
+//////////////////////////////// Instrumentation
+
+// Stages timed by the instrumentation (exclusive, nested stages are not
+// counted in the enclosing one)
+typedef enum {
+  IMAGE_STAGE_HEADER,   // header / metadata parsing
+  IMAGE_STAGE_READ,     // read syscalls
+  IMAGE_STAGE_DECODE,   // entropy decoding (raw row reads for BMP / TIFF)
+  IMAGE_STAGE_UNFILTER, // PNG scanline unfiltering
+  IMAGE_STAGE_CONVERT,  // pixel conversion, scaling, resize, rotate, filters
+  IMAGE_STAGE_ENCODE,   // filtering & entropy encoding
+  IMAGE_STAGE_WRITE,    // write syscalls
+  IMAGE_STAGES
+} image_stage_t;
+
+// Counters of one call (or the sum of a thread's calls)
+typedef struct {
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t bytes_read, bytes_written;
+  uint64_t syscalls; // file I/O (glibc & batch loading only)
+  uint64_t alloc_bytes;
+  uint64_t stage_ns[IMAGE_STAGES];
+} image_counters_t;
+
+// Called (on the calling thread) when an outermost library call returns; its
+// counters include the work done for it on the pool's threads (stage times
+// summed over threads)
+typedef void (*image_trace_fn)(const char *call,
+                               const image_counters_t *counters, void *user);
+
+// Name of stage
+const char *image_stage_name(image_stage_t stage);
+
+// Enable instrumentation (disabled by default)
+void image_trace_enable(int enable);
+
+// Set callback (NULL to remove), set before enabling
+void image_trace_callback(image_trace_fn fn, void *user);
+
+// Counters of the calling thread's calls since the last reset
+void image_trace_counters(image_counters_t *out);
+
+// Reset counters of the calling thread
+void image_trace_reset(void);
+
+// Write every call as a Chrome trace-event (chrome://tracing, Perfetto) until
+// closed; enables instrumentation
+int image_trace_open(const char *path);
+
+// Finish the trace file
+void image_trace_close(void);
+
+//////////////////////////////// CPU Dispatch
+
+// Instruction set level of the pixel kernels
+typedef enum {
+  IMAGE_CPU_SCALAR, // reference implementation
+  IMAGE_CPU_SSE41,
+  IMAGE_CPU_AVX2,
+  IMAGE_CPU_AVX512, // F & BW
+} image_cpu_t;
+
+// Name of level
+const char *image_cpu_name(image_cpu_t cpu);
+
+// Level in use (best detected at startup unless forced at build time)
+image_cpu_t image_cpu_level(void);
+
+// Use level (at most the best supported, returned); not thread safe, select
+// before other threads use the library
+image_cpu_t image_cpu_select(image_cpu_t cpu);
+
+//////////////////////////////// Threading
+
+// Process rows y0 to y1 (exclusive) of image
+typedef void (*image_band_fn)(image_t image, uint32_t y0, uint32_t y1,
+                              void *user);
+
+// Unit of work handed to an executor
+typedef void (*image_task_fn)(void *arg);
+
+// Run task(arg) eventually, on any thread (or right away on the caller)
+typedef void (*image_executor_fn)(image_task_fn task, void *arg, void *user);
+
+// Threads the library may use, including the calling one (0 -> one per core,
+// the default; 1 -> calling thread only); set while no calls are running
+void image_parallel_threads(unsigned threads);
+
+// Threads in use (resolved)
+unsigned image_parallel_count(void);
+
+// Run work on the host application's executor instead of the internal pool
+// (NULL to restore); set while no calls are running
+void image_parallel_executor(image_executor_fn submit, void *user);
+
+// Split image into bands of band_height rows (0 -> picked from the image
+// size) and run fn on each, returns once all finished; the calling thread
+// works on bands too, so it can be used from inside executor tasks
+int image_parallel_for(image_t image, uint32_t band_height, image_band_fn fn,
+                       void *user);
+
 #ifdef __cplusplus
 }
 #endif
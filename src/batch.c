@@ -0,0 +1,460 @@
+/**
+ * @brief Batch Loading
+ *
+ * Reads for many files are in flight at once (through io_uring on Linux,
+ * blocking pread elsewhere) into a fixed set of pooled buffers; every
+ * completed buffer is decoded by a pool task, or by the caller while it
+ * waits, and recycled after.
+ */
+
+#include "parallel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Reads in flight (and buffers in the pool)
+#define QUEUE_DEPTH 32
+
+typedef struct {
+  struct batch *batch;
+  int fd;
+  size_t index; // into paths / images
+  uc *data;
+  size_t capacity, size, done;
+  int reading;
+} slot_t;
+
+#ifdef __linux__
+// Minimal io_uring (raw syscalls, no liburing)
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned queued; // prepared but not yet submitted
+} ring_t;
+
+static void ring_free(ring_t *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr)
+    munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+
+static int ring_init(ring_t *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+
+  struct io_uring_params p = {};
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  trace_syscalls(1);
+  if (ring->fd < 0)
+    return 1;
+
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    ring_free(ring);
+    return 1;
+  }
+
+  ring->cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP
+                     ? ring->sq_ptr
+                     : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+  if (ring->cq_ptr == MAP_FAILED) {
+    ring->cq_ptr = NULL;
+    ring_free(ring);
+    return 1;
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    ring_free(ring);
+    return 1;
+  }
+
+  trace_syscalls(p.features & IORING_FEAT_SINGLE_MMAP ? 2 : 3); // mmaps
+
+  uc *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+// Queue read of the rest of a slot's file
+static void ring_read(ring_t *ring, slot_t *slot) {
+  unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->addr = (u64)(uintptr_t)&slot->data[slot->done];
+  sqe->len = slot->size - slot->done;
+  sqe->off = slot->done;
+  sqe->user_data = (u64)(uintptr_t)slot;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+}
+
+// Submit queued reads and wait for at least one completion
+static int ring_wait(ring_t *ring) {
+  int result;
+  trace_begin(IMAGE_STAGE_READ);
+  do {
+    result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    trace_syscalls(1);
+  } while (result < 0 && errno == EINTR);
+  trace_end();
+
+  if (result >= 0)
+    ring->queued -= result < (int)ring->queued ? result : ring->queued;
+
+  return result < 0;
+}
+
+// Next completion (0 when empty)
+static int ring_reap(ring_t *ring, slot_t **slot, int *res) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  *slot = (slot_t *)(uintptr_t)cqe->user_data;
+  *res = cqe->res;
+
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+#endif
+
+// Shared between the reading (calling) thread and the decoding tasks, freed
+// by whichever of them is last
+typedef struct batch {
+  const char *const *paths;
+  image_t **images;
+  size_t count;
+  u8 scale;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  slot_t slots[QUEUE_DEPTH];
+  slot_t *free[QUEUE_DEPTH]; // recycled buffers
+  unsigned free_count;
+  slot_t *ready[QUEUE_DEPTH]; // read, not yet claimed for decoding
+  unsigned ready_count;
+
+  size_t finished;
+  u32 refs; // the caller & decode tasks not yet run
+
+  trace_share_t trace; // counters of the decode tasks
+} batch_t;
+
+static void batch_release(batch_t *b) {
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  pthread_mutex_destroy(&b->lock);
+  pthread_cond_destroy(&b->changed);
+  free(b);
+}
+
+static void slot_decode(slot_t *slot) {
+  batch_t *b = slot->batch;
+
+  trace_task_t task = trace_task_begin(&b->trace);
+  image_t *image = image_decode(slot->data, slot->size, b->scale);
+  trace_task_end(&b->trace, &task);
+
+  pthread_mutex_lock(&b->lock);
+  b->images[slot->index] = image;
+  b->free[b->free_count++] = slot;
+  b->finished++;
+  pthread_cond_broadcast(&b->changed);
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Open the slot's file (sizing its buffer), 1 if it failed
+static int slot_open(batch_t *b, slot_t *slot) {
+  slot->done = 0;
+
+  slot->fd = open(b->paths[slot->index], O_RDONLY);
+  trace_syscalls(2); // open & fstat (close is counted when done)
+  HANDLE(slot->fd >= 0, "no such file", return 1);
+
+  struct stat st;
+  HANDLE(!fstat(slot->fd, &st) && st.st_size > 0, "failed to stat file", {
+    close(slot->fd);
+    return 1;
+  });
+
+  slot->size = st.st_size;
+  if (slot->size > slot->capacity) {
+    uc *data = realloc(slot->data, slot->size);
+    HANDLE(data, "failed to allocate read buffer", {
+      close(slot->fd);
+      return 1;
+    });
+    trace_alloc(slot->size - slot->capacity);
+    slot->data = data, slot->capacity = slot->size;
+  }
+
+  return 0;
+}
+
+// Claim & decode a read slot, 0 when there was none (batch locked, unlocked
+// while decoding)
+static int decode_next(batch_t *b) {
+  if (!b->ready_count)
+    return 0;
+
+  slot_t *slot = b->ready[--b->ready_count];
+  pthread_mutex_unlock(&b->lock);
+  slot_decode(slot);
+  pthread_mutex_lock(&b->lock);
+  return 1;
+}
+
+static void decode_task(void *arg) {
+  batch_t *b = arg;
+
+  pthread_mutex_lock(&b->lock);
+  decode_next(b);
+  pthread_mutex_unlock(&b->lock);
+
+  batch_release(b);
+}
+
+// Queue a fully read slot for a decode task (or the caller, whichever
+// claims it first)
+static void slot_ready(slot_t *slot) {
+  batch_t *b = slot->batch;
+  close(slot->fd);
+  trace_syscalls(1);
+  slot->reading = 0;
+
+  pthread_mutex_lock(&b->lock);
+  b->ready[b->ready_count++] = slot;
+  pthread_mutex_unlock(&b->lock);
+
+  __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+  parallel_submit(decode_task, b);
+}
+
+// Record a file that could not be read
+static void slot_failed(batch_t *b, slot_t *slot) {
+  if (slot->reading) {
+    close(slot->fd);
+    trace_syscalls(1);
+  }
+  slot->reading = 0;
+
+  pthread_mutex_lock(&b->lock);
+  b->images[slot->index] = NULL;
+  b->free[b->free_count++] = slot;
+  b->finished++;
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Read the rest of the slot's file with blocking reads, then hand it on
+static void slot_read(batch_t *b, slot_t *slot) {
+  trace_begin(IMAGE_STAGE_READ);
+  while (slot->done < slot->size) {
+    ssize_t n = pread(slot->fd, &slot->data[slot->done],
+                      slot->size - slot->done, slot->done);
+    trace_syscalls(1);
+    if (n <= 0)
+      break;
+    slot->done += n;
+    trace_read(n);
+  }
+  trace_end();
+
+  if (slot->done == slot->size)
+    slot_ready(slot);
+  else
+    slot_failed(b, slot);
+}
+
+int image_load_batch(const char *const *paths, size_t count, image_t **images,
+                     uint8_t scale) {
+  TRACE_CALL();
+  HANDLE(paths && images, "invalid value(s)", return 0);
+  if (count == 0)
+    return 0;
+
+  batch_t *b = calloc(1, sizeof(batch_t));
+  HANDLE(b, "failed to allocate batch", return 0);
+
+  *b = (batch_t){paths, images, count, scale};
+  b->refs = 1;
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->changed, NULL);
+  trace_share_begin(&b->trace);
+
+  slot_t *slots = b->slots;
+  for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+    slots[i].batch = b;
+    b->free[b->free_count++] = &slots[i];
+  }
+
+#ifdef __linux__
+  ring_t ring;
+  int uring = !ring_init(&ring, QUEUE_DEPTH);
+  if (!uring)
+    WARNING("io_uring unavailable, reading with pread");
+#else
+  int uring = 0;
+#endif
+
+  size_t next = 0;   // next file to open
+  unsigned busy = 0; // reads in flight
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+
+    // wait for a buffer when nothing is left to reap, decoding meanwhile
+    // (decode tasks may be queued behind this call on the same threads)
+    while (!b->free_count && !busy && next < count)
+      if (!decode_next(b))
+        pthread_cond_wait(&b->changed, &b->lock);
+
+    if (next == count && !busy) {
+      while (b->finished < count)
+        if (!decode_next(b))
+          pthread_cond_wait(&b->changed, &b->lock);
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+
+    // Start reads into every free buffer
+    slot_t *start[QUEUE_DEPTH];
+    unsigned starting = 0;
+    while (b->free_count && next < count) {
+      start[starting] = b->free[--b->free_count];
+      start[starting++]->index = next++;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    for (unsigned i = 0; i < starting; i++) {
+      slot_t *slot = start[i];
+      if (slot_open(b, slot)) {
+        slot_failed(b, slot);
+        continue;
+      }
+      slot->reading = 1;
+
+#ifdef __linux__
+      if (uring) {
+        ring_read(&ring, slot);
+        busy++;
+        continue;
+      }
+#endif
+
+      slot_read(b, slot); // blocking fallback
+    }
+
+#ifdef __linux__
+    if (!uring || !busy)
+      continue;
+
+    // Submit & reap completions; on failure, the reads in flight are done
+    // again from the start with pread (as are all later ones)
+    HANDLE(!ring_wait(&ring), "failed to wait for reads", {
+      ring_free(&ring);
+      uring = 0;
+      busy = 0;
+
+      for (unsigned i = 0; i < QUEUE_DEPTH; i++)
+        if (slots[i].reading) {
+          slots[i].done = 0;
+          slot_read(b, &slots[i]);
+        }
+      continue;
+    });
+
+    slot_t *slot;
+    int res;
+    while (ring_reap(&ring, &slot, &res)) {
+      busy--;
+
+      if (res <= 0) {
+        ERROR("failed to read file");
+        slot_failed(b, slot);
+        continue;
+      }
+
+      trace_read(res);
+      if ((slot->done += res) < slot->size) {
+        ring_read(&ring, slot); // short read, queue the rest
+        busy++;
+      } else {
+        slot_ready(slot);
+      }
+    }
+#endif
+  }
+
+#ifdef __linux__
+  if (uring)
+    ring_free(&ring);
+#endif
+
+  for (unsigned i = 0; i < QUEUE_DEPTH; i++)
+    free(slots[i].data);
+
+  trace_share_end(&b->trace);
+  batch_release(b);
+
+  int loaded = 0;
+  for (size_t i = 0; i < count; i++)
+    loaded += images[i] != NULL;
+
+  return loaded;
+}
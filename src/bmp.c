@@ -2,14 +2,45 @@
  * @brief BMP Loading & Saving
  */
 
+#include "kernel.h"
+#include "reader.h"
+#include "scale.h"
+#include "trace.h"
 #include "util.h"
 #include <image.h>
 
+#include <malloc.h>
 #include <string.h>
 
+// Largest row accepted from a file (keeps sizes of crafted files sane)
+#define MAX_STRIDE (1u << 28)
+
 image_t *image_load_bmp(const char *path) {
-  FILE *f = fopen(path, "rb");
-  HANDLE(f, "no such file", return NULL);
+  TRACE_CALL();
+  return image_load_bmp_scaled(path, 1);
+}
+
+// Swap rows of bottom-up images
+static int flip_rows(image_t *image) {
+  size_t stride = (size_t)image->width * image->channels;
+  uc *tmp = malloc(stride);
+  HANDLE(tmp, "failed to allocate row", return 1);
+
+  for (u32 y = 0; y < image->height / 2; y++) {
+    uc *a = &image->data[y * stride];
+    uc *b = &image->data[(image->height - 1 - y) * stride];
+    memcpy(tmp, a, stride);
+    memcpy(a, b, stride);
+    memcpy(b, tmp, stride);
+  }
+
+  free(tmp);
+  return 0;
+}
+
+static image_t *bmp_decode(reader_t *r, u8 scale) {
+  HANDLE(scaler_valid(scale), "scale must be 1, 2, 4 or 8", return NULL);
+  trace_begin(IMAGE_STAGE_HEADER);
 
   // Read File Header
   struct {
@@ -19,34 +50,26 @@ image_t *image_load_bmp(const char *path) {
   } header;
 
   unsigned char header_raw[14];
-  HANDLE(fread(&header_raw, 14, 1, f), "failed to read header", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(reader_read(r, &header_raw, 14, 1), "failed to read header",
+         return NULL);
 
   memcpy(header.signature, header_raw, 2);
   memcpy(&header.size, &header_raw[0x02], 4);
   memcpy(&header.data, &header_raw[0x0A], 4);
 
-  HANDLE(!strncasecmp(header.signature, "BM", 2), "invalid signature", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(!strncasecmp(header.signature, "BM", 2), "invalid signature",
+         return NULL);
 
   // Read DIB Header
   uint32_t dibsize = 0;
-  HANDLE(fread(&dibsize, 4, 1, f), "failed to read DIB Header Size", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(reader_read(r, &dibsize, 4, 1), "failed to read DIB Header Size",
+         return NULL);
 
-  HANDLE(dibsize == 40, "unsupported BID Header", {
-    fclose(f);
-    return NULL;
-  });
+  // V4/V5 headers extend the 40 byte one
+  HANDLE(dibsize >= 40, "unsupported BID Header", return NULL);
 
   struct {
-    uint32_t width, height;
+    int32_t width, height; // negative height -> top-down
     uint16_t planes;
     uint16_t bpp; // bits per pixel
     uint32_t compression;
@@ -56,108 +79,138 @@ image_t *image_load_bmp(const char *path) {
     uint32_t importantColors;
   } info;
 
-  HANDLE(fread(&info, 36, 1, f), "failed to read BID Header", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(reader_read(r, &info, 36, 1), "failed to read BID Header",
+         return NULL);
 
   // Check Static Values
-  HANDLE(info.width != 0 && info.height != 0 && info.planes == 1,
-         "invalid image size", {
-           fclose(f);
-           return NULL;
-         });
+  HANDLE(info.width > 0 && info.height != 0 && info.planes == 1,
+         "invalid image size", return NULL);
 
-  HANDLE(info.compression == 0, "compression is not supported", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(info.compression == 0, "compression is not supported", return NULL);
 
-  info.size = info.width * info.height;
+  HANDLE(info.bpp == 4 || info.bpp == 8 || info.bpp == 24 || info.bpp == 32,
+         "BPP not yet supported", return NULL);
 
-  // Create Image
-  image_t *out = image_allocate(info.width, info.height, 3);
+  int bottom_up = info.height > 0;
+  u32 width = info.width, height = bottom_up ? info.height : -info.height;
+  u64 stride = ((u64)width * info.bpp + 31) / 32 * 4; // rows are 4 byte aligned
+  HANDLE(stride <= MAX_STRIDE, "image too wide", return NULL);
 
-  HANDLE(out, "failed to create image", {
-    fclose(f);
-    return NULL;
-  });
+  // Read Palette (B-G-R-X entries, right after the DIB header)
+  uc palette[256][4] = {};
+  if (info.bpp <= 8) {
+    u32 colors = info.colorsUsed ? info.colorsUsed : 1u << info.bpp;
+    HANDLE(colors <= 1u << info.bpp, "invalid palette size", return NULL);
 
-  // Read Image Data
-  if (info.bpp == 4 || info.bpp == 8) {
-    // Read Palette
-    HANDLE(info.colorsUsed == 0, "invalid palette size", {
-      image_free(out);
-      fclose(f);
-      return NULL;
-    });
-
-    unsigned char palette[info.colorsUsed * 4];
-    int read = fread(palette, sizeof(*palette), info.colorsUsed, f);
-    HANDLE(read != info.colorsUsed, "failed to read palette", {
-      image_free(out);
-      fclose(f);
-      return NULL;
-    });
+    reader_seek(r, 14 + dibsize, SEEK_SET);
+    HANDLE(reader_read(r, palette, 4, colors) == colors,
+           "failed to read palette", return NULL);
+  }
 
-    if (ftell(f) != header.data) {
+  if (reader_tell(r) != header.data) {
+    if (dibsize == 40 && info.bpp > 8)
       WARNING("cursor does not match data offset");
-      fseek(f, header.data, SEEK_SET);
-    }
-
-    // Read Image Data
-    unsigned char rawID[info.size];
-    HANDLE(fread(rawID, info.size, 1, f), "failed to read image data", {
-      image_free(out);
-      fclose(f);
-      return NULL;
-    });
 
-    for (int i = 0; i < info.size; i++)
-      memcpy(&out->data[i * 3], &palette[rawID[i]], 3);
+    reader_seek(r, header.data, SEEK_SET);
+  }
 
-    fclose(f);
-  } else {
-    // Read Image Data
-    if (ftell(f) != header.data) {
-      WARNING("cursor does not match data offset");
-      printf("%li\n", ftell(f));
-      printf("%i\n", header.data);
+  // Rows are reduced on the fly in top-down order; bottom-up files are read
+  // in file order & flipped at full size, but seek to every row when reduced
+  // (so partial boxes end up at the bottom, as for other formats)
+  int seek = bottom_up && scale > 1;
+  scaler_t s;
+  HANDLE(!scaler_init(&s, width, height, 3, scale),
+         "failed to create image", return NULL);
+  trace_end();
+
+  uc *raw = malloc(stride);
+  HANDLE(raw, "failed to allocate row", {
+    scaler_abort(&s);
+    return NULL;
+  });
 
-      fseek(f, header.data, SEEK_SET);
+  while (!scaler_done(&s)) {
+    trace_begin(IMAGE_STAGE_DECODE);
+    if (seek)
+      reader_seek(r, header.data + (height - 1 - s.y) * stride, SEEK_SET);
+    size_t read = reader_read(r, raw, stride, 1);
+    trace_end();
+    HANDLE(read, "failed to read image data", break);
+
+    trace_begin(IMAGE_STAGE_CONVERT);
+    uc *row = scaler_row(&s);
+    switch (info.bpp) {
+    case 4:
+    case 8:
+      for (u32 x = 0; x < width; x++) {
+        u8 id = info.bpp == 8 ? raw[x] : (raw[x / 2] >> (x % 2 ? 0 : 4)) & 0xF;
+        row[x * 3 + 0] = palette[id][2];
+        row[x * 3 + 1] = palette[id][1];
+        row[x * 3 + 2] = palette[id][0];
+      }
+      break;
+
+    case 24:
+    case 32: // 4th byte is unused without bitfields
+      kernels.swizzle(row, raw, width, info.bpp / 8);
+      break;
     }
 
-    HANDLE(info.bpp == 24, "BPP not yet supported", {
-      image_free(out);
-      fclose(f);
-      return NULL;
-    });
+    scaler_push(&s);
+    trace_end();
+  }
 
-    HANDLE(fread(out->data, info.size * 3, 1, f), "failed to read image data", {
+  free(raw);
+
+  image_t *out = scaler_finish(&s);
+  if (out && bottom_up && !seek) {
+    trace_begin(IMAGE_STAGE_CONVERT);
+    int failed = flip_rows(out);
+    trace_end();
+
+    if (failed) {
       image_free(out);
-      fclose(f);
       return NULL;
-    });
-
-    fclose(f);
+    }
   }
 
   return out;
 }
 
-// TODO works with 3 channels; otherwise breaks
+image_t *image_load_bmp_scaled(const char *path, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  HANDLE(!reader_open(&r, path), "no such file", return NULL);
+
+  image_t *out = bmp_decode(&r, scale);
+  reader_close(&r);
+
+  return out;
+}
+
+image_t *image_decode_bmp(const void *data, size_t size, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  reader_memory(&r, data, size);
+
+  return bmp_decode(&r, scale);
+}
+
 int image_save_bmp(image_t image, const char *path) {
+  TRACE_CALL();
   HANDLE(image_is_valid(image), "invalid image", return 1);
 
-  FILE *f = fopen(path, "wb");
+  FILE *f = trace_fopen(path, "wb");
   HANDLE(f, "failed to create file", return 1);
 
+  u32 stride = ((image.width * 24 + 31) / 32) * 4; // rows are 4 byte aligned
+
   unsigned char header[14];
   memset(header, 0, 14);
   header[0] = 'B', header[1] = 'M';
-  *(uint32_t *)&header[2] = 0; // write 0, will change later
+  *(uint32_t *)&header[2] = 14 + 40 + stride * image.height; // file size
   *(uint32_t *)&header[6] = 0;
-  *(uint32_t *)&header[10] = 0; // write 0, will change later
+  *(uint32_t *)&header[10] = 14 + 40; // start of image data
 
   HANDLE(fwrite(header, 14, 1, f), "failed to write header", {
     fclose(f);
@@ -168,42 +221,121 @@ int image_save_bmp(image_t image, const char *path) {
   memset(info, 0, 40);
   *(uint32_t *)&info[0] = 40;
   *(uint32_t *)&info[4] = image.width;
-  *(uint32_t *)&info[8] = image.height;
-  *(uint32_t *)&info[12] = 1;                            // 1 plane
-  *(uint32_t *)&info[14] = image.channels >= 3 ? 24 : 1; // bpp
-  *(uint32_t *)&info[16] = 0;                            // no compression
-  *(uint32_t *)&info[20] =
-      image.width * image.height; // image size (can be set to 0)
-  *(uint32_t *)&info[24] = 0;     // xppm
-  *(uint32_t *)&info[28] = 0;     // yppm
-  *(uint32_t *)&info[32] = 0;     // colors used
-  *(uint32_t *)&info[36] = 0;     // important colors
+  *(uint32_t *)&info[8] = image.height; // bottom-up
+  *(uint16_t *)&info[12] = 1;           // 1 plane
+  *(uint16_t *)&info[14] = 24;          // bpp
+  *(uint32_t *)&info[16] = 0;           // no compression
+  *(uint32_t *)&info[20] = stride * image.height; // image size
+  *(uint32_t *)&info[24] = 0;                     // xppm
+  *(uint32_t *)&info[28] = 0;                     // yppm
+  *(uint32_t *)&info[32] = 0;                     // colors used
+  *(uint32_t *)&info[36] = 0;                     // important colors
 
   HANDLE(fwrite(info, 40, 1, f), "failed to write info header", {
     fclose(f);
     return 1;
   });
 
-  uint32_t dataStart = ftell(f); // start of image data
+  // Gray is expanded, alpha is composited onto black
+  u8 ch = image.channels;
+  int gray = ch < 3, alpha = ch == 2 || ch == 4;
+
+  uc *row = calloc(stride, 1);
+  HANDLE(row, "failed to allocate row", {
+    fclose(f);
+    return 1;
+  });
+
+  for (u32 y = image.height; y-- > 0;) {
+    const uc *src = &image.data[(size_t)y * image.width * ch];
+    trace_begin(IMAGE_STAGE_CONVERT);
+
+    if (ch == 3) {
+      kernels.swizzle(row, src, image.width, 3);
+    } else {
+      for (u32 x = 0; x < image.width; x++) {
+        const uc *current = &src[x * ch];
+        u32 a = alpha ? current[ch - 1] : 255;
+
+        row[x * 3 + 0] = current[gray ? 0 : 2] * a / 255;
+        row[x * 3 + 1] = current[gray ? 0 : 1] * a / 255;
+        row[x * 3 + 2] = current[0] * a / 255;
+      }
+    }
+    trace_end();
+
+    HANDLE(fwrite(row, stride, 1, f), "failed to write image data", {
+      free(row);
+      fclose(f);
+      return 1;
+    });
+  }
+
+  free(row);
+  fclose(f);
+
+  return 0;
+}
+
+int image_save_bmp_indexed(const image_indexed_t *image, const char *path) {
+  TRACE_CALL();
+  HANDLE(image && image->colors && image->colors <= 256 && image->width &&
+             image->height && image->data,
+         "invalid image", return 1);
+
+  FILE *f = trace_fopen(path, "wb");
+  HANDLE(f, "failed to create file", return 1);
+
+  u32 stride = (image->width + 3) / 4 * 4; // rows are 4 byte aligned
+  u32 offset = 14 + 40 + image->colors * 4;
 
-  for (int i = 0; i < image.width * image.height; i++) {
-    unsigned char *current =
-        &image.data[image.width * image.height * image.channels -
-                    i * image.channels];
-    unsigned char value[3] = {current[2] * current[3] / 255,
-                              current[1] * current[3] / 255,
-                              current[0] * current[3] / 255};
-    fwrite(&value, 3, 1, f);
+  unsigned char header[14] = {'B', 'M'};
+  *(uint32_t *)&header[2] = offset + stride * image->height; // file size
+  *(uint32_t *)&header[10] = offset; // start of image data
+
+  unsigned char info[40] = {0};
+  *(uint32_t *)&info[0] = 40;
+  *(uint32_t *)&info[4] = image->width;
+  *(uint32_t *)&info[8] = image->height; // bottom-up
+  *(uint16_t *)&info[12] = 1;            // 1 plane
+  *(uint16_t *)&info[14] = 8;            // bpp
+  *(uint32_t *)&info[20] = stride * image->height; // image size
+  *(uint32_t *)&info[32] = image->colors;          // colors used
+
+  // B-G-R-X entries, alpha composited onto black
+  uc palette[256][4] = {};
+  for (u32 i = 0; i < image->colors; i++) {
+    const uc *q = image->palette[i];
+    palette[i][0] = q[2] * q[3] / 255;
+    palette[i][1] = q[1] * q[3] / 255;
+    palette[i][2] = q[0] * q[3] / 255;
   }
 
-  uint32_t fileSize = ftell(f);
+  HANDLE(fwrite(header, 14, 1, f) && fwrite(info, 40, 1, f) &&
+             fwrite(palette, 4, image->colors, f) == image->colors,
+         "failed to write header", {
+           fclose(f);
+           return 1;
+         });
 
-  fseek(f, 2, SEEK_SET);
-  fwrite(&fileSize, 4, 1, f);
-  fseek(f, 10, SEEK_SET);
-  fwrite(&dataStart, 4, 1, f);
+  uc *row = calloc(stride, 1);
+  HANDLE(row, "failed to allocate row", {
+    fclose(f);
+    return 1;
+  });
 
+  for (u32 y = image->height; y-- > 0;) {
+    memcpy(row, &image->data[(size_t)y * image->width], image->width);
+
+    HANDLE(fwrite(row, stride, 1, f), "failed to write image data", {
+      free(row);
+      fclose(f);
+      return 1;
+    });
+  }
+
+  free(row);
   fclose(f);
 
   return 0;
-}
\ No newline at end of file
+}
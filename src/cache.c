@@ -0,0 +1,540 @@
+/**
+ * @brief Decode Cache
+ *
+ * Entries are keyed by path, file identity & variant, in a hash table and
+ * a least recently used list under one lock. The first load of a key adds
+ * it as loading & decodes without the lock, later loads of that key wait
+ * for it. Hits are pinned while their pixels are copied out, so eviction
+ * never frees an image in use; an image over the budget stays in the table
+ * (outside the list) until the loads waiting for it have their copies.
+ *
+ * Directory files: disk_t, the path, then the pixels (or QOI chunks) from
+ * the next multiple of 64 bytes, named by the key hash.
+ */
+
+#include "qoi.h"
+#include "reader.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Buckets of a new table (grows to keep under 2 entries per bucket)
+#define BUCKETS 256
+
+// What a cached image was made from
+typedef struct {
+  u64 device, inode, bytes, mtime; // of the file (mtime in ns)
+  u32 scale, size;                 // 1/scale, or a thumbnail (scale 0)
+} identity_t;
+
+typedef struct entry {
+  struct entry *next;          // in its bucket
+  struct entry *newer, *older; // loaded entries by last use
+
+  u64 hash;
+  char *path;
+  identity_t id;
+
+  image_t *image; // NULL while loading or when loading failed
+  u32 refs;       // loads waiting for or copying the image
+  u8 loading;     // decoded by the first load of the key
+  u8 kept;        // in the list & counted against the budget
+} entry_t;
+
+struct image_cache {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+
+  entry_t **buckets;
+  u32 mask;
+  entry_t *newest, *oldest;
+
+  size_t budget;
+  char *directory;
+  int compress;
+
+  image_cache_stats_t stats;
+};
+
+// Header of a directory file
+typedef struct {
+  char magic[4]; // "imgc"
+  u8 channels, compressed, pad[2];
+  u32 width, height, path, reserved;
+  identity_t id;
+  u64 data; // bytes of pixels or chunks
+} disk_t;
+
+static u64 fnv(u64 hash, const void *data, size_t size) {
+  const uc *p = data;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 0x100000001B3ull;
+  return hash;
+}
+
+static u64 key_hash(const char *path, const identity_t *id) {
+  u64 hash = fnv(0xCBF29CE484222325ull, path, strlen(path));
+  u64 fields[6] = {id->device, id->inode, id->bytes,
+                   id->mtime,  id->scale, id->size};
+  return fnv(hash, fields, sizeof(fields));
+}
+
+static int same_id(const identity_t *a, const identity_t *b) {
+  return a->device == b->device && a->inode == b->inode &&
+         a->bytes == b->bytes && a->mtime == b->mtime &&
+         a->scale == b->scale && a->size == b->size;
+}
+
+static size_t image_bytes(const image_t *image) {
+  return (size_t)image->width * image->height * image->channels;
+}
+
+static image_t *copy(const image_t *image) {
+  image_t *out = image_allocate(image->width, image->height, image->channels);
+  if (out)
+    memcpy(out->data, image->data, image_bytes(image));
+  return out;
+}
+
+//////////////////////////////// Directory
+
+// File of a key (hash as 16 hex digits)
+static void disk_path(char *out, size_t size, const image_cache_t *cache,
+                      u64 hash) {
+  snprintf(out, size, "%s/%016llx.imgc", cache->directory,
+           (unsigned long long)hash);
+}
+
+static image_t *disk_load(const image_cache_t *cache, const char *path,
+                          const identity_t *id, u64 hash) {
+  char name[strlen(cache->directory) + 32];
+  disk_path(name, sizeof(name), cache, hash);
+
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  const uc *map = MAP_FAILED;
+  if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof(disk_t))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  trace_syscalls(3);
+  if (map == MAP_FAILED)
+    return NULL;
+
+// Current Exit Procedure
+#define EXIT                                                                   \
+  {                                                                            \
+    munmap((void *)map, st.st_size);                                           \
+    return NULL;                                                               \
+  }
+
+  // another key with the same hash, or an old file, is a miss
+  disk_t header;
+  memcpy(&header, map, sizeof(disk_t));
+  size_t length = strlen(path), offset = (sizeof(disk_t) + length + 63) & ~63;
+  if (memcmp(header.magic, "imgc", 4) || !same_id(&header.id, id) ||
+      header.path != length || offset > (u64)st.st_size ||
+      memcmp(&map[sizeof(disk_t)], path, length))
+    EXIT;
+
+  u64 pixels = (u64)header.width * header.height * header.channels;
+  HANDLE(header.channels >= 1 && header.channels <= 4 && pixels &&
+             offset + header.data <= (u64)st.st_size &&
+             (header.compressed || header.data == pixels),
+         "invalid cache file", EXIT);
+
+  image_t *image = image_allocate(header.width, header.height,
+                                  header.channels);
+  HANDLE(image, "failed to allocate image", EXIT);
+
+  const uc *data = &map[offset];
+  trace_read(header.data);
+  if (header.compressed) {
+    trace_begin(IMAGE_STAGE_DECODE);
+    reader_t r;
+    reader_memory(&r, data, header.data);
+    qoi_state_t q;
+    qoi_init(&q);
+    int failed = qoi_decode_chunks(&q, &r, image->data,
+                                   header.width * header.height,
+                                   header.channels) ||
+                 q.eof;
+    trace_end();
+    HANDLE(!failed, "invalid cache file", {
+      image_free(image);
+      EXIT;
+    });
+  } else {
+    memcpy(image->data, data, pixels);
+  }
+
+#undef EXIT
+
+  munmap((void *)map, st.st_size);
+  return image;
+}
+
+// Written under a temporary name & renamed, so readers never see a part
+static void disk_store(const image_cache_t *cache, const char *path,
+                       const identity_t *id, u64 hash, const image_t *image) {
+  char name[strlen(cache->directory) + 32], temp[sizeof(name) + 32];
+  disk_path(name, sizeof(name), cache, hash);
+
+  static u32 counter;
+  snprintf(temp, sizeof(temp), "%s.%d.%u", name, (int)getpid(),
+           __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+  FILE *f = trace_fopen(temp, "wb");
+  HANDLE(f, "failed to create cache file", return);
+
+  size_t length = strlen(path), offset = (sizeof(disk_t) + length + 63) & ~63;
+  u32 count = image->width * image->height;
+  disk_t header = {"imgc", image->channels, cache->compress, {0},
+                   image->width, image->height, length, 0, *id, 0};
+  uc pad[64] = {};
+
+  int failed = fseek(f, offset, SEEK_SET);
+  if (!cache->compress) {
+    header.data = image_bytes(image);
+    failed |= !fwrite(image->data, header.data, 1, f);
+  } else {
+    // chunks are staged & written in blocks, as image_save_qoi does
+    uc out[1 << 16];
+    u32 block = (sizeof(out) - 2) / 5, n = 0;
+    qoi_state_t q;
+    qoi_init(&q);
+
+    trace_begin(IMAGE_STAGE_ENCODE);
+    for (u32 cursor = 0; cursor < count && !failed; cursor += block) {
+      u32 pixels = count - cursor < block ? count - cursor : block;
+      n = qoi_encode_chunks(&q, out,
+                            &image->data[(size_t)cursor * image->channels],
+                            pixels, image->channels);
+      if (cursor + pixels >= count)
+        n += qoi_encode_end(&q, &out[n]);
+
+      failed |= n && !fwrite(out, n, 1, f);
+      header.data += n;
+    }
+    trace_end();
+  }
+
+  size_t padding = offset - sizeof(disk_t) - length;
+  failed |= fseek(f, 0, SEEK_SET) || !fwrite(&header, sizeof(disk_t), 1, f) ||
+            (length && !fwrite(path, length, 1, f)) ||
+            (padding && !fwrite(pad, padding, 1, f));
+  failed |= fclose(f) != 0;
+
+  if (failed || rename(temp, name)) {
+    WARNING("failed to write cache file");
+    unlink(temp);
+  }
+}
+
+//////////////////////////////// Entries
+
+// Entry of a key, or NULL (cache locked)
+static entry_t *find(const image_cache_t *cache, u64 hash, const char *path,
+                     const identity_t *id) {
+  entry_t *e = cache->buckets[hash & cache->mask];
+  while (e &&
+         (e->hash != hash || !same_id(&e->id, id) || strcmp(e->path, path)))
+    e = e->next;
+  return e;
+}
+
+// Twice the buckets, when there are over two entries each (cache locked)
+static void grow(image_cache_t *cache) {
+  u32 buckets = cache->mask + 1;
+  if (cache->stats.entries <= buckets * 2 || buckets >= 1u << 30)
+    return;
+
+  entry_t **table = calloc(buckets * 2, sizeof(entry_t *));
+  if (!table)
+    return; // longer chains until the next try
+  trace_alloc(buckets * 2 * sizeof(entry_t *));
+
+  for (u32 b = 0; b < buckets; b++)
+    for (entry_t *e = cache->buckets[b], *next; e; e = next) {
+      next = e->next;
+      e->next = table[e->hash & (buckets * 2 - 1)];
+      table[e->hash & (buckets * 2 - 1)] = e;
+    }
+
+  free(cache->buckets);
+  cache->buckets = table, cache->mask = buckets * 2 - 1;
+}
+
+static void unlink_lru(image_cache_t *cache, entry_t *e) {
+  *(e->newer ? &e->newer->older : &cache->newest) = e->older;
+  *(e->older ? &e->older->newer : &cache->oldest) = e->newer;
+  e->newer = e->older = NULL;
+}
+
+static void touch(image_cache_t *cache, entry_t *e) {
+  if (cache->newest == e)
+    return;
+  if (e->newer || e->older || cache->oldest == e)
+    unlink_lru(cache, e);
+
+  e->older = cache->newest, e->newer = NULL;
+  *(cache->newest ? &cache->newest->newer : &cache->oldest) = e;
+  cache->newest = e;
+}
+
+// Drop from the table (& the list when kept), freeing it (cache locked)
+static void remove_entry(image_cache_t *cache, entry_t *e) {
+  entry_t **link = &cache->buckets[e->hash & cache->mask];
+  while (*link != e)
+    link = &(*link)->next;
+  *link = e->next;
+
+  if (e->kept) {
+    unlink_lru(cache, e);
+    cache->stats.bytes -= image_bytes(e->image);
+  }
+  image_free(e->image);
+  cache->stats.entries--;
+
+  free(e->path);
+  free(e);
+}
+
+// Least recently used images out until within budget (cache locked)
+static void evict(image_cache_t *cache) {
+  entry_t *e = cache->oldest;
+  while (e && cache->stats.bytes > cache->budget) {
+    entry_t *newer = e->newer;
+    if (!e->refs) {
+      remove_entry(cache, e);
+      cache->stats.evictions++;
+    }
+    e = newer;
+  }
+}
+
+// Unpin, the last load of an image that was not kept frees it (cache locked)
+static void release(image_cache_t *cache, entry_t *e) {
+  e->refs--;
+  if (!e->kept && !e->refs && !e->loading)
+    remove_entry(cache, e);
+  evict(cache);
+}
+
+//////////////////////////////// Loading
+
+// Largest side at most size, not enlarged
+static image_t *thumbnail(const char *path, u32 size) {
+  // from 1/8 unless that is under size on the longer side, then again at
+  // the largest scale that is not
+  image_t *image = image_load_scaled(path, 8);
+  if (!image)
+    return NULL;
+
+  u32 side = image->width > image->height ? image->width : image->height;
+  if (side < size) {
+    u8 scale = 8;
+    while (scale > 1 && side * 8 / scale < size)
+      scale /= 2;
+
+    image_free(image);
+    image = image_load_scaled(path, scale);
+    if (!image)
+      return NULL;
+    side = image->width > image->height ? image->width : image->height;
+  }
+
+  if (side > size) {
+    u32 width = (u64)image->width * size / side,
+        height = (u64)image->height * size / side;
+    image_resize(image, width ? width : 1, height ? height : 1,
+                 image->channels);
+
+    // a failed resize leaves the image as it was, which must not be cached
+    HANDLE(image->width <= size && image->height <= size,
+           "failed to resize thumbnail", {
+             image_free(image);
+             return NULL;
+           });
+  }
+
+  return image;
+}
+
+static image_t *cache_get(image_cache_t *cache, const char *path,
+                          identity_t id) {
+  struct stat st;
+  HANDLE(!stat(path, &st), "no such file", return NULL);
+  trace_syscalls(1);
+
+  id.device = st.st_dev, id.inode = st.st_ino, id.bytes = st.st_size;
+  id.mtime = (u64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  u64 hash = key_hash(path, &id);
+
+  pthread_mutex_lock(&cache->lock);
+  entry_t *e = find(cache, hash, path, &id);
+
+  // Hit (or the decode of another load), copied out pinned
+  if (e) {
+    e->refs++;
+    while (e->loading)
+      pthread_cond_wait(&cache->loaded, &cache->lock);
+
+    image_t *out = NULL;
+    if (e->image) {
+      cache->stats.hits++;
+      if (e->kept)
+        touch(cache, e);
+      pthread_mutex_unlock(&cache->lock);
+
+      out = copy(e->image);
+      pthread_mutex_lock(&cache->lock);
+    } else {
+      ERROR("failed to load image");
+    }
+
+    release(cache, e);
+    pthread_mutex_unlock(&cache->lock);
+    return out;
+  }
+
+  // Miss, loaded once while other loads of the key wait
+  e = calloc(1, sizeof(entry_t));
+  char *name = strdup(path);
+  if (!e || !name) {
+    pthread_mutex_unlock(&cache->lock);
+    free(e);
+    free(name);
+    ERROR("failed to allocate entry");
+    return NULL;
+  }
+  trace_alloc(sizeof(entry_t) + strlen(path) + 1);
+
+  *e = (entry_t){cache->buckets[hash & cache->mask], NULL, NULL, hash, name,
+                 id, NULL, 1, 1};
+  cache->buckets[hash & cache->mask] = e;
+  cache->stats.entries++;
+  pthread_mutex_unlock(&cache->lock);
+
+  image_t *image = cache->directory ? disk_load(cache, path, &id, hash) : NULL;
+  int disk = image != NULL;
+  if (!image) {
+    image = id.scale ? image_load_scaled(path, id.scale)
+                     : thumbnail(path, id.size);
+    if (image && cache->directory)
+      disk_store(cache, path, &id, hash, image);
+  }
+
+  // Kept when it fits the budget, else handed to the waiting loads; the
+  // caller gets a copy unless nothing else needs the image
+  image_t *out = image;
+  pthread_mutex_lock(&cache->lock);
+  cache->stats.disk_hits += disk, cache->stats.misses += !disk;
+  e->image = image, e->loading = 0;
+  if (image && image_bytes(image) <= cache->budget) {
+    e->kept = 1;
+    cache->stats.bytes += image_bytes(image);
+    touch(cache, e);
+  }
+  pthread_cond_broadcast(&cache->loaded);
+
+  if (!image || (!e->kept && e->refs == 1)) {
+    e->image = NULL;
+    release(cache, e);
+    grow(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return out;
+  }
+
+  grow(cache);
+  pthread_mutex_unlock(&cache->lock);
+
+  out = copy(image);
+
+  pthread_mutex_lock(&cache->lock);
+  release(cache, e);
+  pthread_mutex_unlock(&cache->lock);
+
+  return out;
+}
+
+//////////////////////////////// Interface
+
+image_cache_t *image_cache_create(size_t budget, const char *directory,
+                                  int compress) {
+  TRACE_CALL();
+  image_cache_t *cache = calloc(1, sizeof(image_cache_t));
+  HANDLE(cache, "failed to allocate cache", return NULL);
+
+  cache->budget = budget, cache->compress = compress != 0;
+  cache->mask = BUCKETS - 1;
+  cache->buckets = calloc(BUCKETS, sizeof(entry_t *));
+  cache->directory = directory ? strdup(directory) : NULL;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->loaded, NULL);
+  trace_alloc(sizeof(image_cache_t) + BUCKETS * sizeof(entry_t *));
+
+  HANDLE(cache->buckets && (!directory || cache->directory),
+         "failed to allocate cache", {
+           image_cache_free(cache);
+           return NULL;
+         });
+
+  return cache;
+}
+
+void image_cache_free(image_cache_t *cache) {
+  if (!cache)
+    return;
+
+  for (u32 b = 0; cache->buckets && b <= cache->mask; b++)
+    for (entry_t *e = cache->buckets[b], *next; e; e = next) {
+      next = e->next;
+      image_free(e->image);
+      free(e->path);
+      free(e);
+    }
+
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->loaded);
+  free(cache->buckets);
+  free(cache->directory);
+  free(cache);
+}
+
+image_t *image_cache_load(image_cache_t *cache, const char *path,
+                          uint8_t scale) {
+  TRACE_CALL();
+  HANDLE(cache && path, "invalid value(s)", return NULL);
+  HANDLE(scale == 1 || scale == 2 || scale == 4 || scale == 8,
+         "scale must be 1, 2, 4 or 8", return NULL);
+
+  return cache_get(cache, path, (identity_t){.scale = scale});
+}
+
+image_t *image_cache_thumbnail(image_cache_t *cache, const char *path,
+                               uint32_t size) {
+  TRACE_CALL();
+  HANDLE(cache && path && size, "invalid value(s)", return NULL);
+
+  return cache_get(cache, path, (identity_t){.size = size});
+}
+
+void image_cache_stats(image_cache_t *cache, image_cache_stats_t *stats) {
+  if (!cache || !stats)
+    return;
+
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -1,13 +1,74 @@
+#include "kernel.h"
+#include "util.h"
 #include <image.h>
 
+#include <string.h>
+
+static void fill_band(image_t image, u32 y0, u32 y1, void *pixel) {
+  size_t width = image.width;
+  kernels.fill(&image.data[y0 * width * image.channels], (y1 - y0) * width,
+               pixel, image.channels);
+}
+
 void image_draw_fill(image_t image, const unsigned char *color,
                      uint8_t channels) {
   if (!image_is_valid(image))
     return;
 
-  for (int i = 0; i < image.width * image.height; i++) {
-    for (int j = 0; j < image.channels; j++) {
-      image.data[i * image.channels + j] = j < channels ? color[j] : 0;
-    }
+  uc pixel[image.channels];
+  for (int j = 0; j < image.channels; j++)
+    pixel[j] = j < channels ? color[j] : 0;
+
+  image_parallel_for(image, 0, fill_band, pixel);
+}
+
+typedef struct {
+  image_t src;
+  i64 x, left, right; // columns of src drawn
+  i64 top;            // first row of src drawn
+  int blend;
+} draw_t;
+
+// Rows of the destination band (a view starting at the first drawn row)
+static void blend_band(image_t image, u32 y0, u32 y1, void *arg) {
+  const draw_t *d = arg;
+  size_t length = d->right - d->left;
+
+  for (u32 j = y0; j < y1; j++) {
+    uc *dst = &image.data[((size_t)j * image.width + d->x + d->left) *
+                          image.channels];
+    const uc *src = &d->src.data[((size_t)(d->top + j) * d->src.width +
+                                  d->left) *
+                                 d->src.channels];
+
+    if (d->blend)
+      kernels.blend(dst, src, length, image.channels);
+    else
+      memcpy(dst, src, length * d->src.channels);
   }
-}
\ No newline at end of file
+}
+
+void image_draw_blend(image_t image, image_t src, int x, int y) {
+  if (!image_is_valid(image) || !image_is_valid(src))
+    return;
+
+  int blend = src.channels == 4 && (image.channels == 3 || image.channels == 4);
+  HANDLE(blend || src.channels == image.channels,
+         "unsupported channel combination", return);
+
+  // Clip to image
+  i64 left = x < 0 ? -(i64)x : 0, top = y < 0 ? -(i64)y : 0;
+  i64 right = (i64)x + src.width < image.width ? src.width
+                                               : (i64)image.width - x;
+  i64 bottom = (i64)y + src.height < image.height ? src.height
+                                                  : (i64)image.height - y;
+  if (left >= right || top >= bottom)
+    return;
+
+  draw_t d = {src, x, left, right, top, blend};
+  image_t rows = image;
+  rows.data = &image.data[(size_t)(y + top) * image.width * image.channels];
+  rows.height = bottom - top;
+
+  image_parallel_for(rows, 0, blend_band, &d);
+}
@@ -0,0 +1,379 @@
+/**
+ * @brief Filtering (Convolution, Blur & Sharpen)
+ *
+ * Separable passes run on row bands in parallel: the horizontal one over
+ * edge padded rows, the vertical one in column blocks so a window of rows
+ * stays in cache. Box blurs slide a running sum, so their cost per pixel
+ * does not depend on the radius.
+ */
+
+#include "kernel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <math.h>
+#include <string.h>
+
+// Largest kernel size
+#define MAX_TAPS 255
+
+// Largest box radius (its reciprocal has to fit BOX_BITS)
+#define MAX_RADIUS 16383
+
+// Gaussian blurs up to this radius (3 sigma) are exact, box blurs above
+#define EXACT_RADIUS 6
+
+// Box blurs approximating a Gaussian one
+#define BOX_PASSES 3
+
+// Bytes of every row the vertical passes work on at once
+#define COLUMN_BLOCK 4096
+
+// Edges repeat, so positions outside 0 to size - 1 clamp
+static i64 clamp(i64 v, u32 size) {
+  return v < 0 ? 0 : v >= size ? size - 1 : v;
+}
+
+//////////////////////////////// Convolution
+
+typedef struct {
+  const uc *src;
+  const i32 *weights; // WEIGHT_BITS fixed point
+  u32 taps;
+} pass_t;
+
+// Rows of the horizontal pass, every row padded by its edge pixels and
+// filtered like taps rows one pixel apart
+static void horizontal_band(image_t dst, u32 y0, u32 y1, void *arg) {
+  const pass_t *p = arg;
+  u8 ch = dst.channels;
+  u32 r = p->taps / 2;
+  size_t stride = (size_t)dst.width * ch;
+
+  uc *row = malloc(stride + 2 * r * ch);
+  HANDLE(row, "failed to allocate row", return);
+
+  for (u32 y = y0; y < y1; y++) {
+    const uc *s = &p->src[y * stride];
+    for (u32 i = 0; i < r; i++) {
+      memcpy(&row[i * ch], s, ch);
+      memcpy(&row[r * ch + stride + i * ch], &s[stride - ch], ch);
+    }
+    memcpy(&row[r * ch], s, stride);
+
+    kernels.resample_rows(&dst.data[y * stride], row, ch, stride, p->weights,
+                          p->taps);
+  }
+
+  free(row);
+}
+
+// Rows of the vertical pass, column block by column block
+static void vertical_band(image_t dst, u32 y0, u32 y1, void *arg) {
+  const pass_t *p = arg;
+  u32 r = p->taps / 2;
+  size_t stride = (size_t)dst.width * dst.channels;
+
+  i32 folded[MAX_TAPS];
+  for (size_t x = 0; x < stride; x += COLUMN_BLOCK) {
+    size_t n = stride - x < COLUMN_BLOCK ? stride - x : COLUMN_BLOCK;
+
+    for (u32 y = y0; y < y1; y++) {
+      uc *d = &dst.data[y * stride + x];
+      i64 first = (i64)y - r;
+      if (first >= 0 && first + p->taps <= dst.height) {
+        kernels.resample_rows(d, &p->src[first * stride + x], stride, n,
+                              p->weights, p->taps);
+        continue;
+      }
+
+      // rows past the edges repeat the edge rows, so fold their weights
+      u32 start = clamp(first, dst.height);
+      u32 end = clamp(first + p->taps - 1, dst.height);
+      memset(folded, 0, (end - start + 1) * sizeof(i32));
+      for (u32 k = 0; k < p->taps; k++)
+        folded[clamp(first + k, dst.height) - start] += p->weights[k];
+
+      kernels.resample_rows(d, &p->src[start * stride + x], stride, n, folded,
+                            end - start + 1);
+    }
+  }
+}
+
+// Weights to fixed point, rounding error on the center tap
+static int fixed_taps(i32 *out, const float *weights, u32 size) {
+  HANDLE(weights && size % 2 == 1 && size <= MAX_TAPS,
+         "kernel size must be odd and at most 255", return 1);
+
+  double sum = 0, magnitude = 0;
+  for (u32 k = 0; k < size; k++)
+    sum += weights[k], magnitude += fabs(weights[k]);
+
+  // keeps the accumulators in 32 bits
+  HANDLE(magnitude <= 256, "kernel weights too large", return 1);
+
+  i32 total = 0;
+  for (u32 k = 0; k < size; k++)
+    total += out[k] = lround(weights[k] * (1 << WEIGHT_BITS));
+  out[size / 2] += lround(sum * (1 << WEIGHT_BITS)) - total;
+
+  return 0;
+}
+
+static int convolve(image_t image, const i32 *horizontal, u32 h_size,
+                    const i32 *vertical, u32 v_size) {
+  size_t size = (size_t)image.width * image.height * image.channels;
+  uc *tmp = malloc(size);
+  HANDLE(tmp, "failed to allocate image data", return 1);
+  trace_alloc(size);
+
+  image_t middle = image;
+  middle.data = tmp;
+
+  pass_t h = {image.data, horizontal, h_size}, v = {tmp, vertical, v_size};
+  image_parallel_for(middle, 0, horizontal_band, &h);
+  image_parallel_for(image, 0, vertical_band, &v);
+
+  free(tmp);
+
+  return 0;
+}
+
+int image_convolve(image_t image, const float *horizontal, uint32_t h_size,
+                   const float *vertical, uint32_t v_size) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+
+  i32 h[MAX_TAPS], v[MAX_TAPS];
+  if (fixed_taps(h, horizontal, h_size) || fixed_taps(v, vertical, v_size))
+    return 1;
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  int err = convolve(image, h, h_size, v, v_size);
+  trace_end();
+
+  return err;
+}
+
+//////////////////////////////// Box Blur
+
+typedef struct {
+  const uc *src;
+  u32 radius;
+  u32 scale; // 1 / window, BOX_BITS fixed point
+} box_t;
+
+static void box_horizontal_band(image_t dst, u32 y0, u32 y1, void *arg) {
+  const box_t *b = arg;
+  u8 ch = dst.channels;
+  u32 w = dst.width;
+  i64 r = b->radius;
+
+  for (u32 y = y0; y < y1; y++) {
+    const uc *s = &b->src[(size_t)y * w * ch];
+    uc *d = &dst.data[(size_t)y * w * ch];
+
+    // window of x = 0, the edge pixel counted once per clamped position
+    u32 sum[ch];
+    for (u8 c = 0; c < ch; c++) {
+      sum[c] = (r + 1) * s[c];
+      for (i64 k = 1; k <= r; k++)
+        sum[c] += s[clamp(k, w) * ch + c];
+    }
+
+    // channels side by side, they do not depend on each other
+    for (u32 x = 0; x < w; x++) {
+      const uc *add = &s[clamp(x + r + 1, w) * ch];
+      const uc *sub = &s[clamp(x - r, w) * ch];
+      for (u8 c = 0; c < ch; c++) {
+        d[x * ch + c] =
+            (sum[c] * b->scale + (1u << (BOX_BITS - 1))) >> BOX_BITS;
+        sum[c] += add[c] - sub[c];
+      }
+    }
+  }
+}
+
+// Every band starts with the sum of its first window, then slides down
+static void box_vertical_band(image_t dst, u32 y0, u32 y1, void *arg) {
+  const box_t *b = arg;
+  u32 h = dst.height;
+  i64 r = b->radius;
+  size_t stride = (size_t)dst.width * dst.channels;
+
+  u32 sum[COLUMN_BLOCK];
+  for (size_t x = 0; x < stride; x += COLUMN_BLOCK) {
+    size_t n = stride - x < COLUMN_BLOCK ? stride - x : COLUMN_BLOCK;
+    const uc *src = &b->src[x];
+
+    // rows of the window, the edge ones repeated for clamped positions
+    i64 first = (i64)y0 - r, last = (i64)y0 + r;
+    u32 top = first < 0 ? -first : 0;
+    u32 bottom = last >= h ? last - (h - 1) : 0;
+    memset(sum, 0, n * sizeof(u32));
+    for (i64 j = clamp(first, h); j <= clamp(last, h); j++) {
+      const uc *s = &src[j * stride];
+      u32 count = 1 + (j == 0 ? top : 0) + (j == h - 1 ? bottom : 0);
+      for (size_t i = 0; i < n; i++)
+        sum[i] += count * s[i];
+    }
+
+    for (u32 y = y0; y < y1; y++)
+      kernels.slide(&dst.data[y * stride + x], sum,
+                    &src[clamp((i64)y + r + 1, h) * stride],
+                    &src[clamp((i64)y - r, h) * stride], n, b->scale);
+  }
+}
+
+// One box blur through tmp (same size as image)
+static void box(image_t image, uc *tmp, u32 radius) {
+  u32 window = 2 * radius + 1;
+  u32 scale = ((1u << BOX_BITS) + window / 2) / window;
+
+  image_t middle = image;
+  middle.data = tmp;
+
+  box_t h = {image.data, radius, scale}, v = {tmp, radius, scale};
+  image_parallel_for(middle, 0, box_horizontal_band, &h);
+
+  // bands of at least a window, so summing the first one stays cheap
+  unsigned threads = image_parallel_count();
+  u32 band = (image.height + threads * 4 - 1) / (threads * 4);
+  image_parallel_for(image, band > window ? band : window, box_vertical_band,
+                     &v);
+}
+
+int image_blur_box(image_t image, uint32_t radius) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+  HANDLE(radius <= MAX_RADIUS, "radius too large", return 1);
+  if (radius == 0)
+    return 0;
+
+  size_t size = (size_t)image.width * image.height * image.channels;
+  uc *tmp = malloc(size);
+  HANDLE(tmp, "failed to allocate image data", return 1);
+  trace_alloc(size);
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  box(image, tmp, radius);
+  trace_end();
+
+  free(tmp);
+
+  return 0;
+}
+
+//////////////////////////////// Gaussian Blur & Sharpen
+
+static int gaussian(image_t image, float sigma) {
+  HANDLE(sigma <= MAX_RADIUS, "sigma too large", return 1);
+
+  // Small kernels exactly (5 taps and below take the fast path)
+  u32 r = ceil(3 * sigma);
+  if (r <= EXACT_RADIUS) {
+    u32 size = 2 * r + 1;
+
+    float weights[2 * EXACT_RADIUS + 1], total = 0;
+    for (u32 k = 0; k < size; k++)
+      total += weights[k] = exp(-((float)k - r) * ((float)k - r) /
+                                (2 * sigma * sigma));
+    for (u32 k = 0; k < size; k++)
+      weights[k] /= total;
+
+    i32 taps[2 * EXACT_RADIUS + 1];
+    fixed_taps(taps, weights, size);
+    return convolve(image, taps, size, taps, size);
+  }
+
+  // Larger ones as box blurs of about the same variance (Kovesi)
+  double ideal = sqrt(12 * sigma * sigma / BOX_PASSES + 1);
+  i32 lower = floor(ideal);
+  if (lower % 2 == 0)
+    lower--;
+  i32 below = lround((12 * sigma * sigma - BOX_PASSES * lower * lower -
+                      4 * BOX_PASSES * lower - 3 * BOX_PASSES) /
+                     (-4.0 * lower - 4));
+
+  size_t size = (size_t)image.width * image.height * image.channels;
+  uc *tmp = malloc(size);
+  HANDLE(tmp, "failed to allocate image data", return 1);
+  trace_alloc(size);
+
+  for (i32 i = 0; i < BOX_PASSES; i++) {
+    u32 radius = ((i < below ? lower : lower + 2) - 1) / 2;
+    if (radius > MAX_RADIUS)
+      radius = MAX_RADIUS;
+    if (radius > 0)
+      box(image, tmp, radius);
+  }
+
+  free(tmp);
+
+  return 0;
+}
+
+int image_blur_gaussian(image_t image, float sigma) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+  if (!(sigma > 0))
+    return 0;
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  int err = gaussian(image, sigma);
+  trace_end();
+
+  return err;
+}
+
+typedef struct {
+  const uc *blurred;
+  i32 amount; // 8 bit fixed point
+  u8 threshold;
+} sharpen_t;
+
+static void sharpen_band(image_t image, u32 y0, u32 y1, void *arg) {
+  const sharpen_t *s = arg;
+  size_t stride = (size_t)image.width * image.channels;
+
+  for (size_t i = y0 * stride; i < y1 * stride; i++) {
+    i32 v = image.data[i], d = v - s->blurred[i];
+    if ((d < 0 ? -d : d) < s->threshold)
+      continue;
+
+    v += (d * s->amount + 128) >> 8;
+    image.data[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+  }
+}
+
+int image_sharpen(image_t image, float sigma, float amount,
+                  uint8_t threshold) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+  HANDLE(amount >= 0 && amount <= 64, "amount must be 0 to 64", return 1);
+  if (!(sigma > 0) || amount == 0)
+    return 0;
+
+  size_t size = (size_t)image.width * image.height * image.channels;
+  uc *blurred = malloc(size);
+  HANDLE(blurred, "failed to allocate image data", return 1);
+  trace_alloc(size);
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  memcpy(blurred, image.data, size);
+
+  image_t copy = image;
+  copy.data = blurred;
+  int err = gaussian(copy, sigma);
+  if (!err) {
+    sharpen_t s = {blurred, lround(amount * 256), threshold};
+    image_parallel_for(image, 0, sharpen_band, &s);
+  }
+  trace_end();
+
+  free(blurred);
+
+  return err;
+}
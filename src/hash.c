@@ -0,0 +1,288 @@
+/**
+ * @brief Perceptual Hashing & Near-Duplicate Index
+ *
+ * Hashes are computed on a small gray copy made by the resampler, so only
+ * the source pixels are read at full size. The index splits each hash into
+ * four 16 bit keys with a table each: hashes within r bits of a query match
+ * it within about r / 4 bits on at least one key, so a find probes the
+ * buckets of those few keys instead of scanning every entry.
+ */
+
+#include "kernel.h"
+#include "resize.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tables of the index, one per 16 bit key
+#define TABLES 4
+#define KEY_BITS 16
+
+// Bucket entries checked per kernel call
+#define CHUNK 256
+
+//////////////////////////////// Hashes
+
+// DCT basis of the lowest 9 frequencies over 32 samples
+static float cosines[9][32];
+
+__attribute__((constructor)) static void hash_init(void) {
+  for (int k = 0; k < 9; k++)
+    for (int x = 0; x < 32; x++)
+      cosines[k][x] = cos((2 * x + 1) * k * M_PI / 64);
+}
+
+static u64 average_hash(const uc *p) {
+  u32 sum = 0;
+  for (int i = 0; i < 64; i++)
+    sum += p[i];
+
+  u64 out = 0;
+  for (int i = 0; i < 64; i++)
+    out |= (u64)(p[i] * 64u > sum) << i;
+  return out;
+}
+
+// From 9x8 pixels
+static u64 difference_hash(const uc *p) {
+  u64 out = 0;
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 8; x++)
+      out |= (u64)(p[y * 9 + x] > p[y * 9 + x + 1]) << (y * 8 + x);
+  return out;
+}
+
+static int compare_float(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+// From 32x32 pixels, frequencies 1 to 8 of both axes
+static u64 dct_hash(const uc *p) {
+  float rows[32][8];
+  for (int y = 0; y < 32; y++)
+    for (int u = 0; u < 8; u++) {
+      float sum = 0;
+      for (int x = 0; x < 32; x++)
+        sum += p[y * 32 + x] * cosines[u + 1][x];
+      rows[y][u] = sum;
+    }
+
+  float coefficients[64], sorted[64];
+  for (int v = 0; v < 8; v++)
+    for (int u = 0; u < 8; u++) {
+      float sum = 0;
+      for (int y = 0; y < 32; y++)
+        sum += rows[y][u] * cosines[v + 1][y];
+      coefficients[v * 8 + u] = sum;
+    }
+
+  memcpy(sorted, coefficients, sizeof(sorted));
+  qsort(sorted, 64, sizeof(float), compare_float);
+  float median = (sorted[31] + sorted[32]) / 2;
+
+  u64 out = 0;
+  for (int i = 0; i < 64; i++)
+    out |= (u64)(coefficients[i] > median) << i;
+  return out;
+}
+
+int image_hash(image_t image, image_hash_t type, uint64_t *hash) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image) && image.channels <= 4, "invalid image",
+         return 1);
+  HANDLE(type <= IMAGE_HASH_DCT, "unknown hash", return 1);
+  HANDLE(hash, "invalid value(s)", return 1);
+
+  // gray input of each hash
+  static const u8 sizes[][2] = {{8, 8}, {9, 8}, {32, 32}};
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  uc *gray = resize_pixels(image, sizes[type][0], sizes[type][1], 1);
+  if (gray)
+    *hash = type == IMAGE_HASH_AVERAGE      ? average_hash(gray)
+            : type == IMAGE_HASH_DIFFERENCE ? difference_hash(gray)
+                                            : dct_hash(gray);
+  trace_end();
+
+  HANDLE(gray, "failed to reduce image", return 1);
+  free(gray);
+
+  return 0;
+}
+
+int image_hash_decode(const void *data, size_t size, image_hash_t type,
+                      uint64_t *hash) {
+  TRACE_CALL();
+
+  // 1/8 unless that leaves under 64 pixels a side (twice the largest hash
+  // input), then again at the largest scale that does not (small images are
+  // cheap to decode twice)
+  image_t *image = image_decode(data, size, 8);
+  HANDLE(image, "failed to decode image", return 1);
+
+  u32 side = image->width < image->height ? image->width : image->height;
+  if (side < 64) {
+    u8 scale = 8;
+    while (scale > 1 && side * 8 / scale < 64)
+      scale /= 2;
+
+    image_free(image);
+    image = image_decode(data, size, scale);
+    HANDLE(image, "failed to decode image", return 1);
+  }
+
+  int err = image_hash(*image, type, hash);
+  image_free(image);
+
+  return err;
+}
+
+uint32_t image_hash_distance(uint64_t a, uint64_t b) {
+  return __builtin_popcountll(a ^ b);
+}
+
+//////////////////////////////// Index
+
+// Hashes sharing one key, with their ids
+typedef struct {
+  u64 *hashes, *ids;
+  u32 count, capacity;
+} bucket_t;
+
+struct image_hash_index {
+  size_t count;
+  bucket_t buckets[TABLES][1 << KEY_BITS];
+};
+
+static inline u32 key(u64 hash, u32 table) {
+  return hash >> (table * KEY_BITS) & ((1u << KEY_BITS) - 1);
+}
+
+image_hash_index_t *image_hash_index_create(void) {
+  TRACE_CALL();
+  image_hash_index_t *index = calloc(1, sizeof(image_hash_index_t));
+  HANDLE(index, "failed to allocate hash index", return NULL);
+  trace_alloc(sizeof(image_hash_index_t));
+
+  return index;
+}
+
+void image_hash_index_free(image_hash_index_t *index) {
+  if (!index)
+    return;
+
+  for (u32 t = 0; t < TABLES; t++)
+    for (u32 k = 0; k < 1u << KEY_BITS; k++) {
+      free(index->buckets[t][k].hashes);
+      free(index->buckets[t][k].ids);
+    }
+  free(index);
+}
+
+// Room for one more entry (a bucket left as is on failure)
+static int bucket_reserve(bucket_t *b) {
+  if (b->count < b->capacity)
+    return 0;
+
+  u32 capacity = b->capacity ? b->capacity * 2 : 4;
+  HANDLE(capacity > b->capacity, "hash bucket too large", return 1);
+
+  u64 *hashes = realloc(b->hashes, capacity * sizeof(u64));
+  if (hashes)
+    b->hashes = hashes;
+  u64 *ids = realloc(b->ids, capacity * sizeof(u64));
+  if (ids)
+    b->ids = ids;
+  HANDLE(hashes && ids, "failed to grow hash bucket", return 1);
+  trace_alloc((capacity - b->capacity) * sizeof(u64) * 2);
+
+  b->capacity = capacity;
+  return 0;
+}
+
+int image_hash_index_add(image_hash_index_t *index, uint64_t hash,
+                         uint64_t id) {
+  HANDLE(index, "invalid value(s)", return 1);
+
+  // every table has room before any is changed
+  for (u32 t = 0; t < TABLES; t++)
+    if (bucket_reserve(&index->buckets[t][key(hash, t)]))
+      return 1;
+
+  for (u32 t = 0; t < TABLES; t++) {
+    bucket_t *b = &index->buckets[t][key(hash, t)];
+    b->hashes[b->count] = hash;
+    b->ids[b->count++] = id;
+  }
+  index->count++;
+
+  return 0;
+}
+
+size_t image_hash_index_count(const image_hash_index_t *index) {
+  return index ? index->count : 0;
+}
+
+typedef struct {
+  const image_hash_index_t *index;
+  u64 hash;
+  u32 radius;
+
+  u64 *ids;
+  size_t max, found;
+} search_t;
+
+// Bits a key of table t may differ by: with radius = TABLES * q + a, a hash
+// that differs by over q on the first a + 1 keys and q - 1 on the others is
+// out of reach (negative when the table has nothing to add)
+static i32 key_radius(u32 radius, u32 t) {
+  return radius / TABLES - (t > radius % TABLES);
+}
+
+// Within the key radius on a table searched before this one
+static int seen(const search_t *s, u32 table, u64 hash) {
+  for (u32 t = 0; t < table; t++)
+    if (__builtin_popcount(key(hash ^ s->hash, t)) <= key_radius(s->radius, t))
+      return 1;
+  return 0;
+}
+
+static void visit(search_t *s, u32 table, u32 k) {
+  const bucket_t *b = &s->index->buckets[table][k];
+
+  u32 near[CHUNK];
+  for (u32 i = 0; i < b->count && s->found < s->max; i += CHUNK) {
+    u32 n = b->count - i < CHUNK ? b->count - i : CHUNK;
+    size_t hits = kernels.hamming(near, &b->hashes[i], n, s->hash, s->radius);
+
+    for (size_t j = 0; j < hits && s->found < s->max; j++)
+      if (!seen(s, table, b->hashes[i + near[j]]))
+        s->ids[s->found++] = b->ids[i + near[j]];
+  }
+}
+
+// Keys differing from k in at most left of the bits from bit on
+static void probe(search_t *s, u32 table, u32 k, u32 bit, u32 left) {
+  visit(s, table, k);
+  for (; left && bit < KEY_BITS && s->found < s->max; bit++)
+    probe(s, table, k ^ 1u << bit, bit + 1, left - 1);
+}
+
+size_t image_hash_index_find(const image_hash_index_t *index, uint64_t hash,
+                             uint32_t radius, uint64_t *ids, size_t max) {
+  HANDLE(index && (ids || !max), "invalid value(s)", return 0);
+
+  radius = radius < 64 ? radius : 64;
+  search_t s = {index, hash, radius, ids, max, 0};
+  for (u32 t = 0; t < TABLES && s.found < max; t++)
+    if (key_radius(radius, t) >= 0)
+      probe(&s, t, key(hash, t), 0, key_radius(radius, t));
+
+  return s.found;
+}
@@ -2,10 +2,15 @@
  * @brief Basic Image Management
  */
 
+#include "reader.h"
+#include "shared.h"
+#include "trace.h"
 #include "util.h"
 #include <image.h>
 
 #include <malloc.h>
+#include <string.h>
+#include <strings.h>
 
 int image_is_valid(image_t image) {
   return image.width != 0 && image.height != 0 && image.channels != 0 &&
@@ -21,7 +26,8 @@ image_t *image_allocate(uint32_t width, uint32_t height, uint32_t channels) {
 
   out->width = width, out->height = height;
   out->channels = channels;
-  out->data = malloc(out->width * out->height * out->channels);
+  out->data = malloc((size_t)width * height * channels);
+  trace_alloc((size_t)width * height * channels);
 
   HANDLE(out->data, "failed to allocate image data", {
     free(out);
@@ -35,6 +41,156 @@ void image_free(image_t *image) {
   if (!image)
     return;
 
-  free(image->data);
+  data_free(image->data);
   free(image);
 }
+
+// Format from file extension
+static const char *extension(const char *path) {
+  const char *dot = strrchr(path, '.');
+  return dot && !strchr(dot, '/') ? dot + 1 : "";
+}
+
+image_t *image_load(const char *path) {
+  TRACE_CALL();
+  return image_load_scaled(path, 1);
+}
+
+image_t *image_load_scaled(const char *path, uint8_t scale) {
+  TRACE_CALL();
+  const char *ext = extension(path);
+
+  if (!strcasecmp(ext, "qoi"))
+    return image_load_qoi_scaled(path, scale);
+  if (!strcasecmp(ext, "bmp"))
+    return image_load_bmp_scaled(path, scale);
+  if (!strcasecmp(ext, "png"))
+    return image_load_png_scaled(path, scale);
+  if (!strcasecmp(ext, "tif") || !strcasecmp(ext, "tiff"))
+    return image_load_tiff_scaled(path, scale);
+
+  ERROR("unknown file format");
+  return NULL;
+}
+
+// Big / little endian fields
+static u32 get(const uc *p, int bytes, int big) {
+  u32 v = 0;
+  for (int i = 0; i < bytes; i++)
+    v |= (u32)p[i] << 8 * (big ? bytes - 1 - i : i);
+  return v;
+}
+
+// Size of the first IFD's image (fields stored inline)
+static int tiff_info(reader_t *r, const uc *header, u32 *width, u32 *height,
+                     u8 *channels) {
+  int big = header[0] == 'M';
+  HANDLE(!reader_seek(r, get(&header[4], 4, big), SEEK_SET),
+         "invalid offset", return 1);
+
+  uc raw[12];
+  HANDLE(reader_read(r, raw, 2, 1), "failed to read IFD", return 1);
+
+  u16 count = get(raw, 2, big);
+  *width = *height = 0, *channels = 1;
+  for (u16 i = 0; i < count; i++) {
+    HANDLE(reader_read(r, raw, 12, 1), "failed to read IFD", return 1);
+
+    u16 id = get(raw, 2, big), type = get(&raw[2], 2, big);
+    u32 value = get(&raw[8], type == 3 ? 2 : 4, big);
+    if (id == 256)
+      *width = value;
+    else if (id == 257)
+      *height = value;
+    else if (id == 277)
+      *channels = value;
+  }
+
+  return 0;
+}
+
+int image_info(const char *path, uint32_t *width, uint32_t *height,
+               uint8_t *channels) {
+  TRACE_CALL();
+  HANDLE(width && height && channels, "invalid value(s)", return 1);
+
+  reader_t r;
+  HANDLE(!reader_open(&r, path), "no such file", return 1);
+
+  uc h[32];
+  size_t size = reader_read(&r, h, 1, sizeof(h));
+  int err = 0;
+
+  if (size >= 14 && !memcmp(h, "qoif", 4)) {
+    *width = get(&h[4], 4, 1), *height = get(&h[8], 4, 1), *channels = h[12];
+  } else if (size >= 26 && !memcmp(h, "BM", 2)) {
+    // always decoded to RGB, negative heights are top-down
+    i32 rows = get(&h[22], 4, 0);
+    *width = get(&h[18], 4, 0), *height = rows < 0 ? -rows : rows;
+    *channels = 3;
+  } else if (size >= 26 && !memcmp(h, "\x89PNG", 4)) {
+    // palettes count as RGBA (transparency comes after the header)
+    static const u8 samples[7] = {1, 0, 3, 4, 2, 0, 4};
+    *width = get(&h[16], 4, 1), *height = get(&h[20], 4, 1);
+    *channels = h[25] < 7 ? samples[h[25]] : 0;
+  } else if (size >= 8 &&
+             (!memcmp(h, "II*\0", 4) || !memcmp(h, "MM\0*", 4))) {
+    err = tiff_info(&r, h, width, height, channels);
+  } else {
+    ERROR("unknown file format");
+    err = 1;
+  }
+
+  reader_close(&r);
+
+  HANDLE(err || (*width && *height && *channels), "invalid image size",
+         return 1);
+  return err;
+}
+
+image_t *image_decode(const void *data, size_t size, uint8_t scale) {
+  TRACE_CALL();
+  HANDLE(data && size >= 8, "invalid data", return NULL);
+
+  if (!memcmp(data, "qoif", 4))
+    return image_decode_qoi(data, size, scale);
+  if (!memcmp(data, "BM", 2))
+    return image_decode_bmp(data, size, scale);
+  if (!memcmp(data, "\x89PNG", 4))
+    return image_decode_png(data, size, scale);
+  if (!memcmp(data, "II*\0", 4) || !memcmp(data, "MM\0*", 4))
+    return image_decode_tiff(data, size, scale);
+
+  ERROR("unknown file format");
+  return NULL;
+}
+
+int image_save(image_t image, const char *path) {
+  TRACE_CALL();
+  const char *ext = extension(path);
+
+  if (!strcasecmp(ext, "qoi"))
+    return image_save_qoi(image, path);
+  if (!strcasecmp(ext, "bmp"))
+    return image_save_bmp(image, path);
+  if (!strcasecmp(ext, "png"))
+    return image_save_png(image, path);
+  if (!strcasecmp(ext, "tif") || !strcasecmp(ext, "tiff"))
+    return image_save_tiff(image, path);
+
+  ERROR("unknown file format");
+  return 1;
+}
+
+int image_save_indexed(const image_indexed_t *image, const char *path) {
+  TRACE_CALL();
+  const char *ext = extension(path);
+
+  if (!strcasecmp(ext, "bmp"))
+    return image_save_bmp_indexed(image, path);
+  if (!strcasecmp(ext, "png"))
+    return image_save_png_indexed(image, path);
+
+  ERROR("indexed images are saved as BMP or PNG");
+  return 1;
+}
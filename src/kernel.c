@@ -0,0 +1,311 @@
+/**
+ * @brief Pixel Kernels, Scalar Reference & Dispatch
+ *
+ * The best level the CPU supports is picked once at startup (or forced at
+ * build time through IMAGE_CPU_LEVEL); every level only replaces the
+ * kernels it implements, so the others fall back to the level below.
+ */
+
+#include "kernel.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86
+#endif
+
+kernels_t kernels;
+
+static image_cpu_t level;
+
+//////////////////////////////// Scalar Reference
+
+void scalar_fill(uc *dst, size_t count, const uc *pixel, u8 channels) {
+  for (size_t i = 0; i < count; i++)
+    memcpy(&dst[i * channels], pixel, channels);
+}
+
+void scalar_swizzle(uc *dst, const uc *src, size_t count, u8 src_channels) {
+  for (size_t i = 0; i < count; i++) {
+    const uc *s = &src[i * src_channels];
+    uc r = s[2], g = s[1], b = s[0];
+    dst[i * 3 + 0] = r;
+    dst[i * 3 + 1] = g;
+    dst[i * 3 + 2] = b;
+  }
+}
+
+size_t scalar_run(const uc *src, size_t count, u8 channels, const uc *pixel) {
+  size_t n = 0;
+  while (n < count && !memcmp(&src[n * channels], pixel, channels))
+    n++;
+  return n;
+}
+
+static void unfilter_none(uc *row, const uc *prev, u32 length, u32 bpp) {}
+
+void scalar_unfilter_sub(uc *row, const uc *prev, u32 length, u32 bpp) {
+  for (u32 i = bpp; i < length; i++)
+    row[i] += row[i - bpp];
+}
+
+void scalar_unfilter_up(uc *row, const uc *prev, u32 length, u32 bpp) {
+  for (u32 i = 0; i < length; i++)
+    row[i] += prev[i];
+}
+
+void scalar_unfilter_average(uc *row, const uc *prev, u32 length, u32 bpp) {
+  for (u32 i = 0; i < bpp; i++)
+    row[i] += prev[i] / 2;
+  for (u32 i = bpp; i < length; i++)
+    row[i] += (row[i - bpp] + prev[i]) / 2;
+}
+
+// Paeth predictor
+static uc paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+void scalar_unfilter_paeth(uc *row, const uc *prev, u32 length, u32 bpp) {
+  for (u32 i = 0; i < bpp; i++)
+    row[i] += prev[i];
+  for (u32 i = bpp; i < length; i++)
+    row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+void scalar_blend(uc *dst, const uc *src, size_t count, u8 channels) {
+  for (size_t i = 0; i < count; i++) {
+    const uc *s = &src[i * 4];
+    uc *d = &dst[i * channels];
+    u32 a = s[3];
+
+    for (int c = 0; c < 3; c++)
+      d[c] = div255(s[c] * a + d[c] * (255 - a));
+    if (channels == 4)
+      d[3] = div255(255 * a + d[3] * (255 - a));
+  }
+}
+
+void scalar_resample_rows(uc *dst, const uc *src, size_t stride,
+                          size_t length, const i32 *weights, u32 taps) {
+  // blocks of columns, so the inner loop runs along memory
+  i32 acc[256];
+
+  for (size_t x = 0; x < length; x += 256) {
+    size_t n = length - x < 256 ? length - x : 256;
+    memset(acc, 0, n * sizeof(i32));
+
+    for (u32 k = 0; k < taps; k++) {
+      const uc *s = &src[k * stride + x];
+      for (size_t i = 0; i < n; i++)
+        acc[i] += weights[k] * s[i];
+    }
+
+    for (size_t i = 0; i < n; i++)
+      dst[x + i] = resample_clamp(acc[i]);
+  }
+}
+
+void scalar_resample_row(uc *dst, const uc *src, u32 width, u8 channels,
+                         const u32 *start, const u32 *count,
+                         const i32 *weights, u32 max) {
+  for (u32 x = 0; x < width; x++) {
+    const i32 *w = &weights[(size_t)x * max];
+    const uc *s = &src[start[x] * channels];
+
+    for (u8 c = 0; c < channels; c++) {
+      i32 sum = 0;
+      for (u32 k = 0; k < count[x]; k++)
+        sum += w[k] * s[k * channels + c];
+      dst[x * channels + c] = resample_clamp(sum);
+    }
+  }
+}
+
+void scalar_slide(uc *dst, u32 *sum, const uc *add, const uc *sub,
+                  size_t length, u32 scale) {
+  for (size_t i = 0; i < length; i++) {
+    dst[i] = (sum[i] * scale + (1u << (BOX_BITS - 1))) >> BOX_BITS;
+    sum[i] += add[i] - sub[i];
+  }
+}
+
+void scalar_reduce_box(uc *dst, const uc *a, const uc *b, u32 width,
+                       u8 channels) {
+  size_t pairs = (size_t)(width / 2) * channels;
+  for (size_t i = 0; i < pairs; i++) {
+    size_t j = (i / channels) * channels + i; // first of the pair
+    dst[i] = (a[j] + a[j + channels] + b[j] + b[j + channels] + 2) >> 2;
+  }
+
+  if (width % 2)
+    for (u8 c = 0; c < channels; c++) {
+      size_t j = (size_t)(width - 1) * channels + c;
+      dst[pairs + c] = (a[j] + b[j] + 1) >> 1;
+    }
+}
+
+void scalar_reduce_tent(uc *dst, const uc *const *rows, u32 width,
+                        u8 channels) {
+  static const u32 w[4] = {1, 3, 3, 1};
+
+  for (u32 x = 0; x < (width + 1) / 2; x++) {
+    size_t col[4];
+    for (int k = 0; k < 4; k++) {
+      i64 s = (i64)x * 2 - 1 + k;
+      col[k] = (s < 0 ? 0 : s >= width ? width - 1 : s) * channels;
+    }
+
+    for (u8 c = 0; c < channels; c++) {
+      u32 sum = 0;
+      for (int j = 0; j < 4; j++)
+        for (int k = 0; k < 4; k++)
+          sum += w[j] * w[k] * rows[j][col[k] + c];
+      dst[x * channels + c] = (sum + 32) >> 6;
+    }
+  }
+}
+
+void scalar_nearest(uc *dst, const uc *src, size_t count, const u32 *rg,
+                    const u32 *ba, u32 entries) {
+  for (size_t i = 0; i < count; i++) {
+    const uc *p = &src[i * 4];
+
+    // distance << 8 | index, so the smallest is the nearest
+    u32 best = (u32)-1;
+    for (u32 j = 0; j < entries; j++) {
+      i32 dr = p[0] - (i32)(rg[j] & 0xFFFF), dg = p[1] - (i32)(rg[j] >> 16);
+      i32 db = p[2] - (i32)(ba[j] & 0xFFFF), da = p[3] - (i32)(ba[j] >> 16);
+      u32 key = (u32)(dr * dr + dg * dg + db * db + da * da) << 8 | j;
+      if (key < best)
+        best = key;
+    }
+
+    dst[i] = best & 0xFF;
+  }
+}
+
+u64 scalar_sse(const uc *a, const uc *b, size_t length) {
+  u64 sum = 0;
+  for (size_t i = 0; i < length; i++) {
+    i32 d = a[i] - b[i];
+    sum += d * d;
+  }
+
+  return sum;
+}
+
+void scalar_ssim_sums(u32 *const *sums, const uc *a, const uc *b,
+                      size_t stride, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    u32 s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    for (int k = 0; k < 4; k++) {
+      u32 x = a[k * stride + i], y = b[k * stride + i];
+      s1 += x, s2 += y;
+      ss += x * x + y * y;
+      s12 += x * y;
+    }
+
+    sums[0][i] = s1, sums[1][i] = s2;
+    sums[2][i] = ss, sums[3][i] = s12;
+  }
+}
+
+size_t scalar_hamming(u32 *found, const u64 *hashes, size_t count, u64 hash,
+                      u32 radius) {
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    found[n] = i;
+    n += (u32)__builtin_popcountll(hashes[i] ^ hash) <= radius;
+  }
+
+  return n;
+}
+
+void scalar_lut(uc *data, size_t count, const uc (*tables)[256], u8 channels) {
+  if (channels == 1) {
+    for (size_t i = 0; i < count; i++)
+      data[i] = tables[0][data[i]];
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++, data += channels)
+    for (u8 c = 0; c < channels; c++)
+      data[c] = tables[c][data[c]];
+}
+
+//////////////////////////////// Dispatch
+
+static image_cpu_t detect(void) {
+#ifdef X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return IMAGE_CPU_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return IMAGE_CPU_AVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return IMAGE_CPU_SSE41;
+#endif
+  return IMAGE_CPU_SCALAR;
+}
+
+const char *image_cpu_name(image_cpu_t cpu) {
+  static const char *names[] = {"scalar", "sse4.1", "avx2", "avx512"};
+  return cpu <= IMAGE_CPU_AVX512 ? names[cpu] : "unknown";
+}
+
+image_cpu_t image_cpu_level(void) { return level; }
+
+image_cpu_t image_cpu_select(image_cpu_t cpu) {
+  image_cpu_t best = detect();
+  if (cpu > best) {
+    WARNING("level not supported by this CPU, using the best one");
+    cpu = best;
+  }
+
+  kernels_t k = {scalar_fill,
+                 scalar_swizzle,
+                 scalar_run,
+                 {unfilter_none, scalar_unfilter_sub, scalar_unfilter_up,
+                  scalar_unfilter_average, scalar_unfilter_paeth},
+                 scalar_blend,
+                 scalar_resample_rows,
+                 scalar_resample_row,
+                 scalar_slide,
+                 scalar_reduce_box,
+                 scalar_reduce_tent,
+                 scalar_nearest,
+                 scalar_sse,
+                 scalar_ssim_sums,
+                 scalar_hamming,
+                 scalar_lut};
+
+#ifdef X86
+  if (cpu >= IMAGE_CPU_SSE41)
+    kernels_sse41(&k);
+  if (cpu >= IMAGE_CPU_AVX2)
+    kernels_avx2(&k);
+  if (cpu >= IMAGE_CPU_AVX512)
+    kernels_avx512(&k);
+#endif
+
+  kernels = k;
+  level = cpu;
+
+  return cpu;
+}
+
+__attribute__((constructor)) static void kernels_init(void) {
+#ifdef IMAGE_CPU_FORCE
+  image_cpu_select(IMAGE_CPU_FORCE);
+#else
+  image_cpu_select(detect());
+#endif
+}
@@ -0,0 +1,127 @@
+/**
+ * @brief Pixel Kernels (dispatched by CPU features)
+ */
+
+#pragma once
+
+#include "types.h"
+#include <image.h>
+
+#include <stddef.h>
+
+// Resampling weights fixed point
+#define WEIGHT_BITS 14
+
+// Box filter reciprocal fixed point
+#define BOX_BITS 24
+
+typedef struct {
+  // Fill count pixels with one value
+  void (*fill)(uc *dst, size_t count, const uc *pixel, u8 channels);
+
+  // B-G-R(-X) to R-G-B and back, src has 3 or 4 bytes per pixel
+  void (*swizzle)(uc *dst, const uc *src, size_t count, u8 src_channels);
+
+  // Leading pixels equal to pixel (first channels bytes), at most count
+  size_t (*run)(const uc *src, size_t count, u8 channels, const uc *pixel);
+
+  // Reverse PNG filter types 1-4 in place (prev is zeros for the first row)
+  void (*unfilter[5])(uc *row, const uc *prev, u32 length, u32 bpp);
+
+  // R-G-B-A src over dst of 3 or 4 channels
+  void (*blend)(uc *dst, const uc *src, size_t count, u8 channels);
+
+  // One output row from taps rows of stride bytes (vertical pass)
+  void (*resample_rows)(uc *dst, const uc *src, size_t stride, size_t length,
+                        const i32 *weights, u32 taps);
+
+  // One output row from one source row (horizontal pass), max weights per
+  // output pixel
+  void (*resample_row)(uc *dst, const uc *src, u32 width, u8 channels,
+                       const u32 *start, const u32 *count, const i32 *weights,
+                       u32 max);
+
+  // Sliding window step of a box filter: dst = sum * scale (BOX_BITS fixed
+  // point), then sum += add - sub
+  void (*slide)(uc *dst, u32 *sum, const uc *add, const uc *sub,
+                size_t length, u32 scale);
+
+  // Half width row from two rows (2x2 average, last column repeats)
+  void (*reduce_box)(uc *dst, const uc *a, const uc *b, u32 width,
+                     u8 channels);
+
+  // Half width row from four rows (1 3 3 1 tent, centered between the
+  // middle ones, edge columns repeat)
+  void (*reduce_tent)(uc *dst, const uc *const *rows, u32 width, u8 channels);
+
+  // Index of the nearest palette entry (squared distance, lowest index on
+  // ties) of count R-G-B-A pixels; rg / ba hold R | G << 16 and B | A << 16
+  // of each entry, entries is a multiple of 16 (at most 256)
+  void (*nearest)(uc *dst, const uc *src, size_t count, const u32 *rg,
+                  const u32 *ba, u32 entries);
+
+  // Sum of squared differences of length bytes
+  u64 (*sse)(const uc *a, const uc *b, size_t length);
+
+  // Sums down 4 rows of stride bytes for SSIM, one array each: a, b,
+  // a * a + b * b & a * b
+  void (*ssim_sums)(u32 *const *sums, const uc *a, const uc *b, size_t stride,
+                    size_t length);
+
+  // Positions of the count hashes within radius differing bits of hash,
+  // returns how many were written to found
+  size_t (*hamming)(u32 *found, const u64 *hashes, size_t count, u64 hash,
+                    u32 radius);
+
+  // Map count pixels in place through a table per channel
+  void (*lut)(uc *data, size_t count, const uc (*tables)[256], u8 channels);
+} kernels_t;
+
+// Selected kernels
+extern kernels_t kernels;
+
+// Override the kernels a level implements (lower levels are applied first)
+void kernels_sse41(kernels_t *k);
+void kernels_avx2(kernels_t *k);
+void kernels_avx512(kernels_t *k);
+
+// Scalar reference (also the fallback of unsupported layouts)
+void scalar_fill(uc *dst, size_t count, const uc *pixel, u8 channels);
+void scalar_swizzle(uc *dst, const uc *src, size_t count, u8 src_channels);
+size_t scalar_run(const uc *src, size_t count, u8 channels, const uc *pixel);
+void scalar_unfilter_sub(uc *row, const uc *prev, u32 length, u32 bpp);
+void scalar_unfilter_up(uc *row, const uc *prev, u32 length, u32 bpp);
+void scalar_unfilter_average(uc *row, const uc *prev, u32 length, u32 bpp);
+void scalar_unfilter_paeth(uc *row, const uc *prev, u32 length, u32 bpp);
+void scalar_blend(uc *dst, const uc *src, size_t count, u8 channels);
+void scalar_resample_rows(uc *dst, const uc *src, size_t stride,
+                          size_t length, const i32 *weights, u32 taps);
+void scalar_resample_row(uc *dst, const uc *src, u32 width, u8 channels,
+                         const u32 *start, const u32 *count,
+                         const i32 *weights, u32 max);
+void scalar_slide(uc *dst, u32 *sum, const uc *add, const uc *sub,
+                  size_t length, u32 scale);
+void scalar_reduce_box(uc *dst, const uc *a, const uc *b, u32 width,
+                       u8 channels);
+void scalar_reduce_tent(uc *dst, const uc *const *rows, u32 width,
+                        u8 channels);
+void scalar_nearest(uc *dst, const uc *src, size_t count, const u32 *rg,
+                    const u32 *ba, u32 entries);
+u64 scalar_sse(const uc *a, const uc *b, size_t length);
+void scalar_ssim_sums(u32 *const *sums, const uc *a, const uc *b,
+                      size_t stride, size_t length);
+size_t scalar_hamming(u32 *found, const u64 *hashes, size_t count, u64 hash,
+                      u32 radius);
+void scalar_lut(uc *data, size_t count, const uc (*tables)[256], u8 channels);
+
+// Fixed point sample to byte
+static inline uc resample_clamp(i32 v) {
+  v = (v + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// x / 255 rounded, for x <= 255 * 255
+static inline uc div255(u32 x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
@@ -0,0 +1,431 @@
+/**
+ * @brief Pixel Kernels, AVX2
+ *
+ * Kernels bound by one pixel at a time (Sub, Average & Paeth unfiltering,
+ * horizontal resampling) stay on SSE4.1.
+ */
+
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <string.h>
+
+#define TARGET __attribute__((target("avx2")))
+
+TARGET static void fill(uc *dst, size_t count, const uc *pixel, u8 channels) {
+  if (channels > 4) {
+    scalar_fill(dst, count, pixel, channels);
+    return;
+  }
+
+  // whole number of pixels and vectors
+  uc block[192];
+  size_t period = channels == 3 ? 192 : 64;
+  for (size_t i = 0; i < period; i++)
+    block[i] = pixel[i % channels];
+
+  __m256i v[6];
+  for (size_t k = 0; k < period / 32; k++)
+    v[k] = _mm256_loadu_si256((const __m256i *)&block[k * 32]);
+
+  size_t size = count * channels, i = 0;
+  for (; i + period <= size; i += period)
+    for (size_t k = 0; k < period / 32; k++)
+      _mm256_storeu_si256((__m256i *)&dst[i + k * 32], v[k]);
+
+  memcpy(&dst[i], block, size - i);
+}
+
+TARGET static void swizzle(uc *dst, const uc *src, size_t count,
+                           u8 src_channels) {
+  // 8 pixels per vector, 4 per lane packed into the low 12 bytes
+  const __m256i mask = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, //
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+  // B-G-R loads read 28 bytes
+  size_t i = 0;
+  for (; i + 10 <= count; i += 8) {
+    __m256i v;
+    if (src_channels == 4) {
+      v = _mm256_loadu_si256((const __m256i *)&src[i * 4]);
+    } else {
+      // B-G-R pixels 0-3 & 4-7, as B-G-R-X lanes
+      __m128i lo = _mm_loadu_si128((const __m128i *)&src[i * 3]);
+      __m128i hi = _mm_loadu_si128((const __m128i *)&src[i * 3 + 12]);
+      const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8,
+                                           -1, 9, 10, 11, -1);
+      v = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(_mm_shuffle_epi8(lo, spread)),
+          _mm_shuffle_epi8(hi, spread), 1);
+    }
+
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), lanes);
+    _mm_storeu_si128((__m128i *)&dst[i * 3], _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i *)&dst[i * 3 + 16],
+                     _mm256_extracti128_si256(v, 1));
+  }
+
+  scalar_swizzle(&dst[i * 3], &src[i * src_channels], count - i,
+                 src_channels);
+}
+
+TARGET static size_t run(const uc *src, size_t count, u8 channels,
+                         const uc *pixel) {
+  if (channels != 3 && channels != 4)
+    return scalar_run(src, count, channels, pixel);
+
+  // 32 pixels of 3 bytes or 8 pixels of 4 bytes
+  uc block[96];
+  u32 vectors = channels == 3 ? 3 : 1, pixels = vectors * 32 / channels;
+  for (u32 i = 0; i < vectors * 32; i++)
+    block[i] = pixel[i % channels];
+
+  __m256i v[3];
+  for (u32 k = 0; k < vectors; k++)
+    v[k] = _mm256_loadu_si256((const __m256i *)&block[k * 32]);
+
+  size_t n = 0;
+  for (; n + pixels <= count; n += pixels) {
+    const uc *s = &src[n * channels];
+
+    for (u32 k = 0; k < vectors; k++) {
+      __m256i e = _mm256_cmpeq_epi8(
+          _mm256_loadu_si256((const __m256i *)&s[k * 32]), v[k]);
+      u32 equal = _mm256_movemask_epi8(e);
+
+      if (equal != 0xFFFFFFFF)
+        return n + (k * 32 + __builtin_ctz(~equal)) / channels;
+    }
+  }
+
+  return n + scalar_run(&src[n * channels], count - n, channels, pixel);
+}
+
+TARGET static void unfilter_up(uc *row, const uc *prev, u32 length, u32 bpp) {
+  u32 i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)&row[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)&prev[i]);
+    _mm256_storeu_si256((__m256i *)&row[i], _mm256_add_epi8(x, b));
+  }
+
+  scalar_unfilter_up(&row[i], &prev[i], length - i, bpp);
+}
+
+// div255(s * a + d * (255 - a)) of 16 bit lanes
+TARGET static inline __m256i mix(__m256i s, __m256i d, __m256i a) {
+  __m256i t = _mm256_add_epi16(
+      _mm256_mullo_epi16(s, a),
+      _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), a)));
+  t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET static void blend(uc *dst, const uc *src, size_t count, u8 channels) {
+  if (channels != 4) {
+    scalar_blend(dst, src, count, channels);
+    return;
+  }
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi32(0xFF000000); // alpha over alpha
+  const __m256i alpha = _mm256_setr_epi8(
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15, //
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)&src[i * 4]);
+    __m256i d = _mm256_loadu_si256((const __m256i *)&dst[i * 4]);
+    __m256i a = _mm256_shuffle_epi8(s, alpha);
+    s = _mm256_or_si256(s, opaque);
+
+    // unpack & pack both work per lane, so pixel order is kept
+    __m256i lo =
+        mix(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero),
+            _mm256_unpacklo_epi8(a, zero));
+    __m256i hi =
+        mix(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero),
+            _mm256_unpackhi_epi8(a, zero));
+    _mm256_storeu_si256((__m256i *)&dst[i * 4], _mm256_packus_epi16(lo, hi));
+  }
+
+  scalar_blend(&dst[i * 4], &src[i * 4], count - i, 4);
+}
+
+// Two taps per 16 bit multiply-add, for weights that fit 16 bits; inlined
+// so 3 & 5 taps get unrolled
+TARGET static inline __attribute__((always_inline)) size_t
+pairs(uc *dst, const uc *src, size_t stride, size_t length, const u32 *pair,
+      u32 taps) {
+  const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_BITS - 1));
+  const __m256i zero = _mm256_setzero_si256();
+
+  size_t x = 0;
+  for (; x + 32 <= length; x += 32) {
+    __m256i acc[4] = {round, round, round, round};
+
+    for (u32 k = 0; k < taps; k += 2) {
+      const uc *a = &src[k * stride + x];
+      __m256i ra = _mm256_loadu_si256((const __m256i *)a);
+      __m256i rb = k + 1 < taps
+                       ? _mm256_loadu_si256((const __m256i *)&a[stride])
+                       : zero;
+      __m256i w = _mm256_set1_epi32(pair[k / 2]);
+
+      // per lane, columns 0-7 & 8-15 as pairs of both rows
+      __m256i lo = _mm256_unpacklo_epi8(ra, rb);
+      __m256i hi = _mm256_unpackhi_epi8(ra, rb);
+      acc[0] = _mm256_add_epi32(
+          acc[0], _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+      acc[1] = _mm256_add_epi32(
+          acc[1], _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+      acc[2] = _mm256_add_epi32(
+          acc[2], _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+      acc[3] = _mm256_add_epi32(
+          acc[3], _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+    }
+
+    for (int j = 0; j < 4; j++)
+      acc[j] = _mm256_srai_epi32(acc[j], WEIGHT_BITS);
+
+    // every lane packs its own 16 columns, already in order
+    __m256i lo = _mm256_packs_epi32(acc[0], acc[1]);
+    __m256i hi = _mm256_packs_epi32(acc[2], acc[3]);
+    _mm256_storeu_si256((__m256i *)&dst[x], _mm256_packus_epi16(lo, hi));
+  }
+
+  return x;
+}
+
+TARGET static void resample_rows(uc *dst, const uc *src, size_t stride,
+                                 size_t length, const i32 *weights,
+                                 u32 taps) {
+  // weights of a pair side by side in one 32 bit lane
+  u32 pair[(taps + 1) / 2];
+  int narrow = 1;
+  for (u32 k = 0; k < taps; k++) {
+    narrow &= weights[k] == (i16)weights[k];
+    if (k % 2 == 0)
+      pair[k / 2] = (u16)weights[k];
+    else
+      pair[k / 2] |= (u32)(u16)weights[k] << 16;
+  }
+
+  size_t x = 0;
+  if (narrow && taps == 3)
+    x = pairs(dst, src, stride, length, pair, 3);
+  else if (narrow && taps == 5)
+    x = pairs(dst, src, stride, length, pair, 5);
+  else if (narrow)
+    x = pairs(dst, src, stride, length, pair, taps);
+
+  const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_BITS - 1));
+  for (; x + 32 <= length; x += 32) {
+    __m256i acc[4] = {round, round, round, round};
+
+    for (u32 k = 0; k < taps; k++) {
+      __m256i w = _mm256_set1_epi32(weights[k]);
+      const uc *s = &src[k * stride + x];
+
+      for (int j = 0; j < 4; j++) {
+        __m128i p = _mm_loadl_epi64((const __m128i *)&s[j * 8]);
+        acc[j] = _mm256_add_epi32(
+            acc[j], _mm256_mullo_epi32(_mm256_cvtepu8_epi32(p), w));
+      }
+    }
+
+    for (int j = 0; j < 4; j++)
+      acc[j] = _mm256_srai_epi32(acc[j], WEIGHT_BITS);
+
+    // packs work per 128 bit lane, leaving groups of 4 columns in the
+    // order 0 2 4 6 1 3 5 7
+    __m256i lo = _mm256_packs_epi32(acc[0], acc[1]);
+    __m256i hi = _mm256_packs_epi32(acc[2], acc[3]);
+    __m256i v = _mm256_packus_epi16(lo, hi);
+    v = _mm256_permutevar8x32_epi32(
+        v, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)&dst[x], v);
+  }
+
+  scalar_resample_rows(&dst[x], &src[x], stride, length - x, weights, taps);
+}
+
+TARGET static void slide(uc *dst, u32 *sum, const uc *add, const uc *sub,
+                         size_t length, u32 scale) {
+  const __m256i m = _mm256_set1_epi32(scale);
+  const __m256i round = _mm256_set1_epi32(1u << (BOX_BITS - 1));
+
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i out[4];
+    for (int j = 0; j < 4; j++) {
+      __m256i *p = (__m256i *)&sum[i + j * 8];
+      __m256i v = _mm256_loadu_si256(p);
+      out[j] = _mm256_srli_epi32(
+          _mm256_add_epi32(_mm256_mullo_epi32(v, m), round), BOX_BITS);
+
+      __m256i a = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64((const __m128i *)&add[i + j * 8]));
+      __m256i b = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64((const __m128i *)&sub[i + j * 8]));
+      _mm256_storeu_si256(p, _mm256_add_epi32(v, _mm256_sub_epi32(a, b)));
+    }
+
+    // same lane order fix up as resample_rows
+    __m256i lo = _mm256_packus_epi32(out[0], out[1]);
+    __m256i hi = _mm256_packus_epi32(out[2], out[3]);
+    __m256i v = _mm256_permutevar8x32_epi32(
+        _mm256_packus_epi16(lo, hi), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)&dst[i], v);
+  }
+
+  scalar_slide(&dst[i], &sum[i], &add[i], &sub[i], length - i, scale);
+}
+
+TARGET static void nearest(uc *dst, const uc *src, size_t count,
+                           const u32 *rg, const u32 *ba, u32 entries) {
+  const __m256i step = _mm256_set1_epi32(8);
+
+  for (size_t i = 0; i < count; i++) {
+    const uc *p = &src[i * 4];
+    __m256i prg = _mm256_set1_epi32(p[0] | p[1] << 16);
+    __m256i pba = _mm256_set1_epi32(p[2] | p[3] << 16);
+
+    __m256i best = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (u32 j = 0; j < entries; j += 8) {
+      __m256i d0 = _mm256_sub_epi16(
+          prg, _mm256_loadu_si256((const __m256i *)&rg[j]));
+      __m256i d1 = _mm256_sub_epi16(
+          pba, _mm256_loadu_si256((const __m256i *)&ba[j]));
+      __m256i d = _mm256_add_epi32(_mm256_madd_epi16(d0, d0),
+                                   _mm256_madd_epi16(d1, d1));
+
+      best = _mm256_min_epu32(best,
+                              _mm256_or_si256(_mm256_slli_epi32(d, 8), index));
+      index = _mm256_add_epi32(index, step);
+    }
+
+    __m128i v = _mm_min_epu32(_mm256_castsi256_si128(best),
+                              _mm256_extracti128_si256(best, 1));
+    v = _mm_min_epu32(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_min_epu32(v, _mm_shuffle_epi32(v, 0xB1));
+    dst[i] = _mm_cvtsi128_si32(v) & 0xFF;
+  }
+}
+
+TARGET static u64 sse(const uc *a, const uc *b, size_t length) {
+  const __m256i zero = _mm256_setzero_si256();
+
+  u64 sum = 0;
+  size_t i = 0;
+  while (i + 32 <= length) {
+    // 32 bit lanes are flushed before they can overflow
+    size_t end = length - i > 65536 ? i + 65536 : length;
+    __m256i acc = zero;
+    for (; i + 32 <= end; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i *)&a[i]);
+      __m256i y = _mm256_loadu_si256((const __m256i *)&b[i]);
+      __m256i d = _mm256_sub_epi8(_mm256_max_epu8(x, y), _mm256_min_epu8(x, y));
+
+      __m256i lo = _mm256_unpacklo_epi8(d, zero);
+      __m256i hi = _mm256_unpackhi_epi8(d, zero);
+      acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(lo, lo),
+                                                   _mm256_madd_epi16(hi, hi)));
+    }
+
+    // lanes to 64 bits before adding them up
+    u64 lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes,
+                        _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero),
+                                         _mm256_unpackhi_epi32(acc, zero)));
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  return sum + scalar_sse(&a[i], &b[i], length - i);
+}
+
+TARGET static void ssim_sums(u32 *const *sums, const uc *a, const uc *b,
+                             size_t stride, size_t length) {
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    __m256i s1 = _mm256_setzero_si256(), s2 = s1, ss = s1, s12 = s1;
+    for (int k = 0; k < 4; k++) {
+      __m256i x = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64((const __m128i *)&a[k * stride + i]));
+      __m256i y = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64((const __m128i *)&b[k * stride + i]));
+      s1 = _mm256_add_epi32(s1, x);
+      s2 = _mm256_add_epi32(s2, y);
+
+      // 16 bit halves a | b << 16, madd squares & adds them
+      __m256i xy = _mm256_or_si256(x, _mm256_slli_epi32(y, 16));
+      ss = _mm256_add_epi32(ss, _mm256_madd_epi16(xy, xy));
+      s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(x, y));
+    }
+
+    _mm256_storeu_si256((__m256i *)&sums[0][i], s1);
+    _mm256_storeu_si256((__m256i *)&sums[1][i], s2);
+    _mm256_storeu_si256((__m256i *)&sums[2][i], ss);
+    _mm256_storeu_si256((__m256i *)&sums[3][i], s12);
+  }
+
+  u32 *rest[4] = {&sums[0][i], &sums[1][i], &sums[2][i], &sums[3][i]};
+  scalar_ssim_sums(rest, &a[i], &b[i], stride, length - i);
+}
+
+TARGET static size_t hamming(u32 *found, const u64 *hashes, size_t count,
+                             u64 hash, u32 radius) {
+  const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+                                         3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2,
+                                         2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0F);
+  const __m256i q = _mm256_set1_epi64x(hash);
+  const __m256i limit = _mm256_set1_epi64x(radius + 1);
+
+  size_t n = 0, i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i x =
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&hashes[i]), q);
+
+    // nibble table lookups, then bytes summed per hash
+    __m256i bytes = _mm256_add_epi8(
+        _mm256_shuffle_epi8(table, _mm256_and_si256(x, low)),
+        _mm256_shuffle_epi8(table,
+                            _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+    __m256i bits = _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+    int near = _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, bits)));
+
+    for (int k = 0; k < 4; k++)
+      found[n] = i + k, n += near >> k & 1;
+  }
+
+  for (; i < count; i++) {
+    found[n] = i;
+    n += (u32)__builtin_popcountll(hashes[i] ^ hash) <= radius;
+  }
+
+  return n;
+}
+
+void kernels_avx2(kernels_t *k) {
+  k->fill = fill;
+  k->swizzle = swizzle;
+  k->run = run;
+  k->unfilter[2] = unfilter_up;
+  k->blend = blend;
+  k->resample_rows = resample_rows;
+  k->slide = slide;
+  k->nearest = nearest;
+  k->sse = sse;
+  k->ssim_sums = ssim_sums;
+  k->hamming = hamming;
+}
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * @brief Pixel Kernels, AVX-512 (F & BW)
+ *
+ * Only the kernels that stream whole rows gain from 64 byte vectors; the
+ * others stay on AVX2 / SSE4.1. Table lookups also need VBMI (byte
+ * permutes), checked on its own.
+ */
+
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <string.h>
+
+#define TARGET __attribute__((target("avx512f,avx512bw")))
+#define TARGET_VBMI __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+
+TARGET static void fill(uc *dst, size_t count, const uc *pixel, u8 channels) {
+  if (channels > 4) {
+    scalar_fill(dst, count, pixel, channels);
+    return;
+  }
+
+  // whole number of pixels and vectors
+  uc block[192];
+  size_t period = channels == 3 ? 192 : 64;
+  for (size_t i = 0; i < period; i++)
+    block[i] = pixel[i % channels];
+
+  __m512i v[3];
+  for (size_t k = 0; k < period / 64; k++)
+    v[k] = _mm512_loadu_si512(&block[k * 64]);
+
+  size_t size = count * channels, i = 0;
+  for (; i + period <= size; i += period)
+    for (size_t k = 0; k < period / 64; k++)
+      _mm512_storeu_si512(&dst[i + k * 64], v[k]);
+
+  memcpy(&dst[i], block, size - i);
+}
+
+TARGET static size_t run(const uc *src, size_t count, u8 channels,
+                         const uc *pixel) {
+  if (channels != 3 && channels != 4)
+    return scalar_run(src, count, channels, pixel);
+
+  // 64 pixels of 3 bytes or 16 pixels of 4 bytes
+  uc block[192];
+  u32 vectors = channels == 3 ? 3 : 1, pixels = vectors * 64 / channels;
+  for (u32 i = 0; i < vectors * 64; i++)
+    block[i] = pixel[i % channels];
+
+  __m512i v[3];
+  for (u32 k = 0; k < vectors; k++)
+    v[k] = _mm512_loadu_si512(&block[k * 64]);
+
+  size_t n = 0;
+  for (; n + pixels <= count; n += pixels) {
+    const uc *s = &src[n * channels];
+
+    for (u32 k = 0; k < vectors; k++) {
+      u64 equal = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(&s[k * 64]), v[k]);
+      if (~equal)
+        return n + (k * 64 + __builtin_ctzll(~equal)) / channels;
+    }
+  }
+
+  return n + scalar_run(&src[n * channels], count - n, channels, pixel);
+}
+
+TARGET static void unfilter_up(uc *row, const uc *prev, u32 length, u32 bpp) {
+  u32 i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m512i x = _mm512_loadu_si512(&row[i]);
+    __m512i b = _mm512_loadu_si512(&prev[i]);
+    _mm512_storeu_si512(&row[i], _mm512_add_epi8(x, b));
+  }
+
+  scalar_unfilter_up(&row[i], &prev[i], length - i, bpp);
+}
+
+// div255(s * a + d * (255 - a)) of 16 bit lanes
+TARGET static inline __m512i mix(__m512i s, __m512i d, __m512i a) {
+  __m512i t = _mm512_add_epi16(
+      _mm512_mullo_epi16(s, a),
+      _mm512_mullo_epi16(d, _mm512_sub_epi16(_mm512_set1_epi16(255), a)));
+  t = _mm512_add_epi16(t, _mm512_set1_epi16(128));
+  return _mm512_srli_epi16(_mm512_add_epi16(t, _mm512_srli_epi16(t, 8)), 8);
+}
+
+TARGET static void blend(uc *dst, const uc *src, size_t count, u8 channels) {
+  if (channels != 4) {
+    scalar_blend(dst, src, count, channels);
+    return;
+  }
+
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i opaque = _mm512_set1_epi32(0xFF000000); // alpha over alpha
+  const __m512i alpha = _mm512_broadcast_i32x4(_mm_setr_epi8(
+      3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15));
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i s = _mm512_loadu_si512(&src[i * 4]);
+    __m512i d = _mm512_loadu_si512(&dst[i * 4]);
+    __m512i a = _mm512_shuffle_epi8(s, alpha);
+    s = _mm512_or_si512(s, opaque);
+
+    // unpack & pack both work per 128 bit lane, so pixel order is kept
+    __m512i lo =
+        mix(_mm512_unpacklo_epi8(s, zero), _mm512_unpacklo_epi8(d, zero),
+            _mm512_unpacklo_epi8(a, zero));
+    __m512i hi =
+        mix(_mm512_unpackhi_epi8(s, zero), _mm512_unpackhi_epi8(d, zero),
+            _mm512_unpackhi_epi8(a, zero));
+    _mm512_storeu_si512(&dst[i * 4], _mm512_packus_epi16(lo, hi));
+  }
+
+  scalar_blend(&dst[i * 4], &src[i * 4], count - i, 4);
+}
+
+// Two taps per 16 bit multiply-add, for weights that fit 16 bits; inlined
+// so 3 & 5 taps get unrolled
+TARGET static inline __attribute__((always_inline)) size_t
+pairs(uc *dst, const uc *src, size_t stride, size_t length, const u32 *pair,
+      u32 taps) {
+  const __m512i round = _mm512_set1_epi32(1 << (WEIGHT_BITS - 1));
+  const __m512i zero = _mm512_setzero_si512();
+
+  size_t x = 0;
+  for (; x + 64 <= length; x += 64) {
+    __m512i acc[4] = {round, round, round, round};
+
+    for (u32 k = 0; k < taps; k += 2) {
+      const uc *a = &src[k * stride + x];
+      __m512i ra = _mm512_loadu_si512(a);
+      __m512i rb = k + 1 < taps ? _mm512_loadu_si512(&a[stride]) : zero;
+      __m512i w = _mm512_set1_epi32(pair[k / 2]);
+
+      // per lane, columns 0-7 & 8-15 as pairs of both rows
+      __m512i lo = _mm512_unpacklo_epi8(ra, rb);
+      __m512i hi = _mm512_unpackhi_epi8(ra, rb);
+      acc[0] = _mm512_add_epi32(
+          acc[0], _mm512_madd_epi16(_mm512_unpacklo_epi8(lo, zero), w));
+      acc[1] = _mm512_add_epi32(
+          acc[1], _mm512_madd_epi16(_mm512_unpackhi_epi8(lo, zero), w));
+      acc[2] = _mm512_add_epi32(
+          acc[2], _mm512_madd_epi16(_mm512_unpacklo_epi8(hi, zero), w));
+      acc[3] = _mm512_add_epi32(
+          acc[3], _mm512_madd_epi16(_mm512_unpackhi_epi8(hi, zero), w));
+    }
+
+    for (int j = 0; j < 4; j++)
+      acc[j] = _mm512_srai_epi32(acc[j], WEIGHT_BITS);
+
+    // every lane packs its own 16 columns, already in order
+    __m512i lo = _mm512_packs_epi32(acc[0], acc[1]);
+    __m512i hi = _mm512_packs_epi32(acc[2], acc[3]);
+    _mm512_storeu_si512(&dst[x], _mm512_packus_epi16(lo, hi));
+  }
+
+  return x;
+}
+
+TARGET static void resample_rows(uc *dst, const uc *src, size_t stride,
+                                 size_t length, const i32 *weights,
+                                 u32 taps) {
+  // weights of a pair side by side in one 32 bit lane
+  u32 pair[(taps + 1) / 2];
+  int narrow = 1;
+  for (u32 k = 0; k < taps; k++) {
+    narrow &= weights[k] == (i16)weights[k];
+    if (k % 2 == 0)
+      pair[k / 2] = (u16)weights[k];
+    else
+      pair[k / 2] |= (u32)(u16)weights[k] << 16;
+  }
+
+  size_t x = 0;
+  if (narrow && taps == 3)
+    x = pairs(dst, src, stride, length, pair, 3);
+  else if (narrow && taps == 5)
+    x = pairs(dst, src, stride, length, pair, 5);
+  else if (narrow)
+    x = pairs(dst, src, stride, length, pair, taps);
+
+  const __m512i round = _mm512_set1_epi32(1 << (WEIGHT_BITS - 1));
+  const __m512i zero = _mm512_setzero_si512();
+
+  for (; x + 64 <= length; x += 64) {
+    __m512i acc[4] = {round, round, round, round};
+
+    for (u32 k = 0; k < taps; k++) {
+      __m512i w = _mm512_set1_epi32(weights[k]);
+      const uc *s = &src[k * stride + x];
+
+      for (int j = 0; j < 4; j++) {
+        __m128i p = _mm_loadu_si128((const __m128i *)&s[j * 16]);
+        acc[j] = _mm512_add_epi32(
+            acc[j], _mm512_mullo_epi32(_mm512_cvtepu8_epi32(p), w));
+      }
+    }
+
+    // clamp below, unsigned saturation above
+    for (int j = 0; j < 4; j++) {
+      __m512i v = _mm512_srai_epi32(acc[j], WEIGHT_BITS);
+      v = _mm512_max_epi32(v, zero);
+      _mm_storeu_si128((__m128i *)&dst[x + j * 16], _mm512_cvtusepi32_epi8(v));
+    }
+  }
+
+  scalar_resample_rows(&dst[x], &src[x], stride, length - x, weights, taps);
+}
+
+// Each table is four vectors: a byte picks from a pair with its low 7 bits,
+// its high bit picks the pair
+TARGET_VBMI static void lut(uc *data, size_t count, const uc (*tables)[256],
+                            u8 channels) {
+  // channels with a table to apply, identity ones keep their bytes
+  __m512i t[4][4];
+  u8 active[4], used = 0;
+  for (u8 c = 0; c < channels; c++) {
+    int identity = 1;
+    for (int v = 0; v < 256 && identity; v++)
+      identity = tables[c][v] == v;
+    if (identity)
+      continue;
+
+    for (int k = 0; k < 4; k++)
+      t[c][k] = _mm512_loadu_si512(&tables[c][k * 64]);
+    active[used++] = c;
+  }
+
+  // bytes of channel c in vector j of a period of channels vectors
+  u64 masks[4][4] = {{0}};
+  for (u32 b = 0; b < 64u * channels; b++)
+    masks[b / 64][b % channels] |= 1ull << (b % 64);
+
+  size_t length = count * channels, period = 64 * channels, i = 0;
+  for (; i + period <= length; i += period)
+    for (u8 j = 0; j < channels; j++) {
+      __m512i x = _mm512_loadu_si512(&data[i + j * 64]);
+      __mmask64 high = _mm512_movepi8_mask(x);
+
+      __m512i r = x;
+      for (u8 k = 0; k < used; k++) {
+        u8 c = active[k];
+        __m512i lo = _mm512_permutex2var_epi8(t[c][0], x, t[c][1]);
+        __m512i hi = _mm512_permutex2var_epi8(t[c][2], x, t[c][3]);
+        r = _mm512_mask_mov_epi8(r, masks[j][c],
+                                 _mm512_mask_blend_epi8(high, lo, hi));
+      }
+      _mm512_storeu_si512(&data[i + j * 64], r);
+    }
+
+  scalar_lut(&data[i], count - i / channels, tables, channels);
+}
+
+void kernels_avx512(kernels_t *k) {
+  k->fill = fill;
+  k->run = run;
+  k->unfilter[2] = unfilter_up;
+  k->blend = blend;
+  k->resample_rows = resample_rows;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512vbmi"))
+    k->lut = lut;
+}
+
+#endif
@@ -0,0 +1,619 @@
+/**
+ * @brief Pixel Kernels, SSE4.1
+ */
+
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <string.h>
+
+#define TARGET __attribute__((target("sse4.1")))
+
+// 1-4 byte pixel load & store (no access past the pixel)
+TARGET static inline __m128i load_pixel(const uc *p, u32 size) {
+  u32 v = 0;
+  memcpy(&v, p, size);
+  return _mm_cvtsi32_si128(v);
+}
+
+TARGET static inline void store_pixel(uc *p, __m128i v, u32 size) {
+  u32 x = _mm_cvtsi128_si32(v);
+  memcpy(p, &x, size);
+}
+
+TARGET static void fill(uc *dst, size_t count, const uc *pixel, u8 channels) {
+  if (channels > 4) {
+    scalar_fill(dst, count, pixel, channels);
+    return;
+  }
+
+  // whole number of pixels and vectors
+  uc block[192];
+  size_t period = channels == 3 ? 192 : 64;
+  for (size_t i = 0; i < period; i++)
+    block[i] = pixel[i % channels];
+
+  __m128i v[12];
+  for (size_t k = 0; k < period / 16; k++)
+    v[k] = _mm_loadu_si128((const __m128i *)&block[k * 16]);
+
+  size_t size = count * channels, i = 0;
+  for (; i + period <= size; i += period)
+    for (size_t k = 0; k < period / 16; k++)
+      _mm_storeu_si128((__m128i *)&dst[i + k * 16], v[k]);
+
+  memcpy(&dst[i], block, size - i);
+}
+
+TARGET static void swizzle(uc *dst, const uc *src, size_t count,
+                           u8 src_channels) {
+  size_t i = 0;
+
+  if (src_channels == 4) {
+    const __m128i mask =
+        _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    for (; i + 4 <= count; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+      v = _mm_shuffle_epi8(v, mask);
+
+      _mm_storel_epi64((__m128i *)&dst[i * 3], v);
+      store_pixel(&dst[i * 3 + 8], _mm_srli_si128(v, 8), 4);
+    }
+  } else {
+    // 5 pixels per vector, the 16th byte is rewritten by the next one
+    const __m128i mask =
+        _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+
+    for (; i + 6 <= count; i += 5) {
+      __m128i v = _mm_loadu_si128((const __m128i *)&src[i * 3]);
+      _mm_storeu_si128((__m128i *)&dst[i * 3], _mm_shuffle_epi8(v, mask));
+    }
+  }
+
+  scalar_swizzle(&dst[i * 3], &src[i * src_channels], count - i,
+                 src_channels);
+}
+
+TARGET static size_t run(const uc *src, size_t count, u8 channels,
+                         const uc *pixel) {
+  if (channels != 3 && channels != 4)
+    return scalar_run(src, count, channels, pixel);
+
+  // 16 pixels of 3 bytes or 4 pixels of 4 bytes
+  uc block[48];
+  u32 vectors = channels == 3 ? 3 : 1, pixels = vectors * 16 / channels;
+  for (u32 i = 0; i < vectors * 16; i++)
+    block[i] = pixel[i % channels];
+
+  __m128i v[3];
+  for (u32 k = 0; k < vectors; k++)
+    v[k] = _mm_loadu_si128((const __m128i *)&block[k * 16]);
+
+  u64 all = (1ull << (vectors * 16)) - 1;
+  size_t n = 0;
+  for (; n + pixels <= count; n += pixels) {
+    const uc *s = &src[n * channels];
+
+    u64 equal = 0;
+    for (u32 k = 0; k < vectors; k++) {
+      __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[k * 16]),
+                                 v[k]);
+      equal |= (u64)(u32)_mm_movemask_epi8(e) << (k * 16);
+    }
+
+    if (equal != all)
+      return n + __builtin_ctzll(~equal) / channels;
+  }
+
+  return n + scalar_run(&src[n * channels], count - n, channels, pixel);
+}
+
+// Sub, Average & Paeth depend on the previous pixel, so only one pixel is
+// done at a time (3 or 4 bytes, other sizes use the reference)
+
+TARGET static void unfilter_sub(uc *row, const uc *prev, u32 length,
+                                u32 bpp) {
+  if (bpp != 3 && bpp != 4) {
+    scalar_unfilter_sub(row, prev, length, bpp);
+    return;
+  }
+
+  __m128i a = _mm_setzero_si128();
+  for (u32 i = 0; i < length; i += bpp) {
+    a = _mm_add_epi8(a, load_pixel(&row[i], bpp));
+    store_pixel(&row[i], a, bpp);
+  }
+}
+
+TARGET static void unfilter_up(uc *row, const uc *prev, u32 length, u32 bpp) {
+  u32 i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)&row[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&prev[i]);
+    _mm_storeu_si128((__m128i *)&row[i], _mm_add_epi8(x, b));
+  }
+
+  scalar_unfilter_up(&row[i], &prev[i], length - i, bpp);
+}
+
+TARGET static void unfilter_average(uc *row, const uc *prev, u32 length,
+                                    u32 bpp) {
+  if (bpp != 3 && bpp != 4) {
+    scalar_unfilter_average(row, prev, length, bpp);
+    return;
+  }
+
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for (u32 i = 0; i < length; i += bpp) {
+    __m128i b = load_pixel(&prev[i], bpp);
+
+    // (a + b) / 2, pavgb rounds up
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                                   _mm_and_si128(_mm_xor_si128(a, b), one));
+
+    a = _mm_add_epi8(load_pixel(&row[i], bpp), average);
+    store_pixel(&row[i], a, bpp);
+  }
+}
+
+TARGET static void unfilter_paeth(uc *row, const uc *prev, u32 length,
+                                  u32 bpp) {
+  if (bpp != 3 && bpp != 4) {
+    scalar_unfilter_paeth(row, prev, length, bpp);
+    return;
+  }
+
+  // 16 bit lanes: a left, b up, c up left
+  const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi16(0xFF);
+  __m128i a = zero, c = zero;
+  for (u32 i = 0; i < length; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(&prev[i], bpp), zero);
+    __m128i x = _mm_unpacklo_epi8(load_pixel(&row[i], bpp), zero);
+
+    // p = a + b - c: |p - a| = |b - c|, |p - b| = |a - c|, ...
+    __m128i pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+    __m128i pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+    __m128i pc =
+        _mm_abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+
+    // ties favor a, then b
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest = _mm_blendv_epi8(c, b, _mm_cmpeq_epi16(smallest, pb));
+    nearest = _mm_blendv_epi8(nearest, a, _mm_cmpeq_epi16(smallest, pa));
+
+    a = _mm_and_si128(_mm_add_epi16(x, nearest), low);
+    c = b;
+    store_pixel(&row[i], _mm_packus_epi16(a, a), bpp);
+  }
+}
+
+// div255(s * a + d * (255 - a)) of 16 bit lanes
+TARGET static inline __m128i mix(__m128i s, __m128i d, __m128i a) {
+  __m128i t = _mm_add_epi16(
+      _mm_mullo_epi16(s, a),
+      _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+  t = _mm_add_epi16(t, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+TARGET static void blend(uc *dst, const uc *src, size_t count, u8 channels) {
+  size_t i = 0;
+
+  if (channels == 4) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi32(0xFF000000); // alpha over alpha
+    const __m128i alpha = _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11,
+                                        15, 15, 15, 15);
+
+    for (; i + 4 <= count; i += 4) {
+      __m128i s = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+      __m128i d = _mm_loadu_si128((const __m128i *)&dst[i * 4]);
+      __m128i a = _mm_shuffle_epi8(s, alpha);
+      s = _mm_or_si128(s, opaque);
+
+      __m128i lo = mix(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero),
+                       _mm_unpacklo_epi8(a, zero));
+      __m128i hi = mix(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero),
+                       _mm_unpackhi_epi8(a, zero));
+      _mm_storeu_si128((__m128i *)&dst[i * 4], _mm_packus_epi16(lo, hi));
+    }
+  }
+
+  scalar_blend(&dst[i * channels], &src[i * 4], count - i, channels);
+}
+
+// Two taps per 16 bit multiply-add, for weights that fit 16 bits (always
+// the case resizing & blurring); inlined so 3 & 5 taps get unrolled
+TARGET static inline __attribute__((always_inline)) size_t
+pairs(uc *dst, const uc *src, size_t stride, size_t length, const u32 *pair,
+      u32 taps) {
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t x = 0;
+  for (; x + 16 <= length; x += 16) {
+    __m128i acc[4] = {round, round, round, round};
+
+    for (u32 k = 0; k < taps; k += 2) {
+      const uc *a = &src[k * stride + x];
+      __m128i ra = _mm_loadu_si128((const __m128i *)a);
+      __m128i rb = k + 1 < taps
+                       ? _mm_loadu_si128((const __m128i *)&a[stride])
+                       : zero;
+      __m128i w = _mm_set1_epi32(pair[k / 2]);
+
+      // columns 0-7 & 8-15 as pairs of both rows
+      __m128i lo = _mm_unpacklo_epi8(ra, rb), hi = _mm_unpackhi_epi8(ra, rb);
+      acc[0] = _mm_add_epi32(
+          acc[0], _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+      acc[1] = _mm_add_epi32(
+          acc[1], _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+      acc[2] = _mm_add_epi32(
+          acc[2], _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+      acc[3] = _mm_add_epi32(
+          acc[3], _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+    }
+
+    for (int j = 0; j < 4; j++)
+      acc[j] = _mm_srai_epi32(acc[j], WEIGHT_BITS);
+
+    __m128i lo = _mm_packs_epi32(acc[0], acc[1]);
+    __m128i hi = _mm_packs_epi32(acc[2], acc[3]);
+    _mm_storeu_si128((__m128i *)&dst[x], _mm_packus_epi16(lo, hi));
+  }
+
+  return x;
+}
+
+TARGET static void resample_rows(uc *dst, const uc *src, size_t stride,
+                                 size_t length, const i32 *weights,
+                                 u32 taps) {
+  // weights of a pair side by side in one 32 bit lane
+  u32 pair[(taps + 1) / 2];
+  int narrow = 1;
+  for (u32 k = 0; k < taps; k++) {
+    narrow &= weights[k] == (i16)weights[k];
+    if (k % 2 == 0)
+      pair[k / 2] = (u16)weights[k];
+    else
+      pair[k / 2] |= (u32)(u16)weights[k] << 16;
+  }
+
+  size_t x = 0;
+  if (narrow && taps == 3)
+    x = pairs(dst, src, stride, length, pair, 3);
+  else if (narrow && taps == 5)
+    x = pairs(dst, src, stride, length, pair, 5);
+  else if (narrow)
+    x = pairs(dst, src, stride, length, pair, taps);
+
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+  for (; x + 16 <= length; x += 16) {
+    __m128i acc[4] = {round, round, round, round};
+
+    for (u32 k = 0; k < taps; k++) {
+      __m128i w = _mm_set1_epi32(weights[k]);
+      __m128i s = _mm_loadu_si128((const __m128i *)&src[k * stride + x]);
+
+      for (int j = 0; j < 4; j++, s = _mm_srli_si128(s, 4))
+        acc[j] =
+            _mm_add_epi32(acc[j], _mm_mullo_epi32(_mm_cvtepu8_epi32(s), w));
+    }
+
+    for (int j = 0; j < 4; j++)
+      acc[j] = _mm_srai_epi32(acc[j], WEIGHT_BITS);
+
+    __m128i lo = _mm_packs_epi32(acc[0], acc[1]);
+    __m128i hi = _mm_packs_epi32(acc[2], acc[3]);
+    _mm_storeu_si128((__m128i *)&dst[x], _mm_packus_epi16(lo, hi));
+  }
+
+  scalar_resample_rows(&dst[x], &src[x], stride, length - x, weights, taps);
+}
+
+TARGET static void resample_row(uc *dst, const uc *src, u32 width,
+                                u8 channels, const u32 *start,
+                                const u32 *count, const i32 *weights,
+                                u32 max) {
+  if (channels != 3 && channels != 4) {
+    scalar_resample_row(dst, src, width, channels, start, count, weights,
+                        max);
+    return;
+  }
+
+  // one pixel (all channels) per vector
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+  for (u32 x = 0; x < width; x++) {
+    const i32 *w = &weights[(size_t)x * max];
+    const uc *s = &src[start[x] * channels];
+
+    __m128i acc = round;
+    for (u32 k = 0; k < count[x]; k++) {
+      __m128i p = _mm_cvtepu8_epi32(load_pixel(&s[k * channels], channels));
+      acc = _mm_add_epi32(acc, _mm_mullo_epi32(p, _mm_set1_epi32(w[k])));
+    }
+
+    acc = _mm_srai_epi32(acc, WEIGHT_BITS);
+    acc = _mm_packs_epi32(acc, acc);
+    store_pixel(&dst[x * channels], _mm_packus_epi16(acc, acc), channels);
+  }
+}
+
+TARGET static void slide(uc *dst, u32 *sum, const uc *add, const uc *sub,
+                         size_t length, u32 scale) {
+  const __m128i m = _mm_set1_epi32(scale);
+  const __m128i round = _mm_set1_epi32(1u << (BOX_BITS - 1));
+
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&add[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&sub[i]);
+
+    __m128i out[4];
+    for (int j = 0; j < 4; j++) {
+      __m128i *p = (__m128i *)&sum[i + j * 4];
+      __m128i v = _mm_loadu_si128(p);
+      out[j] = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(v, m), round),
+                              BOX_BITS);
+
+      v = _mm_add_epi32(v, _mm_sub_epi32(_mm_cvtepu8_epi32(a),
+                                         _mm_cvtepu8_epi32(b)));
+      _mm_storeu_si128(p, v);
+      a = _mm_srli_si128(a, 4), b = _mm_srli_si128(b, 4);
+    }
+
+    __m128i lo = _mm_packus_epi32(out[0], out[1]);
+    __m128i hi = _mm_packus_epi32(out[2], out[3]);
+    _mm_storeu_si128((__m128i *)&dst[i], _mm_packus_epi16(lo, hi));
+  }
+
+  scalar_slide(&dst[i], &sum[i], &add[i], &sub[i], length - i, scale);
+}
+
+// Shuffle picking byte k from pixel 2 * (k / channels) (12 source bytes give
+// 6 for 3 channels, 16 give 8 otherwise), second of the pair when next
+TARGET static inline __m128i even_mask(u8 channels, int next) {
+  u32 used = channels == 3 ? 6 : 8;
+  uc m[16];
+  for (u32 k = 0; k < 16; k++) {
+    u32 j = k / channels * channels + k;
+    m[k] = k < used ? j + (next ? channels : 0) : 0x80;
+  }
+
+  return _mm_loadu_si128((const __m128i *)m);
+}
+
+TARGET static void reduce_box(uc *dst, const uc *a, const uc *b, u32 width,
+                              u8 channels) {
+  // both pixels of a pair side by side, summed by maddubs
+  const __m128i mask = _mm_unpacklo_epi8(even_mask(channels, 0),
+                                         even_mask(channels, 1));
+  const __m128i ones = _mm_set1_epi8(1), two = _mm_set1_epi16(2);
+  size_t step = channels == 3 ? 12 : 16;
+
+  size_t pairs = (size_t)(width / 2) * 2 * channels, i = 0;
+  for (; i + 16 <= pairs; i += step) {
+    __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+    __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]);
+    va = _mm_maddubs_epi16(_mm_shuffle_epi8(va, mask), ones);
+    vb = _mm_maddubs_epi16(_mm_shuffle_epi8(vb, mask), ones);
+
+    __m128i v = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(va, vb), two), 2);
+    _mm_storel_epi64((__m128i *)&dst[i / 2], _mm_packus_epi16(v, v));
+  }
+
+  scalar_reduce_box(&dst[i / 2], &a[i], &b[i], width - i / channels,
+                    channels);
+}
+
+TARGET static void reduce_tent(uc *dst, const uc *const *rows, u32 width,
+                               u8 channels) {
+  // Vertical pass to 16 bits, edge columns repeated (one left, three right)
+  size_t length = (size_t)width * channels;
+  u16 v[length + 4 * channels + 8], *p = &v[channels];
+  const __m128i three = _mm_set1_epi16(3);
+
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    __m128i r[4];
+    for (int j = 0; j < 4; j++)
+      r[j] = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&rows[j][i]));
+
+    __m128i middle = _mm_mullo_epi16(_mm_add_epi16(r[1], r[2]), three);
+    __m128i s = _mm_add_epi16(_mm_add_epi16(r[0], r[3]), middle);
+    _mm_storeu_si128((__m128i *)&p[i], s);
+  }
+  for (; i < length; i++)
+    p[i] = rows[0][i] + 3 * (rows[1][i] + rows[2][i]) + rows[3][i];
+
+  for (u8 c = 0; c < channels; c++) {
+    v[c] = p[c];
+    for (int k = 0; k < 3; k++)
+      p[length + k * channels + c] = p[length - channels + c];
+  }
+  memset(&p[length + 3 * channels], 0, 8 * sizeof(u16));
+
+  // Horizontal pass at every column, even ones kept
+  const __m128i mask = even_mask(channels, 0);
+  const __m128i round = _mm_set1_epi16(32);
+  size_t step = channels == 3 ? 12 : 16;
+
+  size_t even = (size_t)((width + 1) / 2) * 2 * channels;
+  for (i = 0; i + 16 <= even; i += step) {
+    __m128i s[2];
+    for (int h = 0; h < 2; h++) {
+      const u16 *q = &p[i + h * 8];
+      __m128i l = _mm_loadu_si128((const __m128i *)(q - channels));
+      __m128i c0 = _mm_loadu_si128((const __m128i *)q);
+      __m128i c1 = _mm_loadu_si128((const __m128i *)(q + channels));
+      __m128i r = _mm_loadu_si128((const __m128i *)(q + 2 * channels));
+
+      __m128i t = _mm_add_epi16(_mm_add_epi16(l, r),
+                                _mm_mullo_epi16(_mm_add_epi16(c0, c1), three));
+      s[h] = _mm_srli_epi16(_mm_add_epi16(t, round), 6);
+    }
+
+    __m128i out = _mm_shuffle_epi8(_mm_packus_epi16(s[0], s[1]), mask);
+    _mm_storel_epi64((__m128i *)&dst[i / 2], out);
+  }
+
+  for (i /= 2; i < even / 2; i++) {
+    const u16 *q = &p[i / channels * channels + i];
+    dst[i] = (q[-channels] + 3 * (q[0] + q[channels]) + q[2 * channels] + 32) >>
+             6;
+  }
+}
+
+TARGET static void nearest(uc *dst, const uc *src, size_t count,
+                           const u32 *rg, const u32 *ba, u32 entries) {
+  const __m128i step = _mm_set1_epi32(4);
+
+  for (size_t i = 0; i < count; i++) {
+    const uc *p = &src[i * 4];
+    __m128i prg = _mm_set1_epi32(p[0] | p[1] << 16);
+    __m128i pba = _mm_set1_epi32(p[2] | p[3] << 16);
+
+    // distance << 8 | index of four entries at a time, madd squares pairs
+    __m128i best = _mm_set1_epi32(-1), index = _mm_setr_epi32(0, 1, 2, 3);
+    for (u32 j = 0; j < entries; j += 4) {
+      __m128i d0 = _mm_sub_epi16(prg, _mm_loadu_si128((const __m128i *)&rg[j]));
+      __m128i d1 = _mm_sub_epi16(pba, _mm_loadu_si128((const __m128i *)&ba[j]));
+      __m128i d = _mm_add_epi32(_mm_madd_epi16(d0, d0), _mm_madd_epi16(d1, d1));
+
+      best = _mm_min_epu32(best, _mm_or_si128(_mm_slli_epi32(d, 8), index));
+      index = _mm_add_epi32(index, step);
+    }
+
+    best = _mm_min_epu32(best, _mm_shuffle_epi32(best, 0x4E));
+    best = _mm_min_epu32(best, _mm_shuffle_epi32(best, 0xB1));
+    dst[i] = _mm_cvtsi128_si32(best) & 0xFF;
+  }
+}
+
+TARGET static u64 sse(const uc *a, const uc *b, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+
+  u64 sum = 0;
+  size_t i = 0;
+  while (i + 16 <= length) {
+    // 32 bit lanes are flushed before they can overflow
+    size_t end = length - i > 65536 ? i + 65536 : length;
+    __m128i acc = zero;
+    for (; i + 16 <= end; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+      __m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+      __m128i d = _mm_sub_epi8(_mm_max_epu8(x, y), _mm_min_epu8(x, y));
+
+      __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+      acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo),
+                                             _mm_madd_epi16(hi, hi)));
+    }
+
+    sum += (u64)(u32)_mm_extract_epi32(acc, 0) +
+           (u32)_mm_extract_epi32(acc, 1) + (u32)_mm_extract_epi32(acc, 2) +
+           (u32)_mm_extract_epi32(acc, 3);
+  }
+
+  return sum + scalar_sse(&a[i], &b[i], length - i);
+}
+
+TARGET static void ssim_sums(u32 *const *sums, const uc *a, const uc *b,
+                             size_t stride, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    __m128i s1 = zero, s2 = zero;
+    __m128i ss[2] = {zero, zero}, s12[2] = {zero, zero};
+    for (int k = 0; k < 4; k++) {
+      __m128i x = _mm_cvtepu8_epi16(
+          _mm_loadl_epi64((const __m128i *)&a[k * stride + i]));
+      __m128i y = _mm_cvtepu8_epi16(
+          _mm_loadl_epi64((const __m128i *)&b[k * stride + i]));
+      s1 = _mm_add_epi16(s1, x);
+      s2 = _mm_add_epi16(s2, y);
+
+      // a * a + b * b from interleaved pairs, a * b fits 16 bits unsigned
+      __m128i lo = _mm_unpacklo_epi16(x, y), hi = _mm_unpackhi_epi16(x, y);
+      ss[0] = _mm_add_epi32(ss[0], _mm_madd_epi16(lo, lo));
+      ss[1] = _mm_add_epi32(ss[1], _mm_madd_epi16(hi, hi));
+
+      __m128i xy = _mm_mullo_epi16(x, y);
+      s12[0] = _mm_add_epi32(s12[0], _mm_unpacklo_epi16(xy, zero));
+      s12[1] = _mm_add_epi32(s12[1], _mm_unpackhi_epi16(xy, zero));
+    }
+
+    __m128i out[4][2] = {
+        {_mm_unpacklo_epi16(s1, zero), _mm_unpackhi_epi16(s1, zero)},
+        {_mm_unpacklo_epi16(s2, zero), _mm_unpackhi_epi16(s2, zero)},
+        {ss[0], ss[1]},
+        {s12[0], s12[1]}};
+    for (int q = 0; q < 4; q++) {
+      _mm_storeu_si128((__m128i *)&sums[q][i], out[q][0]);
+      _mm_storeu_si128((__m128i *)&sums[q][i + 4], out[q][1]);
+    }
+  }
+
+  u32 *rest[4] = {&sums[0][i], &sums[1][i], &sums[2][i], &sums[3][i]};
+  scalar_ssim_sums(rest, &a[i], &b[i], stride, length - i);
+}
+
+// Bits set in each byte (nibble table lookups)
+TARGET static inline __m128i popcount8(__m128i v) {
+  const __m128i table = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+                                      3, 3, 4);
+  const __m128i low = _mm_set1_epi8(0x0F);
+  return _mm_add_epi8(
+      _mm_shuffle_epi8(table, _mm_and_si128(v, low)),
+      _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4), low)));
+}
+
+TARGET static size_t hamming(u32 *found, const u64 *hashes, size_t count,
+                             u64 hash, u32 radius) {
+  const __m128i q = _mm_set1_epi64x(hash), limit = _mm_set1_epi32(radius + 1);
+
+  size_t n = 0, i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&hashes[i]), q);
+
+    // bit counts in the low dword of each half, no 64 bit compare before 4.2
+    __m128i bits = _mm_sad_epu8(popcount8(x), _mm_setzero_si128());
+    int near = _mm_movemask_epi8(_mm_cmpgt_epi32(limit, bits));
+
+    found[n] = i, n += near & 1;
+    found[n] = i + 1, n += near >> 8 & 1;
+  }
+
+  for (; i < count; i++) {
+    found[n] = i;
+    n += (u32)__builtin_popcountll(hashes[i] ^ hash) <= radius;
+  }
+
+  return n;
+}
+
+void kernels_sse41(kernels_t *k) {
+  k->fill = fill;
+  k->swizzle = swizzle;
+  k->run = run;
+  k->unfilter[1] = unfilter_sub;
+  k->unfilter[2] = unfilter_up;
+  k->unfilter[3] = unfilter_average;
+  k->unfilter[4] = unfilter_paeth;
+  k->blend = blend;
+  k->resample_rows = resample_rows;
+  k->resample_row = resample_row;
+  k->slide = slide;
+  k->reduce_box = reduce_box;
+  k->reduce_tent = reduce_tent;
+  k->nearest = nearest;
+  k->sse = sse;
+  k->ssim_sums = ssim_sums;
+  k->hamming = hamming;
+}
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * @brief Tone Curves
+ *
+ * Every operation is a table from 8 bits to 8 bits, run through the tables
+ * built so far; the result equals applying them one after another, but the
+ * image is only read and written once.
+ */
+
+#include "kernel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <math.h>
+#include <string.h>
+
+// Rounded & clamped to a byte
+static uc to_byte(double v) {
+  return v <= 0 ? 0 : v >= 255 ? 255 : (uc)(v + 0.5);
+}
+
+void image_lut_identity(image_lut_t *lut) {
+  for (int c = 0; c < 4; c++)
+    for (int v = 0; v < 256; v++)
+      lut->tables[c][v] = v;
+}
+
+int image_lut_map(image_lut_t *lut, uint8_t channels,
+                  const unsigned char table[256]) {
+  HANDLE(lut && table, "invalid value(s)", return 1);
+
+  for (int c = 0; c < 4; c++)
+    if (channels >> c & 1)
+      for (int v = 0; v < 256; v++)
+        lut->tables[c][v] = table[lut->tables[c][v]];
+
+  return 0;
+}
+
+int image_lut_levels(image_lut_t *lut, uint8_t channels, uint8_t in_black,
+                     uint8_t in_white, float gamma, uint8_t out_black,
+                     uint8_t out_white) {
+  HANDLE(in_black < in_white && gamma > 0, "invalid levels", return 1);
+
+  uc table[256];
+  for (int v = 0; v < 256; v++) {
+    double x = (double)(v - in_black) / (in_white - in_black);
+    x = x <= 0 ? 0 : x >= 1 ? 1 : pow(x, 1 / gamma);
+    table[v] = to_byte(out_black + x * (out_white - out_black));
+  }
+
+  return image_lut_map(lut, channels, table);
+}
+
+int image_lut_gamma(image_lut_t *lut, uint8_t channels, float gamma) {
+  HANDLE(gamma > 0, "gamma must be positive", return 1);
+
+  uc table[256];
+  for (int v = 0; v < 256; v++)
+    table[v] = to_byte(255 * pow(v / 255.0, 1 / gamma));
+
+  return image_lut_map(lut, channels, table);
+}
+
+int image_lut_brightness_contrast(image_lut_t *lut, uint8_t channels,
+                                  float brightness, float contrast) {
+  HANDLE(contrast >= 0 && fabsf(brightness) <= 255, "invalid value(s)",
+         return 1);
+
+  uc table[256];
+  for (int v = 0; v < 256; v++)
+    table[v] = to_byte((v - 127.5) * contrast + 127.5 + brightness);
+
+  return image_lut_map(lut, channels, table);
+}
+
+int image_lut_curve(image_lut_t *lut, uint8_t channels,
+                    const uint8_t (*points)[2], uint32_t count) {
+  HANDLE(points && count >= 2 && count <= 256, "curves need 2-256 points",
+         return 1);
+  for (u32 k = 0; k + 1 < count; k++)
+    HANDLE(points[k][0] < points[k + 1][0], "curve points must increase",
+           return 1);
+
+  // Secant slopes & tangents, limited so no segment overshoots
+  // (Fritsch-Carlson monotone cubic)
+  double slope[count], tangent[count];
+  for (u32 k = 0; k + 1 < count; k++)
+    slope[k] = ((double)points[k + 1][1] - points[k][1]) /
+               (points[k + 1][0] - points[k][0]);
+
+  tangent[0] = slope[0], tangent[count - 1] = slope[count - 2];
+  for (u32 k = 1; k + 1 < count; k++)
+    tangent[k] = slope[k - 1] * slope[k] <= 0
+                     ? 0
+                     : (slope[k - 1] + slope[k]) / 2;
+
+  for (u32 k = 0; k + 1 < count; k++) {
+    if (slope[k] == 0) {
+      tangent[k] = tangent[k + 1] = 0;
+      continue;
+    }
+
+    double a = tangent[k] / slope[k], b = tangent[k + 1] / slope[k];
+    double s = a * a + b * b;
+    if (s > 9) {
+      tangent[k] = 3 / sqrt(s) * a * slope[k];
+      tangent[k + 1] = 3 / sqrt(s) * b * slope[k];
+    }
+  }
+
+  uc table[256];
+  u32 k = 0;
+  for (int v = 0; v < 256; v++) {
+    if (v <= points[0][0] || v >= points[count - 1][0]) {
+      table[v] = points[v <= points[0][0] ? 0 : count - 1][1];
+      continue;
+    }
+
+    while (v > points[k + 1][0])
+      k++;
+
+    // cubic Hermite between points k & k + 1
+    double h = points[k + 1][0] - points[k][0];
+    double t = (v - points[k][0]) / h, t2 = t * t, t3 = t2 * t;
+    table[v] = to_byte((2 * t3 - 3 * t2 + 1) * points[k][1] +
+                       (t3 - 2 * t2 + t) * h * tangent[k] +
+                       (-2 * t3 + 3 * t2) * points[k + 1][1] +
+                       (t3 - t2) * h * tangent[k + 1]);
+  }
+
+  return image_lut_map(lut, channels, table);
+}
+
+static void lut_band(image_t image, u32 y0, u32 y1, void *arg) {
+  const uc(*tables)[256] = arg;
+  size_t offset = (size_t)y0 * image.width * image.channels;
+  kernels.lut(&image.data[offset], (size_t)(y1 - y0) * image.width, tables,
+              image.channels);
+}
+
+int image_lut_apply(image_t image, const image_lut_t *lut) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image) && image.channels <= 4, "invalid image",
+         return 1);
+  HANDLE(lut, "invalid value(s)", return 1);
+
+  // Tables in the order of the image channels
+  static const u8 order[4][4] = {{0}, {0, 3}, {0, 1, 2}, {0, 1, 2, 3}};
+  uc tables[4][256];
+  int identity = 1;
+  for (u8 c = 0; c < image.channels; c++) {
+    memcpy(tables[c], lut->tables[order[image.channels - 1][c]], 256);
+    for (int v = 0; v < 256 && identity; v++)
+      identity = tables[c][v] == v;
+  }
+  if (identity)
+    return 0;
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  image_parallel_for(image, 0, lut_band, tables);
+  trace_end();
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @brief Shared Thread Pool & Row-Band Scheduler
+ *
+ * Every multithreaded operation runs on one lazily started work-stealing
+ * pool (or the host's executor). Bands are claimed from a shared counter by
+ * the calling thread and by helper tasks alike, so a call completes even
+ * when no helper ever gets to run.
+ */
+
+#include "parallel.h"
+#include "pool.h"
+#include "trace.h"
+#include "util.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Rows worth splitting off on their own
+#define BAND_BYTES (16 << 10)
+
+static struct {
+  pthread_mutex_t lock;
+  unsigned threads; // 0 -> one per core
+  pool_t *pool;     // threads - 1 workers, started on first use
+
+  image_executor_fn submit;
+  void *user;
+} shared = {PTHREAD_MUTEX_INITIALIZER};
+
+// Items of one parallel_range call, freed by whoever finishes last
+typedef struct {
+  u32 count;
+  parallel_fn fn;
+  void *arg;
+
+  u32 next, done, refs;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+
+  trace_share_t trace; // counters of the helpers' items
+} job_t;
+
+static unsigned resolve(unsigned threads) {
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+
+  return threads;
+}
+
+void image_parallel_threads(unsigned threads) {
+  pthread_mutex_lock(&shared.lock);
+  if (resolve(threads) != resolve(shared.threads)) {
+    pool_destroy(shared.pool);
+    shared.pool = NULL;
+  }
+  shared.threads = threads;
+  pthread_mutex_unlock(&shared.lock);
+}
+
+unsigned image_parallel_count(void) {
+  pthread_mutex_lock(&shared.lock);
+  unsigned threads = resolve(shared.threads);
+  pthread_mutex_unlock(&shared.lock);
+
+  return threads;
+}
+
+void image_parallel_executor(image_executor_fn submit, void *user) {
+  pthread_mutex_lock(&shared.lock);
+  shared.submit = submit, shared.user = user;
+  pthread_mutex_unlock(&shared.lock);
+}
+
+void parallel_submit(image_task_fn fn, void *arg) {
+  pthread_mutex_lock(&shared.lock);
+  image_executor_fn submit = shared.submit;
+  void *user = shared.user;
+
+  unsigned threads = resolve(shared.threads);
+  if (!submit && !shared.pool && threads > 1) {
+    shared.pool = pool_create(threads - 1);
+    if (!shared.pool)
+      WARNING("failed to start threads, running on the caller");
+  }
+  pool_t *pool = shared.pool;
+  pthread_mutex_unlock(&shared.lock);
+
+  if (submit)
+    submit(fn, arg, user);
+  else if (pool)
+    pool_submit(pool, fn, arg);
+  else
+    fn(arg);
+}
+
+static void job_release(job_t *job) {
+  if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->finished);
+  free(job);
+}
+
+// Claim & run items until none are left
+static void job_run(job_t *job) {
+  u32 i;
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->count) {
+    trace_task_t task = trace_task_begin(&job->trace);
+    job->fn(i, job->arg);
+    trace_task_end(&job->trace, &task);
+
+    if (__atomic_add_fetch(&job->done, 1, __ATOMIC_ACQ_REL) == job->count) {
+      pthread_mutex_lock(&job->lock);
+      pthread_cond_broadcast(&job->finished);
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+}
+
+static void job_helper(void *arg) {
+  job_run(arg);
+  job_release(arg);
+}
+
+void parallel_range(u32 count, parallel_fn fn, void *arg) {
+  unsigned threads = image_parallel_count();
+  u32 helpers = count < threads ? count - 1 : threads - 1;
+  job_t *job = count && helpers ? malloc(sizeof(job_t)) : NULL;
+  if (!job) {
+    for (u32 i = 0; i < count; i++)
+      fn(i, arg);
+    return;
+  }
+
+  *job = (job_t){count, fn, arg, 0, 0, helpers + 1};
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->finished, NULL);
+  trace_share_begin(&job->trace);
+
+  for (u32 i = 0; i < helpers; i++)
+    parallel_submit(job_helper, job);
+
+  job_run(job);
+
+  pthread_mutex_lock(&job->lock);
+  while (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) < count)
+    pthread_cond_wait(&job->finished, &job->lock);
+  pthread_mutex_unlock(&job->lock);
+
+  trace_share_end(&job->trace);
+  job_release(job);
+}
+
+typedef struct {
+  image_t image;
+  u32 band;
+  image_band_fn fn;
+  void *user;
+} bands_t;
+
+static void band_run(u32 i, void *arg) {
+  const bands_t *b = arg;
+  u32 y0 = i * b->band;
+  u32 y1 = y0 + b->band < b->image.height ? y0 + b->band : b->image.height;
+  b->fn(b->image, y0, y1, b->user);
+}
+
+int image_parallel_for(image_t image, uint32_t band_height, image_band_fn fn,
+                       void *user) {
+  HANDLE(image_is_valid(image) && fn, "invalid value(s)", return 1);
+
+  if (band_height == 0) {
+    // a few bands per thread to even out, but none too small
+    unsigned threads = image_parallel_count();
+    size_t stride = (size_t)image.width * image.channels;
+    u32 min = stride < BAND_BYTES ? BAND_BYTES / stride : 1;
+
+    band_height = (image.height + threads * 4 - 1) / (threads * 4);
+    if (band_height < min)
+      band_height = min;
+  }
+
+  bands_t b = {image, band_height, fn, user};
+  parallel_range((image.height + band_height - 1) / band_height, band_run, &b);
+
+  return 0;
+}
@@ -0,0 +1,19 @@
+/**
+ * @brief Shared Thread Pool
+ */
+
+#pragma once
+
+#include "types.h"
+#include <image.h>
+
+// Run fn(arg) on the host executor or the shared pool (right away when the
+// library is limited to one thread)
+void parallel_submit(image_task_fn fn, void *arg);
+
+// Item i of a parallel_range call
+typedef void (*parallel_fn)(u32 i, void *arg);
+
+// Run fn(i, arg) for every i below count on the calling thread and helper
+// tasks, returns once all finished
+void parallel_range(u32 count, parallel_fn fn, void *arg);
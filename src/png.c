@@ -2,10 +2,15 @@
  * @brief PNG Loading & Saving
  */
 
+#include "kernel.h"
+#include "reader.h"
+#include "scale.h"
+#include "trace.h"
 #include "util.h"
 #include <image.h>
 
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <zconf.h>
@@ -13,21 +18,39 @@
 
 #define IS_CRITICAL(type) ('A' <= (type)[0] && (type)[0] <= 'Z')
 
+// Paeth predictor
+static uc paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// zlib allocations, counted by the instrumentation
+static voidpf z_alloc(voidpf opaque, uInt items, uInt size) {
+  trace_alloc((size_t)items * size);
+  return malloc((size_t)items * size);
+}
+
+static void z_free(voidpf opaque, voidpf address) { free(address); }
+
 image_t *image_load_png(const char *path) {
-  FILE *f = fopen(path, "rb");
-  HANDLE(f, "no such file", return NULL);
+  TRACE_CALL();
+  return image_load_png_scaled(path, 1);
+}
+
+static image_t *png_decode(reader_t *r, u8 scale) {
+  HANDLE(scaler_valid(scale), "scale must be 1, 2, 4 or 8", return NULL);
+  trace_begin(IMAGE_STAGE_HEADER);
 
   // Read Header
   char header[8];
-  HANDLE(fread(header, 8, 1, f), "failed to read header", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(reader_read(r, header, 8, 1), "failed to read header", return NULL);
 
-  HANDLE(!strncasecmp(header, "\x89PNG\x0D\x0A\x1A\x0A", 8), "invalid header", {
-    fclose(f);
-    return NULL;
-  });
+  HANDLE(!strncasecmp(header, "\x89PNG\x0D\x0A\x1A\x0A", 8), "invalid header",
+         return NULL);
 
   // Read Chunks
   struct {
@@ -38,12 +61,47 @@ image_t *image_load_png(const char *path) {
     uint8_t compressionMethod;
     uint8_t filterMethod;
     uint8_t interlanceMethod;
-  } ihdr;
+  } ihdr = {};
 
+  // Palette (R-G-B-A)
   struct {
-    size_t size;
+    uint32_t size;
+    uc entries[256][4];
+  } plte = {};
+  int transparent = 0;
+
+  // Scanlines are inflated one at a time, unfiltered against the previous
+  // one and reduced on the fly, so the full image is never in memory
+  struct {
+    z_stream z;
+    int started;
+    u32 samples;  // samples per pixel
+    u32 bpp;      // bytes per complete pixel (>= 1)
+    u32 length;   // scanline length (without filter byte)
+    uc *line;     // filter byte + current scanline
+    uc *prev;     // previous scanline
+    scaler_t out; // reduced output
+  } idat = {};
+
+  struct {
+    uint32_t size;
     unsigned char *data;
-  } idat = {0, NULL};
+  } buffer = {0, NULL};
+
+  image_t *out = NULL;
+
+// Current Exit Procedure
+#define EXIT                                                                   \
+  {                                                                            \
+    if (idat.started) {                                                        \
+      inflateEnd(&idat.z);                                                     \
+      scaler_abort(&idat.out);                                                 \
+    }                                                                          \
+    free(idat.line);                                                           \
+    free(idat.prev);                                                           \
+    free(buffer.data);                                                         \
+    return out;                                                                \
+  }
 
   while (1) {
     // Chunk Data
@@ -55,48 +113,37 @@ image_t *image_load_png(const char *path) {
     } chunk;
 
     // Read Chunk Length & Type
-    HANDLE(fread(&chunk.length, 4, 1, f) && fread(chunk.type, 4, 1, f),
-           "unexpected error", {
-             free(idat.data);
-             fclose(f);
-             return NULL;
-           });
+    HANDLE(reader_read(r, &chunk.length, 4, 1) &&
+               reader_read(r, chunk.type, 4, 1),
+           "unexpected error", EXIT);
 
     chunk.length = __builtin_bswap32(chunk.length);
 
-    // Read Data
-    if (chunk.length > 0) {
-      // Allocate Memory
-      chunk.data = (unsigned char *)malloc(chunk.length);
-      HANDLE(chunk.data, "failed to allocate chunk", {
-        if (IS_CRITICAL(chunk.type)) {
-          free(idat.data);
-          fclose(f);
-          return NULL;
-        } else
-          continue;
-      })
-
-      // Read Data
-      HANDLE(fread(chunk.data, chunk.length, 1, f), "failed to read data", {
-        if (IS_CRITICAL(chunk.type)) {
-          free(chunk.data);
-          free(idat.data);
-          fclose(f);
-          return NULL;
-        } else {
-          free(chunk.data);
-          continue;
-        }
-      });
+    // Skip unknown ancillary chunks without reading them
+    if (!IS_CRITICAL(chunk.type) && strncmp(chunk.type, "tRNS", 4)) {
+      reader_seek(r, chunk.length + 4, SEEK_CUR);
+      continue;
+    }
+
+    // Read Data (into a buffer reused between chunks)
+    if (chunk.length > buffer.size) {
+      unsigned char *d = realloc(buffer.data, chunk.length);
+      HANDLE(d, "failed to allocate chunk", EXIT);
+      trace_alloc(chunk.length - buffer.size);
+      buffer.data = d, buffer.size = chunk.length;
     }
 
+    chunk.data = buffer.data;
+    HANDLE(chunk.length == 0 || reader_read(r, chunk.data, chunk.length, 1),
+           "failed to read data", EXIT);
+
     // Read Chunk CRC
-    HANDLE(fread(&chunk.crc, 4, 1, f), "failed to read crc",
-           fseek(f, 4, SEEK_CUR););
+    HANDLE(reader_read(r, &chunk.crc, 4, 1), "failed to read crc", EXIT);
     chunk.crc = __builtin_bswap32(chunk.crc);
 
-    if (!strncasecmp(chunk.type, "IHDR", 4)) {
+    if (!strncmp(chunk.type, "IHDR", 4)) {
+      HANDLE(chunk.length == 13, "invalid ihdr size", EXIT);
+
       // Image Info
       ihdr.width = *(uint32_t *)&chunk.data[0];
       ihdr.height = *(uint32_t *)&chunk.data[4];
@@ -106,12 +153,13 @@ image_t *image_load_png(const char *path) {
       ihdr.filterMethod = *(uint8_t *)&chunk.data[11];
       ihdr.interlanceMethod = *(uint8_t *)&chunk.data[12];
 
-      ihdr.width = __bswap_32(ihdr.width);
-      ihdr.height = __bswap_32(ihdr.height);
+      ihdr.width = __builtin_bswap32(ihdr.width);
+      ihdr.height = __builtin_bswap32(ihdr.height);
 
       int palette = ihdr.colorType & 1 << 0;
       int color = ihdr.colorType & 1 << 1;
       int alpha = ihdr.colorType & 1 << 2;
+      u8 depth = ihdr.bitDepth;
 
       int err = 0;
 
@@ -119,12 +167,20 @@ image_t *image_load_png(const char *path) {
       HANDLE(ihdr.width != 0 && ihdr.height != 0, "invalid ihdr size",
              err = 1;);
 
-      HANDLE((!color || !alpha) && ihdr.bitDepth >= 8, "invalid bit depth",
-             err = 1;);
+      HANDLE(ihdr.colorType == 0 || ihdr.colorType == 2 ||
+                 ihdr.colorType == 3 || ihdr.colorType == 4 ||
+                 ihdr.colorType == 6,
+             "invalid color type", err = 1;);
 
-      HANDLE((!palette || !color) && ihdr.bitDepth <= 8, "invalid bit depth",
+      HANDLE(depth == 1 || depth == 2 || depth == 4 || depth == 8 ||
+                 depth == 16,
+             "invalid bit depth", err = 1;);
+
+      HANDLE(palette || (!color && !alpha) || depth >= 8, "invalid bit depth",
              err = 1;);
 
+      HANDLE(!palette || depth <= 8, "invalid bit depth", err = 1;);
+
       HANDLE(ihdr.compressionMethod == 0, "unknown compression method",
              err = 1;);
       HANDLE(ihdr.filterMethod == 0, "unknown filter method", err = 1;);
@@ -132,109 +188,378 @@ image_t *image_load_png(const char *path) {
              err = 1;);
 
       // exit if test(s) fail(s)
-      if (err) {
-        free(chunk.data);
-        free(idat.data);
-        fclose(f);
-        return NULL;
-      }
+      if (err)
+        EXIT;
+
+      idat.samples = palette ? 1 : (color ? 3 : 1) + (alpha ? 1 : 0);
+      idat.bpp = (idat.samples * depth + 7) / 8;
+      idat.length = ((u64)ihdr.width * idat.samples * depth + 7) / 8;
 
       // TODO: check chunk order
-    } else if (!strncasecmp(chunk.type, "PLTE", 4)) {
-      HANDLE(chunk.length % 3 == 0, "invalid palette size", {
-        free(chunk.data);
-        free(idat.data);
-        fclose(f);
-        return NULL;
-      });
+    } else if (!strncmp(chunk.type, "PLTE", 4)) {
+      HANDLE(chunk.length % 3 == 0 && chunk.length <= 256 * 3,
+             "invalid palette size", EXIT);
+
+      plte.size = chunk.length / 3;
+      for (u32 i = 0; i < plte.size; i++) {
+        memcpy(plte.entries[i], &chunk.data[i * 3], 3);
+        plte.entries[i][3] = 255;
+      }
+    } else if (!strncmp(chunk.type, "tRNS", 4)) {
+      // only palette transparency is kept
+      if (ihdr.colorType == 3) {
+        for (u32 i = 0; i < chunk.length && i < 256; i++)
+          plte.entries[i][3] = chunk.data[i];
+        transparent = 1;
+      }
+    } else if (!strncmp(chunk.type, "IDAT", 4)) {
+      if (!idat.started) {
+        HANDLE(ihdr.width != 0, "missing ihdr", EXIT);
+        HANDLE(ihdr.colorType != 3 || plte.size > 0, "missing palette", EXIT);
+
+        idat.line = malloc(idat.length + 1);
+        idat.prev = calloc(idat.length, 1);
+        HANDLE(idat.line && idat.prev, "failed to allocate scanlines", EXIT);
+        trace_alloc(idat.length * 2 + 1);
+
+        u8 channels =
+            ihdr.colorType == 3 ? (transparent ? 4 : 3) : idat.samples;
+        HANDLE(
+            !scaler_init(&idat.out, ihdr.width, ihdr.height, channels, scale),
+            "failed to create image", EXIT);
+
+        idat.z.zalloc = z_alloc, idat.z.zfree = z_free;
+        HANDLE(inflateInit(&idat.z) == Z_OK, "failed to initialize zlib", {
+          scaler_abort(&idat.out);
+          EXIT;
+        });
+
+        idat.started = 1;
+        trace_end(); // header
+        idat.z.next_out = idat.line;
+        idat.z.avail_out = idat.length + 1;
+      }
 
-      uint8_t entries = chunk.length / 3;
-      unsigned char palette[entries][3];
-
-      ERROR("palette is not yet supported");
-      free(chunk.data);
-      free(idat.data);
-      fclose(f);
-      return NULL;
-
-      //   int err = 0;
-
-      //   if (fread(palette, 3, entries, f) != entries) {
-      //     // Failed to read palette
-      //     printf("Failed to read Palette\n");
-      //     return out;
-      //   }
-
-      // TODO: store palette
-    } else if (!strncasecmp(chunk.type, "IDAT", 4)) {
-      size_t cursor = idat.size;
-      idat.size += chunk.length;
-      unsigned char *d = NULL;
-      if (idat.data == NULL)
-        d = (unsigned char *)malloc(chunk.length);
-      else
-        d = (unsigned char *)realloc(idat.data, idat.size);
-
-      HANDLE(d, "failed to allocate memory", {
-        free(chunk.data);
-        free(idat.data);
-        fclose(f);
-        return NULL;
-      });
-      idat.data = d;
-
-      for (int i = 0; i < chunk.length; i++)
-        idat.data[cursor + i] = chunk.data[i];
-    } else if (!strncasecmp(chunk.type, "IEND", 4)) {
-      // TODO: finish up & return image
-
-      // Decompress Data
-      uLong dstSize =
-          ihdr.width * ihdr.height * ihdr.bitDepth; // TODO: color type
-      unsigned char *dst =
-          (unsigned char *)malloc(sizeof(unsigned char) * dstSize);
-      int result = uncompress((Bytef *)dst, &dstSize, (const Bytef *)idat.data,
-                              idat.size);
-
-      // TODO channels
-      image_t *out = image_allocate(ihdr.width, ihdr.height, 3);
-      HANDLE(out, "failed to create image", {});
-
-      if (result) {
-        printf("Failed to Decompress Image\n");
-        return out;
+      idat.z.next_in = chunk.data;
+      idat.z.avail_in = chunk.length;
+
+      while (idat.z.avail_in > 0 && !scaler_done(&idat.out)) {
+        trace_begin(IMAGE_STAGE_DECODE);
+        int result = inflate(&idat.z, Z_NO_FLUSH);
+        trace_end();
+
+        HANDLE(result == Z_OK || result == Z_STREAM_END,
+               "failed to decompress image", EXIT);
+
+        if (idat.z.avail_out > 0) {
+          if (result == Z_STREAM_END)
+            break;
+          continue;
+        }
+
+        // Scanline complete
+        uc *line = &idat.line[1];
+        HANDLE(idat.line[0] <= 4, "invalid filter type", EXIT);
+
+        // prev is zeros for the first scanline
+        trace_begin(IMAGE_STAGE_UNFILTER);
+        kernels.unfilter[idat.line[0]](line, idat.prev, idat.length, idat.bpp);
+        trace_end();
+
+        trace_begin(IMAGE_STAGE_CONVERT);
+        uc *row = scaler_row(&idat.out);
+        u8 depth = ihdr.bitDepth;
+        u32 mask = (1 << depth) - 1;
+
+        if (depth == 8 && ihdr.colorType != 3) {
+          memcpy(row, line, idat.length);
+        } else if (depth == 16) {
+          // keep the most significant byte
+          for (u32 i = 0; i < ihdr.width * idat.samples; i++)
+            row[i] = line[i * 2];
+        } else {
+          // unpack (sub-byte) grayscale samples & palette indices
+          for (u32 x = 0; x < ihdr.width; x++) {
+            u32 bit = x * depth;
+            u8 v = depth == 8 ? line[x]
+                              : (line[bit / 8] >> (8 - depth - bit % 8)) & mask;
+
+            if (ihdr.colorType == 3)
+              memcpy(&row[x * idat.out.channels], plte.entries[v],
+                     idat.out.channels);
+            else
+              row[x] = v * 255 / mask;
+          }
+        }
+
+        scaler_push(&idat.out);
+        trace_end();
+
+        memcpy(idat.prev, line, idat.length);
+
+        idat.z.next_out = idat.line;
+        idat.z.avail_out = idat.length + 1;
       }
+    } else if (!strncmp(chunk.type, "IEND", 4)) {
+      HANDLE(idat.started, "missing image data", EXIT);
 
-      // TODO filtering
-      switch (ihdr.filterMethod) {
-      default:
-      case 0: // None
-        break;
+      inflateEnd(&idat.z);
+      idat.started = 0;
 
-      case 1: // Sub
-        break;
+      out = scaler_finish(&idat.out);
+      EXIT;
+    } else {
+      ERROR("unsupported critical chunk");
+      EXIT;
+    }
+  }
 
-      case 2: // Up
+#undef EXIT
+}
+
+image_t *image_load_png_scaled(const char *path, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  HANDLE(!reader_open(&r, path), "no such file", return NULL);
+
+  image_t *out = png_decode(&r, scale);
+  reader_close(&r);
+
+  return out;
+}
+
+image_t *image_decode_png(const void *data, size_t size, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  reader_memory(&r, data, size);
+
+  return png_decode(&r, scale);
+}
+
+// Write one chunk (length, type, data, crc)
+static int write_chunk(FILE *f, const char *type, const uc *data, u32 length) {
+  u32 crc = crc32(0, (const Bytef *)type, 4);
+  if (length > 0)
+    crc = crc32(crc, data, length);
+
+  u32 be_length = __builtin_bswap32(length), be_crc = __builtin_bswap32(crc);
+
+  return fwrite(&be_length, 4, 1, f) && fwrite(type, 4, 1, f) &&
+         (length == 0 || fwrite(data, length, 1, f)) &&
+         fwrite(&be_crc, 4, 1, f);
+}
+
+// Filter one scanline with the type that has the smallest sum of absolute
+// differences (libpng heuristic), out receives filter byte + scanline
+// (trial holds length bytes)
+static void filter(uc *out, uc *trial, const uc *row, const uc *prev,
+                   u32 length, u32 bpp) {
+  u64 best = (u64)-1;
+
+  for (u8 type = 0; type <= 4; type++) {
+    u64 sum = 0;
+    for (u32 i = 0; i < length; i++) {
+      uc a = i >= bpp ? row[i - bpp] : 0;
+      uc b = prev ? prev[i] : 0;
+      uc c = prev && i >= bpp ? prev[i - bpp] : 0;
+
+      uc v = row[i];
+      switch (type) {
+      case 1:
+        v -= a;
         break;
-
-      case 3: // Avarage
+      case 2:
+        v -= b;
         break;
-
-      case 4: // Paeth
+      case 3:
+        v -= (a + b) / 2;
+        break;
+      case 4:
+        v -= paeth(a, b, c);
         break;
       }
 
-      return out;
+      trial[i] = v;
+      sum += v < 128 ? v : 256 - v;
+    }
+
+    if (sum < best) {
+      best = sum;
+      out[0] = type;
+      memcpy(&out[1], trial, length);
+    }
+  }
+}
+
+// Scanlines filtered ahead of deflate at once (in parallel)
+#define FILTER_BYTES (1 << 20)
+
+typedef struct {
+  u32 first;   // row of the view in the image
+  uc *lines;   // filter byte + scanline of every row
+  int indexed; // palette indices are not filtered
+} filter_t;
+
+static void filter_band(image_t rows, u32 y0, u32 y1, void *arg) {
+  const filter_t *f = arg;
+  u32 length = rows.width * rows.channels;
+
+  // without room for trials, rows are left unfiltered
+  uc *trial = f->indexed ? NULL : malloc(length);
+
+  for (u32 y = y0; y < y1; y++) {
+    const uc *row = &rows.data[(size_t)y * length];
+    uc *out = &f->lines[(size_t)y * (length + 1)];
+
+    if (!trial) {
+      out[0] = 0;
+      memcpy(&out[1], row, length);
     } else {
-      free(chunk.data);
+      filter(out, trial, row, f->first + y > 0 ? row - length : NULL,
+             length, rows.channels);
+    }
+  }
 
-      if (IS_CRITICAL(chunk.type)) {
-        free(idat.data);
-        fclose(f);
-        return NULL;
-      }
+  free(trial);
+}
+
+// Write image as color type, with the palette of indexed ones (colors > 0)
+static int png_write(image_t image, u8 color_type, const uc (*palette)[4],
+                     u32 colors, const char *path) {
+  FILE *f = trace_fopen(path, "wb");
+  HANDLE(f, "failed to create file", return 1);
+
+  // Write Header
+  uc ihdr[13];
+  *(u32 *)&ihdr[0] = __builtin_bswap32(image.width);
+  *(u32 *)&ihdr[4] = __builtin_bswap32(image.height);
+  ihdr[8] = 8;          // bit depth
+  ihdr[9] = color_type; // color type
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  HANDLE(fwrite("\x89PNG\x0D\x0A\x1A\x0A", 8, 1, f) &&
+             write_chunk(f, "IHDR", ihdr, 13),
+         "failed to write header", {
+           fclose(f);
+           return 1;
+         });
+
+  // Palette, alpha up to the last translucent entry
+  if (colors) {
+    uc plte[256 * 3], trns[256];
+    u32 translucent = 0;
+    for (u32 i = 0; i < colors; i++) {
+      memcpy(&plte[i * 3], palette[i], 3);
+      trns[i] = palette[i][3];
+      if (trns[i] != 255)
+        translucent = i + 1;
     }
+
+    HANDLE(write_chunk(f, "PLTE", plte, colors * 3) &&
+               (!translucent || write_chunk(f, "tRNS", trns, translucent)),
+           "failed to write palette", {
+             fclose(f);
+             return 1;
+           });
   }
 
-  return NULL;
-}
\ No newline at end of file
+  // Groups of scanlines are filtered, then deflated into IDAT chunks
+  u32 length = image.width * image.channels;
+  u32 group = length + 1 < FILTER_BYTES ? FILTER_BYTES / (length + 1) : 1;
+  if (group > image.height)
+    group = image.height;
+
+  uc *lines = malloc((size_t)group * (length + 1));
+  uc *chunk = malloc(1 << 16);
+  trace_alloc((size_t)group * (length + 1) + (1 << 16));
+
+  z_stream z = {.zalloc = z_alloc, .zfree = z_free};
+  HANDLE(lines && chunk && deflateInit(&z, Z_DEFAULT_COMPRESSION) == Z_OK,
+         "failed to initialize zlib", {
+           free(lines);
+           free(chunk);
+           fclose(f);
+           return 1;
+         });
+
+  z.next_out = chunk;
+  z.avail_out = 1 << 16;
+
+  trace_begin(IMAGE_STAGE_ENCODE);
+
+  int err = 0;
+  for (u32 y = 0, rows = 0; y <= image.height && !err; y += rows) {
+    int last = y == image.height;
+
+    if (!last) {
+      rows = image.height - y < group ? image.height - y : group;
+      image_t view = {image.width, rows, image.channels,
+                      &image.data[(size_t)y * length]};
+      filter_t ft = {y, lines, colors > 0};
+      image_parallel_for(view, 0, filter_band, &ft);
+
+      z.next_in = lines;
+      z.avail_in = rows * (length + 1);
+    }
+
+    // Deflate until input is consumed (and the stream ended on the last row)
+    int result;
+    do {
+      result = deflate(&z, last ? Z_FINISH : Z_NO_FLUSH);
+      HANDLE(result != Z_STREAM_ERROR, "failed to compress image", {
+        err = 1;
+        break;
+      });
+
+      if (z.avail_out == 0 || (last && result == Z_STREAM_END)) {
+        u32 size = (1 << 16) - z.avail_out;
+        HANDLE(size == 0 || write_chunk(f, "IDAT", chunk, size),
+               "failed to write image data", {
+                 err = 1;
+                 break;
+               });
+
+        z.next_out = chunk;
+        z.avail_out = 1 << 16;
+      }
+    } while (last ? result != Z_STREAM_END : z.avail_in > 0);
+  }
+
+  trace_end();
+
+  deflateEnd(&z);
+  free(lines);
+  free(chunk);
+
+  HANDLE(!err && write_chunk(f, "IEND", NULL, 0), "failed to write image", {
+    fclose(f);
+    return 1;
+  });
+
+  fclose(f);
+
+  return 0;
+}
+
+int image_save_png(image_t image, const char *path) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+  HANDLE(image.channels <= 4, "too many channels", return 1);
+
+  // gray, gray + alpha, rgb, rgba
+  static const u8 color_types[] = {0, 4, 2, 6};
+
+  return png_write(image, color_types[image.channels - 1], NULL, 0, path);
+}
+
+int image_save_png_indexed(const image_indexed_t *image, const char *path) {
+  TRACE_CALL();
+  HANDLE(image && image->colors && image->colors <= 256, "invalid image",
+         return 1);
+
+  image_t indices = {image->width, image->height, 1, image->data};
+  HANDLE(image_is_valid(indices), "invalid image", return 1);
+
+  return png_write(indices, 3, (const uc(*)[4])image->palette, image->colors,
+                   path);
+}
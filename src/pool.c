@@ -0,0 +1,233 @@
+/**
+ * @brief Work-Stealing Thread Pool
+ */
+
+#include "pool.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  pool_fn fn;
+  void *arg;
+} task_t;
+
+// Growable ring of tasks; owner works at the bottom, thieves take the top
+typedef struct {
+  pthread_mutex_t lock;
+  task_t *tasks;
+  unsigned size, top, count;
+
+  pool_t *pool; // owner
+  unsigned index;
+} deque_t;
+
+struct pool {
+  pthread_t *threads;
+  deque_t *deques;
+  unsigned count;
+  unsigned next; // round-robin target for outside submissions
+
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signaled on submit
+  pthread_cond_t idle; // signaled when pending reaches 0
+  unsigned long pending, queued;
+  int stop;
+};
+
+// Index of the calling worker (-1 outside the pool)
+static __thread int worker = -1;
+static __thread pool_t *worker_pool = NULL;
+
+static int deque_push(deque_t *d, task_t task) {
+  pthread_mutex_lock(&d->lock);
+
+  if (d->count == d->size) {
+    unsigned size = d->size ? d->size * 2 : 64;
+    task_t *tasks = malloc(size * sizeof(task_t));
+    if (!tasks) {
+      pthread_mutex_unlock(&d->lock);
+      return 1;
+    }
+
+    for (unsigned i = 0; i < d->count; i++)
+      tasks[i] = d->tasks[(d->top + i) % d->size];
+
+    free(d->tasks);
+    d->tasks = tasks, d->size = size, d->top = 0;
+  }
+
+  d->tasks[(d->top + d->count++) % d->size] = task;
+
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+// Take newest (own deque) or oldest (stealing) task
+static int deque_pop(deque_t *d, task_t *task, int steal) {
+  pthread_mutex_lock(&d->lock);
+
+  int found = d->count > 0;
+  if (found && steal) {
+    *task = d->tasks[d->top];
+    d->top = (d->top + 1) % d->size, d->count--;
+  } else if (found) {
+    *task = d->tasks[(d->top + --d->count) % d->size];
+  }
+
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Own deque first, then steal from the others
+static int pool_take(pool_t *pool, unsigned self, task_t *task) {
+  if (deque_pop(&pool->deques[self], task, 0))
+    return 1;
+
+  for (unsigned i = 1; i < pool->count; i++)
+    if (deque_pop(&pool->deques[(self + i) % pool->count], task, 1))
+      return 1;
+
+  return 0;
+}
+
+static void *pool_worker(void *arg) {
+  deque_t *own = arg;
+  pool_t *pool = own->pool;
+  unsigned self = own->index;
+
+  worker = self, worker_pool = pool;
+
+  while (1) {
+    task_t task;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->queued && !pool->stop)
+      pthread_cond_wait(&pool->work, &pool->lock);
+
+    if (!pool->queued && pool->stop) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // counted before pushed, so the task may not be visible yet
+    if (!pool_take(pool, self, &task))
+      continue;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    task.fn(task.arg);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+pool_t *pool_create(unsigned threads) {
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+
+  pool_t *pool = calloc(1, sizeof(pool_t));
+  if (!pool)
+    return NULL;
+
+  pool->count = threads;
+  pool->threads = calloc(threads, sizeof(pthread_t));
+  pool->deques = calloc(threads, sizeof(deque_t));
+  if (!pool->threads || !pool->deques) {
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  for (unsigned i = 0; i < threads; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pool->deques[i].pool = pool, pool->deques[i].index = i;
+  }
+
+  for (unsigned i = 0; i < threads; i++)
+    pthread_create(&pool->threads[i], NULL, pool_worker, &pool->deques[i]);
+
+  return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+  if (!pool)
+    return;
+
+  pool_wait(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (unsigned i = 0; i < pool->count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for (unsigned i = 0; i < pool->count; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+
+  free(pool->threads);
+  free(pool->deques);
+  free(pool);
+}
+
+unsigned pool_threads(const pool_t *pool) { return pool->count; }
+
+void pool_submit(pool_t *pool, pool_fn fn, void *arg) {
+  unsigned target;
+
+  pthread_mutex_lock(&pool->lock);
+  target = worker_pool == pool ? (unsigned)worker : pool->next++ % pool->count;
+  pool->pending++, pool->queued++;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!deque_push(&pool->deques[target], (task_t){fn, arg})) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  // run inline rather than lose the task
+  pthread_mutex_lock(&pool->lock);
+  pool->queued--;
+  pthread_mutex_unlock(&pool->lock);
+
+  fn(arg);
+
+  pthread_mutex_lock(&pool->lock);
+  if (--pool->pending == 0)
+    pthread_cond_broadcast(&pool->idle);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,25 @@
+/**
+ * @brief Work-Stealing Thread Pool
+ */
+
+#pragma once
+
+typedef struct pool pool_t;
+
+typedef void (*pool_fn)(void *arg);
+
+// Start pool with threads workers (0 -> one per core)
+pool_t *pool_create(unsigned threads);
+
+// Stop workers (after pending tasks finished) and free pool
+void pool_destroy(pool_t *pool);
+
+// Number of workers
+unsigned pool_threads(const pool_t *pool);
+
+// Queue task; from a worker it goes to that worker's own deque (run next,
+// stealable by idle workers), otherwise to the workers round-robin
+void pool_submit(pool_t *pool, pool_fn fn, void *arg);
+
+// Wait until every submitted task (and the tasks they submitted) finished
+void pool_wait(pool_t *pool);
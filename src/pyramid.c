@@ -0,0 +1,181 @@
+/**
+ * @brief Image Pyramids
+ *
+ * A level row is reduced from the rows above as soon as they exist, so one
+ * pass over the source builds every level while the rows it reads are
+ * still in cache. Box pyramids split the source into bands aligned to the
+ * first BAND_LEVELS levels, which are independent and run in parallel; the
+ * levels below are then built from the last of those.
+ */
+
+#include "kernel.h"
+#include "parallel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+// Levels box bands build (bands are aligned to 2^BAND_LEVELS source rows)
+#define BAND_LEVELS 4
+
+typedef struct {
+  image_t src;
+  const image_pyramid_t *pyramid;
+  image_pyramid_filter_t filter;
+  u32 base, last; // bands are rows of level base, levels to last are built
+} build_t;
+
+// Level l, 0 being the source
+static image_t level(const build_t *b, u32 l) {
+  return l ? b->pyramid->levels[l - 1] : b->src;
+}
+
+// Row y of image, edges repeat
+static const uc *row(image_t image, i64 y) {
+  y = y < 0 ? 0 : y >= image.height ? image.height - 1 : y;
+  return &image.data[(size_t)y * image.width * image.channels];
+}
+
+// Last row of the level above that row y of level l reads
+static u32 needs(const build_t *b, u32 l, u32 y) {
+  u32 last = level(b, l - 1).height - 1;
+  u32 need = y * 2 + (b->filter == IMAGE_PYRAMID_TENT ? 2 : 1);
+  return need < last ? need : last;
+}
+
+static void reduce(const build_t *b, u32 l, u32 y) {
+  image_t above = level(b, l - 1), out = level(b, l);
+  uc *dst = &out.data[(size_t)y * out.width * out.channels];
+
+  if (b->filter == IMAGE_PYRAMID_TENT) {
+    const uc *rows[4];
+    for (int k = 0; k < 4; k++)
+      rows[k] = row(above, (i64)y * 2 - 1 + k);
+    kernels.reduce_tent(dst, rows, above.width, above.channels);
+  } else {
+    const uc *top = row(above, (i64)y * 2);
+    const uc *bottom = row(above, (i64)y * 2 + 1);
+    kernels.reduce_box(dst, top, bottom, above.width, above.channels);
+  }
+}
+
+// Level rows covered by rows y0 to y1 of level base, y0 being a multiple of
+// 2^(last - base) (tent pyramids are a single band)
+static void build_band(image_t image, u32 y0, u32 y1, void *arg) {
+  const build_t *b = arg;
+  u32 base = b->base, last = b->last;
+
+  // next row & end of each level within the band, the base is all there
+  u32 next[last + 1], end[last + 1];
+  next[base] = end[base] = y1;
+  for (u32 l = base + 1, start = y0; l <= last; l++) {
+    next[l] = start /= 2;
+    end[l] = (end[l - 1] + 1) / 2;
+  }
+
+  while (next[base + 1] < end[base + 1]) {
+    reduce(b, base + 1, next[base + 1]++);
+
+    for (u32 l = base + 2; l <= last; l++)
+      while (next[l] < end[l] && needs(b, l, next[l]) < next[l - 1])
+        reduce(b, l, next[l]++);
+  }
+}
+
+image_pyramid_t *image_build_pyramid(image_t image, uint32_t levels,
+                                     image_pyramid_filter_t filter) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image) && image.channels <= 4, "invalid image",
+         return NULL);
+  HANDLE(filter == IMAGE_PYRAMID_BOX || filter == IMAGE_PYRAMID_TENT,
+         "unknown filter", return NULL);
+
+  // Level sizes, down to 1x1 at most
+  u32 count = 0, width = image.width, height = image.height;
+  size_t size = 0;
+  for (; (width > 1 || height > 1) && (!levels || count < levels); count++) {
+    width = (width + 1) / 2, height = (height + 1) / 2;
+    size += (size_t)width * height * image.channels;
+  }
+  HANDLE(count, "image is a single pixel", return NULL);
+
+  // Header, levels & their data in one block
+  size_t head = sizeof(image_pyramid_t) + count * sizeof(image_t);
+  image_pyramid_t *out = malloc(head + size);
+  HANDLE(out, "failed to allocate pyramid", return NULL);
+  trace_alloc(head + size);
+
+  out->count = count;
+  out->levels = (image_t *)&out[1];
+
+  uc *data = (uc *)&out->levels[count];
+  width = image.width, height = image.height;
+  for (u32 l = 0; l < count; l++) {
+    width = (width + 1) / 2, height = (height + 1) / 2;
+    out->levels[l] = (image_t){width, height, image.channels, data};
+    data += (size_t)width * height * image.channels;
+  }
+
+  build_t b = {image, out, filter, 0, count};
+  trace_begin(IMAGE_STAGE_CONVERT);
+  if (filter == IMAGE_PYRAMID_TENT) {
+    build_band(image, 0, image.height, &b);
+  } else {
+    // a few bands per thread, whole rows of the first levels each
+    b.last = count < BAND_LEVELS ? count : BAND_LEVELS;
+
+    unsigned threads = image_parallel_count();
+    u32 align = 1u << b.last;
+    u64 band = (image.height + threads * 4 - 1) / (threads * 4);
+    band = (band + align - 1) / align * align;
+
+    image_parallel_for(image, band < image.height ? band : image.height,
+                       build_band, &b);
+
+    // the rest from the last of those (1/4^BAND_LEVELS of the pixels)
+    if (b.last < count) {
+      b.base = b.last, b.last = count;
+      image_t above = level(&b, b.base);
+      build_band(above, 0, above.height, &b);
+    }
+  }
+  trace_end();
+
+  return out;
+}
+
+void image_pyramid_free(image_pyramid_t *pyramid) { free(pyramid); }
+
+typedef struct {
+  const image_pyramid_t *pyramid;
+  const char *prefix, *extension;
+  int *err;
+} save_t;
+
+static void save_level(u32 i, void *arg) {
+  const save_t *s = arg;
+  char path[strlen(s->prefix) + strlen(s->extension) + 16];
+  snprintf(path, sizeof(path), "%s%u.%s", s->prefix, i + 1, s->extension);
+
+  s->err[i] = image_save(s->pyramid->levels[i], path);
+}
+
+int image_save_pyramid(const image_pyramid_t *pyramid, const char *prefix,
+                       const char *extension) {
+  TRACE_CALL();
+  HANDLE(pyramid && pyramid->count && prefix && extension, "invalid value(s)",
+         return 1);
+
+  int err[pyramid->count];
+  save_t s = {pyramid, prefix, extension, err};
+  parallel_range(pyramid->count, save_level, &s);
+
+  int failed = 0;
+  for (u32 i = 0; i < pyramid->count; i++)
+    failed |= err[i];
+
+  return failed;
+}
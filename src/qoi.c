@@ -2,6 +2,11 @@
  * @brief QOI Loading & Saving
  */
 
+#include "kernel.h"
+#include "qoi.h"
+#include "reader.h"
+#include "scale.h"
+#include "trace.h"
 #include "util.h"
 #include <image.h>
 
@@ -12,120 +17,236 @@
 // hash rgba according to qoi specification
 #define HASH(R, G, B, A) (((R) * 3 + (G) * 5 + (B) * 7 + (A) * 11) % 64)
 
-image_t *image_load_qoi(const char *path) {
-  FILE *f = fopen(path, "rb");
-  HANDLE(f, "no such file", return NULL);
+//////////////////////////////// Chunks
 
-// Current Exit Procedure
-#define EXIT                                                                   \
-  {                                                                            \
-    fclose(f);                                                                 \
-    return NULL;                                                               \
-  }
+void qoi_init(qoi_state_t *q) {
+  memset(q, 0, sizeof(*q));
+  q->prev[3] = 255;
+}
 
-  // Read File Header
-  uc header[14];
-  HANDLE(fread(header, 14, 1, f), "failed to read header", EXIT);
-  HANDLE(!strncasecmp((char *)header, "QOIF", 4), "invalid file", EXIT);
+u32 qoi_encode_chunks(qoi_state_t *q, uc *out, const uc *pixels, u32 count,
+                      u8 channels) {
+  uc current[4] = {0, 0, 0, 255};
+  u32 n = 0;
 
-  u32 width = __bswap_32(*(u32 *)&header[4]),
-      height = __bswap_32(*(u32 *)&header[8]);
-  u8 channels = *(u8 *)&header[12];
+  for (u32 cursor = 0; cursor < count; cursor++) {
+    memcpy(current, &pixels[(size_t)cursor * channels], channels);
 
-  image_t *out = image_allocate(width, height, channels);
-  memset(out->data, 0, width * height * channels);
+    // Try encoding by repetition (the whole run at once)
+    if (!memcmp(current, q->prev, 4)) {
+      u32 left = count - cursor < 62u - q->run ? count - cursor : 62u - q->run;
+      u32 same = kernels.run(&pixels[(size_t)cursor * channels], left,
+                             channels, q->prev);
 
-  u32 array[64] = {};
-  uc prev[4] = {0, 0, 0, 255}; // previous color
-  u32 cursor = 0;
-  while (cursor < width * height) {
-    uc tag;
-    HANDLE(fread(&tag, 1, 1, f), "failed to read tag", break);
+      q->run += same, cursor += same - 1;
+      if (q->run == 62)
+        n += qoi_encode_end(q, &out[n]);
+      continue;
+    }
 
-    // ptr to current pixel
-    uc *current = &out->data[cursor * channels];
+    n += qoi_encode_end(q, &out[n]);
 
-    // 8 bit tags
-    if (tag == 0xFE) {
-      // RGB
-      HANDLE(fread(current, 3, 1, f), "failed to read rgb", continue);
+    // Try encoding by indexing
+    u32 id = HASH(current[0], current[1], current[2], current[3]);
+    if (!memcmp(q->array[id], current, 4)) {
+      out[n++] = 0b00000000 | id;
+      memcpy(q->prev, current, 4);
+      continue;
+    }
+    memcpy(q->array[id], current, 4);
 
-      if (channels == 4)
-        current[3] = prev[3];
+    // Try encoding by difference
+    const uc *prev = q->prev;
+    if (current[3] == prev[3]) {
+      // Diff
+      i8 raw[3] = {current[0] - prev[0], current[1] - prev[1],
+                   current[2] - prev[2]};
+      if ((raw[0] >= -2 && raw[0] <= 1) && (raw[1] >= -2 && raw[1] <= 1) &&
+          (raw[2] >= -2 && raw[2] <= 1)) {
+        u8 dr = raw[0] + 2, dg = raw[1] + 2, db = raw[2] + 2;
+        out[n++] = 0b01000000 | (dr << 4) | (dg << 2) | db;
+        memcpy(q->prev, current, 4);
+        continue;
+      }
 
-      array[HASH(current[0], current[1], current[2], prev[3])] = cursor;
-      memcpy(prev, current, channels); // TODO check
-      cursor++;
-    } else if (tag == 0xFF) {
-      // RGBA
-      HANDLE(fread(current, 4, 1, f), "failed to read rgba", continue);
+      // Luma
+      i8 drdg = raw[0] - raw[1], dbdg = raw[2] - raw[1];
+      if ((raw[1] >= -32 && raw[1] <= 31) && (drdg >= -8 && drdg <= 7) &&
+          (dbdg >= -8 && dbdg <= 7)) {
+        out[n++] = 0b10000000 | (raw[1] + 32);
+        out[n++] = ((drdg + 8) << 4) | (dbdg + 8);
+        memcpy(q->prev, current, 4);
+        continue;
+      }
 
-      memcpy(prev, current, channels); // TODO check
-      array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-      cursor++;
+      // RGB
+      out[n++] = 0b11111110;
+      memcpy(&out[n], current, 3);
+      n += 3;
     } else {
-      // 2 bit tags
-      if (tag >> 6 == 0x00) {
-        // index
-        u8 index = tag & 0x3F;
+      // RGBA
+      out[n++] = 0b11111111;
+      memcpy(&out[n], current, 4);
+      n += 4;
+    }
+
+    memcpy(q->prev, current, 4);
+  }
 
-        memcpy(current, &out->data[array[index] * channels], channels);
-        memcpy(prev, current, channels); // TODO check
-        cursor++;
+  return n;
+}
+
+u32 qoi_encode_end(qoi_state_t *q, uc *out) {
+  if (!q->run)
+    return 0;
+
+  out[0] = 0b11000000 | (q->run - 1);
+  q->run = 0;
+  return 1;
+}
+
+int qoi_decode_chunks(qoi_state_t *q, reader_t *r, uc *pixels, u32 count,
+                      u8 channels) {
+  uc *prev = q->prev;
+
+  for (u32 x = 0; x < count; x++) {
+    if (q->run > 0) {
+      q->run--;
+    } else if (!q->eof) {
+      uc tag;
+      if (!reader_read(r, &tag, 1, 1)) {
+        // truncated stream, fill the rest with black
+        ERROR("failed to read tag");
+        memcpy(prev, (uc[4]){0, 0, 0, 255}, 4);
+        q->eof = 1;
+      } else if (tag == 0xFE) {
+        // RGB
+        HANDLE(reader_read(r, prev, 3, 1), "failed to read rgb", return 1);
+      } else if (tag == 0xFF) {
+        // RGBA
+        HANDLE(reader_read(r, prev, 4, 1), "failed to read rgba", return 1);
+      } else if (tag >> 6 == 0x00) {
+        // index
+        memcpy(prev, q->array[tag & 0x3F], 4);
       } else if (tag >> 6 == 0x01) {
         // diff
         u8 dr = (tag >> 4) & 0x03, dg = (tag >> 2) & 0x03, db = tag & 0x03;
-        current[0] = prev[0] + (dr - 2);
-        current[1] = prev[1] + (dg - 2);
-        current[2] = prev[2] + (db - 2);
-
-        if (channels == 4)
-          current[3] = prev[3];
-
-        memcpy(prev, current, channels); // TODO check
-        array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-        cursor++;
+        prev[0] += dr - 2;
+        prev[1] += dg - 2;
+        prev[2] += db - 2;
       } else if (tag >> 6 == 0x02) {
         // luma
         u8 dg = (tag & 0x3F) - 32;
 
         uc drb;
-        HANDLE(fread(&drb, 1, 1, f), "failed to read rb difference", continue);
+        HANDLE(reader_read(r, &drb, 1, 1), "failed to read rb difference",
+               return 1);
 
         u8 drmdg = drb >> 4, dbmdg = drb & 0x0F;
-        u8 dr = drmdg + dg - 8, db = dbmdg + dg - 8;
-
-        current[0] = prev[0] + dr;
-        current[1] = prev[1] + dg;
-        current[2] = prev[2] + db;
-
-        if (channels == 4)
-          current[3] = prev[3];
-
-        memcpy(prev, current, channels); // TODO check
-        array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-        cursor++;
-      } else if (tag >> 6 == 0x03) {
-        // run
-        u8 run = (tag & 0b00111111) + 1;
-        for (int i = 0; i < run; i++) {
-          memcpy(&out->data[cursor * channels], prev, channels); // TODO check
-          cursor++;
-        }
+        prev[0] += drmdg + dg - 8;
+        prev[1] += dg;
+        prev[2] += dbmdg + dg - 8;
+      } else {
+        // run (this pixel plus the remaining ones)
+        q->run = tag & 0x3F;
       }
-      // TODO eos
+
+      memcpy(q->array[HASH(prev[0], prev[1], prev[2], prev[3])], prev, 4);
     }
+
+    memcpy(&pixels[(size_t)x * channels], prev, channels);
   }
 
-  fclose(f);
+  return 0;
+}
+
+//////////////////////////////// Files
+
+image_t *image_load_qoi(const char *path) {
+  TRACE_CALL();
+  return image_load_qoi_scaled(path, 1);
+}
+
+static image_t *qoi_decode(reader_t *r, u8 scale) {
+  HANDLE(scaler_valid(scale), "scale must be 1, 2, 4 or 8", return NULL);
+
+// Current Exit Procedure
+#define EXIT                                                                   \
+  {                                                                            \
+    return NULL;                                                               \
+  }
+
+  // Read File Header
+  trace_begin(IMAGE_STAGE_HEADER);
+  uc header[14];
+  HANDLE(reader_read(r, header, 14, 1), "failed to read header", EXIT);
+  HANDLE(!strncasecmp((char *)header, "QOIF", 4), "invalid file", EXIT);
+
+  u32 width = __bswap_32(*(u32 *)&header[4]),
+      height = __bswap_32(*(u32 *)&header[8]);
+  u8 channels = *(u8 *)&header[12];
+  HANDLE(channels == 3 || channels == 4, "invalid channel count", EXIT);
+
+  // Rows are decoded one at a time and reduced on the fly
+  scaler_t s;
+  HANDLE(!scaler_init(&s, width, height, channels, scale),
+         "failed to create image", EXIT);
+  trace_end();
+
+#undef EXIT
+#define EXIT                                                                   \
+  {                                                                            \
+    scaler_abort(&s);                                                          \
+    return NULL;                                                               \
+  }
+
+  qoi_state_t q;
+  qoi_init(&q);
+  while (!scaler_done(&s)) {
+    trace_begin(IMAGE_STAGE_DECODE);
+    HANDLE(!qoi_decode_chunks(&q, r, scaler_row(&s), width, channels),
+           "failed to decode chunks", EXIT);
+    trace_end();
+
+    trace_begin(IMAGE_STAGE_CONVERT);
+    scaler_push(&s);
+    trace_end();
+  }
+
+#undef EXIT
+
+  return scaler_finish(&s);
+}
+
+image_t *image_load_qoi_scaled(const char *path, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  HANDLE(!reader_open(&r, path), "no such file", return NULL);
+
+  image_t *out = qoi_decode(&r, scale);
+  reader_close(&r);
 
   return out;
 }
 
+image_t *image_decode_qoi(const void *data, size_t size, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  reader_memory(&r, data, size);
+
+  return qoi_decode(&r, scale);
+}
+
 int image_save_qoi(image_t image, const char *path) {
-  HANDLE(image_is_valid(image), "invalid image", return 1);
+  TRACE_CALL();
+  HANDLE(image_is_valid(image) && image.channels <= 4, "invalid image",
+         return 1);
+
+  // Gray(-alpha) is expanded to RGB(A), a block at a time
+  u8 ch = image.channels, gray = ch <= 2;
+  u8 channels = ch == 1 || ch == 3 ? 3 : 4;
 
-  FILE *f = fopen(path, "wb");
+  FILE *f = trace_fopen(path, "wb");
   HANDLE(f, "failed to create file", return 1);
 
   // Write Header
@@ -133,7 +254,7 @@ int image_save_qoi(image_t image, const char *path) {
   strncpy((char *)header, "qoif", 4);
   *(u32 *)&header[4] = __bswap_32(image.width);
   *(u32 *)&header[8] = __bswap_32(image.height);
-  *(u8 *)&header[12] = image.channels <= 3 ? 3 : 4;
+  *(u8 *)&header[12] = channels;
   *(u8 *)&header[13] = 0; // TODO
 
   HANDLE(fwrite(header, 14, 1, f), "failed to write header", {
@@ -141,108 +262,57 @@ int image_save_qoi(image_t image, const char *path) {
     return 1;
   });
 
-  // Start Writing Chunks
-  u32 array[64] = {};
-  uc prev[4] = {0, 0, 0, 255}; // previous color
-  u32 cursor = 0;
-  while (cursor <= image.width * image.height) {
-    uc *current = &image.data[cursor * image.channels];
-
-    // Try encoding by repetition
-    {
-      u8 count = 0;
-      while (
-          !memcmp(&image.data[cursor * image.channels], prev, image.channels) &&
-          count < 62) {
-        count++;
-        cursor++;
-      }
+  // Chunks are staged and written in blocks instead of byte by byte
+  uc out[1 << 16];
+  u32 n = 0;
 
-      if (count > 0) {
-        u8 run = 0b11000000 | ((count - 1) & 0b00111111);
-        fwrite(&run, 1, 1, f);
-        continue;
-      }
-    }
-
-    // Try encoding by indexing
-    {
-      u32 id = HASH(current[0], current[1], current[2],
-                    image.channels == 3 ? prev[3] : current[3]);
-
-      if (!memcmp(&image.data[array[id] * image.channels], current,
-                  image.channels)) {
-        u8 index = 0b00000000 | (id & 0b00111111);
-        HANDLE(fwrite(&index, 1, 1, f), "failed to write index", continue);
-
-        memcpy(prev, current, image.channels);
-        array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-        cursor++;
-        continue;
-      }
-    }
-
-    // Try encoding by difference
-    {
-      if (image.channels == 3 ||
-          (image.channels == 4 && current[3] == prev[3])) {
-        // Diff
-        int raw[3] = {current[0] - prev[0], current[1] - prev[1],
-                      current[2] - prev[2]};
-        if ((raw[0] >= -2 && raw[0] <= 1) && (raw[1] >= -2 && raw[1] <= 1) &&
-            (raw[2] >= -2 && raw[2] <= 1)) {
-          u8 dr = raw[0] + 2, dg = raw[1] + 2, db = raw[2] + 2;
-          u8 diff = 0b01000000 | ((dr & 0b00000011) << 4) |
-                    ((dg & 0b00000011) << 2) | (db & 0b00000011);
-          fwrite(&diff, 1, 1, f);
-
-          memcpy(prev, current, image.channels);
-          array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-          cursor++;
-          continue;
-        }
-
-        // Luma
-        raw[0] = raw[0] - raw[1], raw[2] = raw[2] - raw[1];
-        if ((raw[1] >= -32 && raw[1] <= 31) && (raw[0] >= -8 && raw[0] <= 7) &&
-            (raw[2] >= -8 && raw[2] <= 7)) {
-          u8 dr = raw[0] + 8, dg = raw[1] + 32, db = raw[2] + 8;
-          u8 diffg = 0b10000000 | (dg & 0b00111111);
-          u8 drb = ((dr & 0b00001111) << 4) | (db & 0b00001111);
-          HANDLE(fwrite(&diffg, 1, 1, f), "failed to write DIFF tag", continue);
-          HANDLE(fwrite(&drb, 1, 1, f), "failed to write DIFF data", continue);
-
-          memcpy(prev, current, image.channels);
-          array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-          cursor++;
-          continue;
-        }
+#define FLUSH                                                                  \
+  HANDLE(n == 0 || fwrite(out, n, 1, f), "failed to write chunks", {           \
+    fclose(f);                                                                 \
+    return 1;                                                                  \
+  });                                                                          \
+  n = 0;
+
+  // Start Writing Chunks (largest chunk is 5 bytes)
+  qoi_state_t q;
+  qoi_init(&q);
+
+  trace_begin(IMAGE_STAGE_ENCODE);
+
+  uc expanded[1024 * 4];
+  u32 count = image.width * image.height;
+  u32 block = gray ? 1024 : (sizeof(out) - 9) / 5;
+  for (u32 cursor = 0; cursor < count; cursor += block) {
+    u32 length = count - cursor < block ? count - cursor : block;
+    const uc *pixels = &image.data[(size_t)cursor * ch];
+
+    if (gray) {
+      for (u32 i = 0; i < length; i++) {
+        const uc *p = &pixels[i * ch];
+        uc a = ch == 2 ? p[1] : 255;
+        memcpy(&expanded[i * channels], (uc[4]){p[0], p[0], p[0], a},
+               channels);
       }
+      pixels = expanded;
     }
 
-    // encode RGB(A)
-    {
-      u8 tag = 0b11111110;
-      if (image.channels == 4 && current[3] != prev[3])
-        tag = 0b11111111;
-      HANDLE(fwrite(&tag, 1, 1, f), "failed to write RGB(A) tag", continue);
-      HANDLE(fwrite(current, (tag == 0b11111110) ? 3 : 4, 1, f),
-             "failed to write RGB(A) data", continue);
-
-      memcpy(prev, current, image.channels);
-      array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-      cursor++;
+    n = qoi_encode_chunks(&q, out, pixels, length, channels);
+    if (cursor + length < count) {
+      FLUSH
     }
   }
+  n += qoi_encode_end(&q, &out[n]);
 
   // Write End Sequence
-  u8 end = 0b00000000;
-  for (int i = 0; i < 7; i++)
-    fwrite(&end, 1, 1, f);
-  end = 0b00000001;
-  fwrite(&end, 1, 1, f);
+  memcpy(&out[n], (uc[8]){0, 0, 0, 0, 0, 0, 0, 1}, 8);
+  n += 8;
+
+  FLUSH
+  trace_end();
+
+#undef FLUSH
 
   fclose(f);
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,31 @@
+/**
+ * @brief QOI Chunk Coding
+ */
+
+#pragma once
+
+#include "reader.h"
+#include "types.h"
+
+// Coder state, kept between calls so runs & the color array carry over
+typedef struct {
+  uc array[64][4];
+  uc prev[4];
+  u8 run; // pending (encoder) or remaining (decoder) run
+  u8 eof; // decoder ran out of chunks
+} qoi_state_t;
+
+// State at the start of a stream
+void qoi_init(qoi_state_t *q);
+
+// Chunks of count pixels into out (at most 5 bytes per pixel), a run that
+// may continue is left pending; returns bytes written
+u32 qoi_encode_chunks(qoi_state_t *q, uc *out, const uc *pixels, u32 count,
+                      u8 channels);
+
+// Close the pending run (at most 1 byte), returns bytes written
+u32 qoi_encode_end(qoi_state_t *q, uc *out);
+
+// Count pixels from chunks of r (a truncated stream continues in black)
+int qoi_decode_chunks(qoi_state_t *q, reader_t *r, uc *pixels, u32 count,
+                      u8 channels);
@@ -0,0 +1,412 @@
+/**
+ * @brief Palette Quantization & Dithering
+ *
+ * The palette is cut from a histogram of sampled pixels (median cut) and
+ * refined by a few k-means rounds. Pixels map through a table of small
+ * color cells whose nearest entry is searched on first use, so the search
+ * runs once per distinct cell instead of once per pixel.
+ */
+
+#include "kernel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <string.h>
+
+// Pixels sampled for the histogram at most
+#define SAMPLES (1 << 18)
+
+// k-means rounds after the median cut
+#define ROUNDS 4
+
+// Bits per channel of histogram bins & mapping cells (by channel count)
+static const u8 bin_bits[4][4] = {{8}, {8, 8}, {5, 5, 5}, {4, 4, 4, 4}};
+static const u8 cell_bits[4][4] = {{8}, {8, 8}, {6, 6, 6}, {5, 5, 5, 5}};
+
+// Key of pixel p, first channel in the high bits
+static inline u32 key(const uc *p, u8 channels, const u8 *bits) {
+  u32 k = 0;
+  for (u8 c = 0; c < channels; c++)
+    k = k << bits[c] | p[c] >> (8 - bits[c]);
+  return k;
+}
+
+// Total bits of a key
+static u32 key_bits(u8 channels, const u8 *bits) {
+  u32 total = 0;
+  for (u8 c = 0; c < channels; c++)
+    total += bits[c];
+  return total;
+}
+
+// Pixel of channels to R-G-B-A and back (gray palettes have R = G = B)
+static void to_rgba(uc *q, const uc *p, u8 channels) {
+  int gray = channels < 3;
+  q[0] = p[0];
+  q[1] = p[gray ? 0 : 1];
+  q[2] = p[gray ? 0 : 2];
+  q[3] = channels == 2 || channels == 4 ? p[channels - 1] : 255;
+}
+
+static void from_rgba(uc *p, const uc *q, u8 channels) {
+  for (u8 c = 0; c < channels; c++)
+    p[c] = c == channels - 1 && (channels == 2 || channels == 4) ? q[3] : q[c];
+}
+
+//////////////////////////////// Palette
+
+// Non-empty histogram bin
+typedef struct {
+  u32 count;
+  u32 sum[4]; // R-G-B-A
+} entry_t;
+
+// Median cut box, entries first to first + count
+typedef struct {
+  u32 first, count;
+  u32 axis, range; // widest channel
+  u64 weight;      // pixels
+} box_t;
+
+static void box_measure(box_t *b, const entry_t *entries) {
+  uc lo[4] = {255, 255, 255, 255}, hi[4] = {0};
+  b->weight = 0;
+
+  for (u32 i = b->first; i < b->first + b->count; i++) {
+    const entry_t *e = &entries[i];
+    for (int c = 0; c < 4; c++) {
+      uc v = e->sum[c] / e->count;
+      lo[c] = v < lo[c] ? v : lo[c];
+      hi[c] = v > hi[c] ? v : hi[c];
+    }
+    b->weight += e->count;
+  }
+
+  b->axis = b->range = 0;
+  for (u32 c = 0; c < 4; c++)
+    if ((u32)(hi[c] - lo[c]) > b->range)
+      b->axis = c, b->range = hi[c] - lo[c];
+}
+
+// Sort a box along its axis (counting sort, tmp holds its entries) and
+// split it at the weighted median
+static void box_split(box_t *b, box_t *next, entry_t *entries, entry_t *tmp) {
+  u32 start[257] = {0};
+  for (u32 i = b->first; i < b->first + b->count; i++) {
+    const entry_t *e = &entries[i];
+    start[e->sum[b->axis] / e->count + 1]++;
+  }
+  for (int v = 0; v < 256; v++)
+    start[v + 1] += start[v];
+
+  for (u32 i = b->first; i < b->first + b->count; i++) {
+    const entry_t *e = &entries[i];
+    tmp[start[e->sum[b->axis] / e->count]++] = *e;
+  }
+  memcpy(&entries[b->first], tmp, b->count * sizeof(entry_t));
+
+  // both halves keep at least one entry
+  u32 half = 0;
+  u64 below = entries[b->first].count;
+  while (half + 2 < b->count && below * 2 < b->weight)
+    below += entries[b->first + ++half].count;
+
+  *next = (box_t){b->first + half + 1, b->count - half - 1};
+  b->count = half + 1;
+  box_measure(b, entries);
+  box_measure(next, entries);
+}
+
+// R | G << 16 & B | A << 16 of the palette, padded with entry 0 to a
+// multiple of 16, returns the entries searched
+static u32 palette_pairs(const uc (*palette)[4], u32 colors, u32 *rg,
+                         u32 *ba) {
+  u32 entries = (colors + 15) & ~15u;
+  for (u32 i = 0; i < entries; i++) {
+    const uc *q = palette[i < colors ? i : 0];
+    rg[i] = q[0] | q[1] << 16;
+    ba[i] = q[2] | q[3] << 16;
+  }
+
+  return entries;
+}
+
+// Median cut, then k-means over the entries, returns the palette size
+static u32 palette_build(uc (*palette)[4], u32 colors, entry_t *entries,
+                         u32 count, entry_t *tmp) {
+  box_t boxes[256];
+  boxes[0] = (box_t){0, count};
+  box_measure(&boxes[0], entries);
+
+  u32 used = 1;
+  while (used < colors) {
+    // split the box with the most pixels times spread
+    u32 pick = used;
+    u64 score = 0;
+    for (u32 i = 0; i < used; i++) {
+      u64 s = boxes[i].weight * boxes[i].range;
+      if (boxes[i].count > 1 && s > score)
+        pick = i, score = s;
+    }
+    if (pick == used)
+      break;
+
+    box_split(&boxes[pick], &boxes[used++], entries, tmp);
+  }
+
+  for (u32 i = 0; i < used; i++) {
+    u64 sum[4] = {0};
+    for (u32 j = boxes[i].first; j < boxes[i].first + boxes[i].count; j++)
+      for (int c = 0; c < 4; c++)
+        sum[c] += entries[j].sum[c];
+    for (int c = 0; c < 4; c++)
+      palette[i][c] = (sum[c] + boxes[i].weight / 2) / boxes[i].weight;
+  }
+
+  // k-means on the entry means (tmp holds them as pixels)
+  uc *means = (uc *)tmp, *nearest = means + (size_t)count * 4;
+  for (u32 i = 0; i < count; i++)
+    for (int c = 0; c < 4; c++)
+      means[i * 4 + c] =
+          (entries[i].sum[c] + entries[i].count / 2) / entries[i].count;
+
+  u32 rg[256], ba[256];
+  for (int round = 0; round < ROUNDS; round++) {
+    u32 entries_used = palette_pairs((const uc(*)[4])palette, used, rg, ba);
+    kernels.nearest(nearest, means, count, rg, ba, entries_used);
+
+    u64 sum[256][4] = {{0}}, weight[256] = {0};
+    for (u32 i = 0; i < count; i++) {
+      for (int c = 0; c < 4; c++)
+        sum[nearest[i]][c] += entries[i].sum[c];
+      weight[nearest[i]] += entries[i].count;
+    }
+
+    // empty clusters keep their color
+    for (u32 i = 0; i < used; i++)
+      if (weight[i])
+        for (int c = 0; c < 4; c++)
+          palette[i][c] = (sum[i][c] + weight[i] / 2) / weight[i];
+  }
+
+  return used;
+}
+
+//////////////////////////////// Mapping
+
+typedef struct {
+  const image_indexed_t *out;
+  u8 channels;
+  u16 *cells; // nearest entry + 1 per cell, 0 until searched
+  u32 rg[256], ba[256], entries;
+  i32 spread; // ordered dithering amplitude, 0 for none
+} map_t;
+
+// Palette index of pixel p (channels), searched at the cell center
+static inline u8 lookup(map_t *m, const uc *p) {
+  const u8 *bits = cell_bits[m->channels - 1];
+  u32 k = key(p, m->channels, bits);
+
+  u16 v = __atomic_load_n(&m->cells[k], __ATOMIC_RELAXED);
+  if (!v) {
+    uc center[4] = {0}, q[4], index;
+    for (int c = m->channels - 1, rest = k; c >= 0; c--) {
+      u32 shift = 8 - bits[c];
+      center[c] = (rest & ((1u << bits[c]) - 1)) << shift | (1u << shift) >> 1;
+      rest >>= bits[c];
+    }
+    to_rgba(q, center, m->channels);
+    kernels.nearest(&index, q, 1, m->rg, m->ba, m->entries);
+
+    v = index + 1;
+    __atomic_store_n(&m->cells[k], v, __ATOMIC_RELAXED);
+  }
+
+  return v - 1;
+}
+
+// 8x8 Bayer matrix
+static const u8 bayer[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+
+static void map_band(image_t image, u32 y0, u32 y1, void *arg) {
+  map_t *m = arg;
+  u8 ch = image.channels;
+
+  for (u32 y = y0; y < y1; y++) {
+    const uc *src = &image.data[(size_t)y * image.width * ch];
+    uc *dst = &m->out->data[(size_t)y * image.width];
+
+    for (u32 x = 0; x < image.width; x++, src += ch) {
+      if (!m->spread) {
+        dst[x] = lookup(m, src);
+        continue;
+      }
+
+      // threshold offset centered on zero
+      i32 offset = (2 * bayer[y & 7][x & 7] - 63) * m->spread / 128;
+      uc p[4];
+      for (u8 c = 0; c < ch; c++) {
+        i32 v = src[c] + offset;
+        p[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+      }
+      dst[x] = lookup(m, p);
+    }
+  }
+}
+
+// Floyd-Steinberg, errors in 1/16
+static int diffuse(image_t image, map_t *m) {
+  u8 ch = image.channels;
+  size_t length = (size_t)(image.width + 2) * ch;
+  i32 *err = calloc(length * 2, sizeof(i32));
+  HANDLE(err, "failed to allocate error rows", return 1);
+
+  i32 *current = err, *next = err + length;
+  for (u32 y = 0; y < image.height; y++) {
+    const uc *src = &image.data[(size_t)y * image.width * ch];
+    uc *dst = &m->out->data[(size_t)y * image.width];
+    memset(next, 0, length * sizeof(i32));
+
+    for (u32 x = 0; x < image.width; x++) {
+      i32 *e = &current[(x + 1) * ch], *below = &next[(x + 1) * ch];
+
+      uc want[4], got[4];
+      for (u8 c = 0; c < ch; c++) {
+        i32 v = src[x * ch + c] + ((e[c] + 8) >> 4);
+        want[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+      }
+
+      dst[x] = lookup(m, want);
+      from_rgba(got, m->out->palette[dst[x]], ch);
+
+      for (u8 c = 0; c < ch; c++) {
+        i32 d = want[c] - got[c];
+        e[ch + c] += d * 7;
+        below[c - ch] += d * 3;
+        below[c] += d * 5;
+        below[ch + c] += d;
+      }
+    }
+
+    i32 *swap = current;
+    current = next, next = swap;
+  }
+
+  free(err);
+  return 0;
+}
+
+//////////////////////////////// Quantization
+
+image_indexed_t *image_quantize(image_t image, uint32_t colors,
+                                image_dither_t dither) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image) && image.channels <= 4, "invalid image",
+         return NULL);
+  HANDLE(colors >= 2 && colors <= 256, "colors must be 2 to 256",
+         return NULL);
+  HANDLE(dither <= IMAGE_DITHER_DIFFUSION, "unknown dithering", return NULL);
+
+  u8 ch = image.channels;
+  size_t bins = (size_t)1 << key_bits(ch, bin_bits[ch - 1]);
+  size_t cells = (size_t)1 << key_bits(ch, cell_bits[ch - 1]);
+  size_t pixels = (size_t)image.width * image.height;
+
+  image_indexed_t *out = calloc(1, sizeof(image_indexed_t));
+  entry_t *hist = calloc(bins, sizeof(entry_t));
+  entry_t *tmp = malloc(bins * sizeof(entry_t));
+  map_t *m = malloc(sizeof(map_t));
+  if (out)
+    out->data = malloc(pixels);
+  if (m)
+    m->cells = calloc(cells, sizeof(u16));
+
+#define EXIT                                                                   \
+  {                                                                            \
+    if (out)                                                                   \
+      free(out->data);                                                         \
+    if (m)                                                                     \
+      free(m->cells);                                                          \
+    free(out);                                                                 \
+    free(hist);                                                                \
+    free(tmp);                                                                 \
+    free(m);                                                                   \
+    return NULL;                                                               \
+  }
+
+  HANDLE(out && out->data && hist && tmp && m && m->cells,
+         "failed to allocate image", EXIT);
+  trace_alloc(pixels + bins * sizeof(entry_t) * 2 + cells * sizeof(u16));
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+
+  // Histogram of evenly spread samples (jittered against aliasing)
+  size_t step = pixels > SAMPLES ? pixels / SAMPLES : 1;
+  for (size_t i = 0; i < pixels / step; i++) {
+    size_t at = i * step + (i * 2654435761u) % step;
+    const uc *p = &image.data[at * ch];
+
+    uc q[4];
+    to_rgba(q, p, ch);
+    entry_t *e = &hist[key(p, ch, bin_bits[ch - 1])];
+    e->count++;
+    for (int c = 0; c < 4; c++)
+      e->sum[c] += q[c];
+  }
+
+  u32 count = 0;
+  for (size_t i = 0; i < bins; i++)
+    if (hist[i].count)
+      hist[count++] = hist[i];
+
+  out->width = image.width, out->height = image.height;
+  out->colors = palette_build(out->palette, colors, hist, count, tmp);
+
+  // Map every pixel
+  m->out = out, m->channels = ch;
+  m->entries = palette_pairs((const uc(*)[4])out->palette, out->colors,
+                             m->rg, m->ba);
+  m->spread = 0;
+
+  int err = 0;
+  if (dither == IMAGE_DITHER_DIFFUSION) {
+    err = diffuse(image, m);
+  } else {
+    if (dither == IMAGE_DITHER_ORDERED) {
+      // about the spacing of the palette along one axis
+      u32 axes = ch < 3 ? 1 : 3, levels = 1;
+      while (levels * (axes > 1 ? levels * levels : 1) < out->colors)
+        levels++;
+      m->spread = 255 / levels;
+    }
+    image_parallel_for(image, 0, map_band, m);
+  }
+
+  trace_end();
+
+  free(hist);
+  free(tmp);
+  free(m->cells);
+  free(m);
+  if (err) {
+    image_indexed_free(out);
+    return NULL;
+  }
+
+  return out;
+#undef EXIT
+}
+
+void image_indexed_free(image_indexed_t *indexed) {
+  if (!indexed)
+    return;
+
+  free(indexed->data);
+  free(indexed);
+}
@@ -0,0 +1,40 @@
+/**
+ * @brief Codec Input (file or memory)
+ */
+
+#include "reader.h"
+
+int reader_open(reader_t *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  r->f = trace_fopen(path, "rb");
+  return r->f == NULL;
+}
+
+void reader_memory(reader_t *r, const void *data, size_t size) {
+  memset(r, 0, sizeof(*r));
+  r->data = data, r->size = size;
+}
+
+void reader_close(reader_t *r) {
+  if (r->f)
+    fclose(r->f);
+  r->f = NULL;
+}
+
+int reader_seek(reader_t *r, long offset, int whence) {
+  if (r->f)
+    return fseek(r->f, offset, whence);
+
+  long base = whence == SEEK_SET ? 0
+              : whence == SEEK_CUR ? (long)r->cursor
+                                   : (long)r->size;
+  if (base + offset < 0)
+    return -1;
+
+  r->cursor = base + offset;
+  return 0;
+}
+
+long reader_tell(reader_t *r) {
+  return r->f ? ftell(r->f) : (long)r->cursor;
+}
@@ -0,0 +1,55 @@
+/**
+ * @brief Codec Input (file or memory)
+ */
+
+#pragma once
+
+#include "trace.h"
+#include "types.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Decoders read through this, so the same code decodes files and buffers
+typedef struct {
+  FILE *f; // file source (NULL for memory)
+
+  const uc *data; // memory source
+  size_t size, cursor;
+} reader_t;
+
+// Open file source
+int reader_open(reader_t *r, const char *path);
+
+// Memory source (not copied, must outlive the reader)
+void reader_memory(reader_t *r, const void *data, size_t size);
+
+// Close file source
+void reader_close(reader_t *r);
+
+// Seek like fseek
+int reader_seek(reader_t *r, long offset, int whence);
+
+// Position like ftell
+long reader_tell(reader_t *r);
+
+// Read like fread (returns complete items read)
+static inline size_t reader_read(reader_t *r, void *dst, size_t size,
+                                 size_t count) {
+  if (r->f)
+    return fread(dst, size, count, r->f);
+
+  if (size == 0)
+    return 0;
+
+  size_t left = r->cursor < r->size ? r->size - r->cursor : 0;
+  if (count > left / size)
+    count = left / size;
+
+  memcpy(dst, &r->data[r->cursor], size * count);
+  r->cursor += size * count;
+  trace_read(size * count);
+
+  return count;
+}
@@ -0,0 +1,239 @@
+/**
+ * @brief Image Resampling
+ */
+
+#include "kernel.h"
+#include "resize.h"
+#include "shared.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <math.h>
+#include <string.h>
+
+// Filter taps of every output sample along one axis
+typedef struct {
+  u32 *start;   // first source sample
+  u32 *count;   // number of taps
+  i32 *weights; // max taps per output sample, WEIGHT_BITS fixed point
+  u32 max;      // max taps
+} taps_t;
+
+// Safe to call again (fields are cleared)
+static void taps_free(taps_t *t) {
+  free(t->start);
+  free(t->count);
+  free(t->weights);
+  t->start = t->count = NULL, t->weights = NULL;
+}
+
+// Triangle filter; bilinear when enlarging, widened to cover every source
+// sample (area average) when shrinking
+static int taps_init(taps_t *t, u32 src, u32 dst) {
+  double scale = (double)src / dst;
+  double radius = scale > 1 ? scale : 1;
+
+  t->max = (u32)ceil(radius) * 2 + 1;
+  t->start = malloc(dst * sizeof(u32));
+  t->count = malloc(dst * sizeof(u32));
+  t->weights = malloc((size_t)dst * t->max * sizeof(i32));
+  HANDLE(t->start && t->count && t->weights, "failed to allocate taps", {
+    taps_free(t);
+    return 1;
+  });
+
+  for (u32 i = 0; i < dst; i++) {
+    double center = (i + 0.5) * scale - 0.5;
+    i64 left = (i64)ceil(center - radius), right = (i64)floor(center + radius);
+    if (left < 0)
+      left = 0;
+    if (right > (i64)src - 1)
+      right = src - 1;
+
+    i32 *w = &t->weights[(size_t)i * t->max];
+    double total = 0;
+    u32 n = 0;
+    for (i64 j = left; j <= right && n < t->max; j++, n++) {
+      double v = 1 - fabs(j - center) / radius;
+      total += v > 0 ? v : 0;
+    }
+
+    // normalize, putting the rounding error on the first tap
+    i32 sum = 0;
+    for (u32 k = 0; k < n; k++) {
+      double v = 1 - fabs(left + k - center) / radius;
+      w[k] = total > 0 ? lround((v > 0 ? v : 0) / total * (1 << WEIGHT_BITS))
+                       : (k == 0) << WEIGHT_BITS;
+      sum += w[k];
+    }
+    w[0] += (1 << WEIGHT_BITS) - sum;
+
+    t->start[i] = left, t->count[i] = n;
+  }
+
+  return 0;
+}
+
+typedef struct {
+  const uc *src;
+  u32 width; // of src
+  taps_t *taps;
+} pass_t;
+
+// Rows of the horizontal pass (same rows of src)
+static void horizontal_band(image_t tmp, u32 y0, u32 y1, void *arg) {
+  const pass_t *p = arg;
+  u8 ch = tmp.channels;
+
+  for (u32 y = y0; y < y1; y++)
+    kernels.resample_row(&tmp.data[(size_t)y * tmp.width * ch],
+                         &p->src[(size_t)y * p->width * ch], tmp.width, ch,
+                         p->taps->start, p->taps->count, p->taps->weights,
+                         p->taps->max);
+}
+
+// Rows of the vertical pass (row at a time, so the inner loop runs along
+// memory)
+static void vertical_band(image_t out, u32 y0, u32 y1, void *arg) {
+  const pass_t *p = arg;
+  const taps_t *v = p->taps;
+  size_t stride = (size_t)out.width * out.channels;
+
+  for (u32 y = y0; y < y1; y++)
+    kernels.resample_rows(&out.data[y * stride], &p->src[v->start[y] * stride],
+                          stride, stride, &v->weights[(size_t)y * v->max],
+                          v->count[y]);
+}
+
+// Resample width x height x channels pixels into a new buffer
+static uc *resample(const uc *src, u32 width, u32 height, u8 channels,
+                    u32 new_width, u32 new_height) {
+  taps_t h = {}, v = {};
+  uc *tmp = malloc((size_t)new_width * height * channels);
+  uc *out = malloc((size_t)new_width * new_height * channels);
+  trace_alloc((size_t)new_width * (height + new_height) * channels);
+
+  HANDLE(tmp && out && !taps_init(&h, width, new_width) &&
+             !taps_init(&v, height, new_height),
+         "failed to allocate resample buffers", {
+           taps_free(&h);
+           taps_free(&v);
+           free(tmp);
+           free(out);
+           return NULL;
+         });
+
+  pass_t horizontal = {src, width, &h}, vertical = {tmp, new_width, &v};
+  image_parallel_for((image_t){new_width, height, channels, tmp}, 0,
+                     horizontal_band, &horizontal);
+  image_parallel_for((image_t){new_width, new_height, channels, out}, 0,
+                     vertical_band, &vertical);
+
+  taps_free(&h);
+  taps_free(&v);
+  free(tmp);
+
+  return out;
+}
+
+// Rows of the channel conversion
+static void convert_band(image_t out, u32 y0, u32 y1, void *arg) {
+  const image_t *in = arg;
+  u8 from = in->channels, to = out.channels;
+
+  int from_alpha = from == 2 || from == 4, to_alpha = to == 2 || to == 4;
+  u8 from_color = from_alpha ? from - 1 : from;
+  u8 to_color = to_alpha ? to - 1 : to;
+
+  for (size_t i = (size_t)y0 * out.width; i < (size_t)y1 * out.width; i++) {
+    const uc *s = &in->data[i * from];
+    uc *d = &out.data[i * to];
+
+    if (from_color >= 3 && to_color == 1) {
+      // luma (BT.601)
+      d[0] = (77 * s[0] + 150 * s[1] + 29 * s[2] + 128) >> 8;
+    } else {
+      for (u8 c = 0; c < to_color; c++)
+        d[c] = s[c < from_color ? c : 0];
+    }
+
+    if (to_alpha)
+      d[to - 1] = from_alpha ? s[from - 1] : 255;
+  }
+}
+
+// Convert between gray, gray + alpha, rgb and rgba into a new buffer
+static uc *convert(image_t in, u8 to) {
+  size_t size = (size_t)in.width * in.height * to;
+  uc *out = malloc(size);
+  HANDLE(out, "failed to allocate image data", return NULL);
+  trace_alloc(size);
+
+  image_parallel_for((image_t){in.width, in.height, to, out}, 0, convert_band,
+                     &in);
+
+  return out;
+}
+
+uc *resize_pixels(image_t image, u32 width, u32 height, u8 channels) {
+  // fewer channels first, so less is resampled
+  uc *converted = NULL;
+  if (channels < image.channels) {
+    converted = convert(image, channels);
+    if (!converted)
+      return NULL;
+    image.data = converted, image.channels = channels;
+  }
+
+  uc *out = resample(image.data, image.width, image.height, image.channels,
+                     width, height);
+  free(converted);
+
+  if (out && channels > image.channels) {
+    uc *more = convert((image_t){width, height, image.channels, out}, channels);
+    free(out);
+    out = more;
+  }
+
+  return out;
+}
+
+void image_resize(image_t *image, uint32_t width, uint32_t height,
+                  uint32_t channels) {
+  TRACE_CALL();
+  HANDLE(image && image_is_valid(*image), "invalid image", return);
+  HANDLE(width != 0 && height != 0 && channels != 0 && channels <= 4 &&
+             image->channels <= 4,
+         "invalid value(s)", return);
+  HANDLE(!data_pinned(*image, width, height, channels),
+         "can't change the size of a shared image", return);
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+
+  // Drop channels before resampling, add them after
+  if (channels < image->channels) {
+    uc *data = convert(*image, channels);
+    HANDLE(data, "failed to convert channels", return);
+
+    data_replace(image, data, image->width, image->height, channels);
+  }
+
+  if (width != image->width || height != image->height) {
+    uc *data = resample(image->data, image->width, image->height,
+                        image->channels, width, height);
+    HANDLE(data, "failed to resample image", return);
+
+    data_replace(image, data, width, height, image->channels);
+  }
+
+  if (channels > image->channels) {
+    uc *data = convert(*image, channels);
+    HANDLE(data, "failed to convert channels", return);
+
+    data_replace(image, data, image->width, image->height, channels);
+  }
+
+  trace_end();
+}
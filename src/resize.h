@@ -0,0 +1,12 @@
+/**
+ * @brief Image Resampling
+ */
+
+#pragma once
+
+#include "types.h"
+#include <image.h>
+
+// Pixels of image resized & converted to channels in a new buffer, the
+// image is left as is
+uc *resize_pixels(image_t image, u32 width, u32 height, u8 channels);
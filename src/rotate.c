@@ -0,0 +1,108 @@
+/**
+ * @brief Image Rotation
+ *
+ * Quarter turns gather destination rows from source columns a tile wide
+ * strip at a time, so the source rows read stay cached across a band.
+ */
+
+#include "shared.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <string.h>
+
+typedef struct {
+  const uc *src; // source pixels
+  int amount;
+} rotate_t;
+
+// Quarter turn of destination rows y0 to y1 (inlined per channel count so
+// pixel copies are plain moves)
+static inline __attribute__((always_inline)) void
+quarter(image_t out, u32 y0, u32 y1, const rotate_t *r, u8 ch) {
+  u32 w = out.height, h = out.width;
+  for (u32 nx0 = 0; nx0 < h; nx0 += IMAGE_TILE) {
+    u32 nx1 = h - nx0 < IMAGE_TILE ? h : nx0 + IMAGE_TILE;
+
+    for (u32 ny = y0; ny < y1; ny++) {
+      u32 x = r->amount == 1 ? ny : w - 1 - ny;
+      uc *dst = &out.data[((size_t)ny * h + nx0) * ch];
+
+      for (u32 nx = nx0; nx < nx1; nx++, dst += ch) {
+        u32 y = r->amount == 1 ? h - 1 - nx : nx;
+        memcpy(dst, &r->src[((size_t)y * w + x) * ch], ch);
+      }
+    }
+  }
+}
+
+// Rows of the rotated image, gathered from the source
+static void rotate_band(image_t out, u32 y0, u32 y1, void *arg) {
+  const rotate_t *r = arg;
+  u8 ch = out.channels;
+
+  if (r->amount == 2) {
+    // 180: reversed pixel order
+    size_t n = (size_t)out.width * out.height;
+    for (size_t i = (size_t)y0 * out.width; i < (size_t)y1 * out.width; i++)
+      memcpy(&out.data[i * ch], &r->src[(n - 1 - i) * ch], ch);
+    return;
+  }
+
+  // 90 / 270: destination row is a source column (source is h x w)
+  switch (ch) {
+  case 1:
+    quarter(out, y0, y1, r, 1);
+    break;
+  case 2:
+    quarter(out, y0, y1, r, 2);
+    break;
+  case 3:
+    quarter(out, y0, y1, r, 3);
+    break;
+  case 4:
+    quarter(out, y0, y1, r, 4);
+    break;
+  default:
+    quarter(out, y0, y1, r, ch);
+    break;
+  }
+}
+
+void image_rotate(image_t *image, int amount) {
+  TRACE_CALL();
+  HANDLE(image && image_is_valid(*image), "invalid image", return);
+
+  amount = ((amount % 4) + 4) % 4; // clockwise quarter turns
+  if (amount == 0)
+    return;
+
+  u32 w = image->width, h = image->height;
+  u8 ch = image->channels;
+  size_t size = (size_t)w * h * ch;
+  HANDLE(!data_pinned(*image, amount == 2 ? w : h, amount == 2 ? h : w, ch),
+         "can't change the size of a shared image", return);
+
+  uc *out = malloc(size);
+  HANDLE(out, "failed to allocate image data", return);
+  trace_alloc(size);
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+
+  image_t rotated = {amount == 2 ? w : h, amount == 2 ? h : w, ch, out};
+  rotate_t r = {image->data, amount};
+  if (amount == 2) {
+    image_parallel_for(rotated, 0, rotate_band, &r);
+  } else {
+    // bands of whole tiles, a few per thread
+    unsigned threads = image_parallel_count();
+    u32 band = (rotated.height + threads * 4 - 1) / (threads * 4);
+    band = (band + IMAGE_TILE - 1) & ~(u32)(IMAGE_TILE - 1);
+    image_parallel_for(rotated, band, rotate_band, &r);
+  }
+  trace_end();
+
+  data_replace(image, out, rotated.width, rotated.height, ch);
+}
@@ -0,0 +1,125 @@
+/**
+ * @brief Reduced-Resolution Decoding
+ */
+
+#include "scale.h"
+#include "trace.h"
+#include "util.h"
+
+#include <malloc.h>
+#include <string.h>
+
+int scaler_valid(u8 scale) {
+  return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+}
+
+int scaler_init(scaler_t *s, u32 width, u32 height, u8 channels, u8 scale) {
+  memset(s, 0, sizeof(*s));
+  HANDLE(scaler_valid(scale), "scale must be 1, 2, 4 or 8", return 1);
+
+  s->width = width, s->height = height;
+  s->channels = channels, s->scale = scale;
+
+  s->image = image_allocate((width + scale - 1) / scale,
+                            (height + scale - 1) / scale, channels);
+  HANDLE(s->image, "failed to create image", return 1);
+
+  if (scale == 1)
+    return 0;
+
+  s->sum = calloc(s->image->width * channels, sizeof(u32));
+  s->row = malloc(width * channels);
+  HANDLE(s->sum && s->row, "failed to allocate row buffers", {
+    scaler_abort(s);
+    return 1;
+  });
+  trace_alloc(s->image->width * channels * sizeof(u32) + width * channels);
+
+  return 0;
+}
+
+uc *scaler_row(scaler_t *s) {
+  // decode straight into the output when not reducing
+  if (s->scale == 1)
+    return &s->image->data[(size_t)s->y * s->width * s->channels];
+
+  return s->row;
+}
+
+// Average accumulated box sums into output row
+static void scaler_emit(scaler_t *s) {
+  u32 oy = (s->y - 1) / s->scale;
+  u32 rows = s->y - oy * s->scale;
+
+  u32 ow = s->image->width;
+  uc *dst = &s->image->data[(size_t)oy * ow * s->channels];
+
+  for (u32 x = 0; x < ow; x++) {
+    u32 cols = x + 1 < ow ? s->scale : s->width - x * s->scale;
+    u32 n = rows * cols;
+
+    for (u8 c = 0; c < s->channels; c++) {
+      u32 *sum = &s->sum[x * s->channels + c];
+      dst[x * s->channels + c] = (*sum + n / 2) / n;
+      *sum = 0;
+    }
+  }
+}
+
+void scaler_push(scaler_t *s) {
+  if (s->y >= s->height)
+    return;
+
+  if (s->scale == 1) {
+    s->y++;
+    return;
+  }
+
+  const uc *src = s->row;
+  u32 *sum = s->sum;
+  u8 ch = s->channels;
+
+  // Accumulate row into box sums, one output sample per scale pixels
+  for (u32 x = 0; x < s->width; x += s->scale) {
+    u32 end = x + s->scale < s->width ? x + s->scale : s->width;
+
+    for (u32 i = x; i < end; i++)
+      for (u8 c = 0; c < ch; c++)
+        sum[c] += src[i * ch + c];
+
+    sum += ch;
+  }
+
+  s->y++;
+  if (s->y % s->scale == 0 || s->y == s->height)
+    scaler_emit(s);
+}
+
+int scaler_done(const scaler_t *s) { return s->y >= s->height; }
+
+image_t *scaler_finish(scaler_t *s) {
+  // zero-fill rows a truncated stream never reached
+  if (s->y < s->height) {
+    WARNING("image data ended early");
+
+    if (s->scale > 1 && s->y % s->scale != 0)
+      scaler_emit(s);
+
+    u32 oy = (s->y + s->scale - 1) / s->scale;
+    size_t stride = (size_t)s->image->width * s->channels;
+    memset(&s->image->data[oy * stride], 0, (s->image->height - oy) * stride);
+  }
+
+  image_t *out = s->image;
+  s->image = NULL;
+  scaler_abort(s);
+
+  return out;
+}
+
+void scaler_abort(scaler_t *s) {
+  image_free(s->image);
+  free(s->sum);
+  free(s->row);
+  memset(s, 0, sizeof(*s));
+}
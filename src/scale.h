@@ -0,0 +1,41 @@
+/**
+ * @brief Reduced-Resolution Decoding
+ */
+
+#pragma once
+
+#include "types.h"
+#include <image.h>
+
+// Box-filters source rows into a 1/scale image while a codec decodes,
+// so the full-size image is never materialized
+typedef struct {
+  image_t *image; // reduced output
+  u32 width, height;
+  u8 channels, scale;
+
+  u32 y;    // next source row
+  u32 *sum; // per output sample accumulator (scale > 1)
+  uc *row;  // source row buffer (scale > 1)
+} scaler_t;
+
+// Is scale one of 1, 2, 4, 8
+int scaler_valid(u8 scale);
+
+// Allocate output image (and buffers) for a width x height source
+int scaler_init(scaler_t *s, u32 width, u32 height, u8 channels, u8 scale);
+
+// Buffer to decode the next source row into (width * channels bytes)
+uc *scaler_row(scaler_t *s);
+
+// Consume the row returned by scaler_row
+void scaler_push(scaler_t *s);
+
+// Have all source rows been pushed
+int scaler_done(const scaler_t *s);
+
+// Flush the last partial row and hand over the output image
+image_t *scaler_finish(scaler_t *s);
+
+// Free everything (on decode error)
+void scaler_abort(scaler_t *s);
@@ -0,0 +1,578 @@
+/**
+ * @brief Frame Sequences
+ *
+ * Frames are cut into IMAGE_TILE square tiles, each coded on its own with
+ * QOI chunks, so tiles encode & decode in parallel. Keyframes code every
+ * tile, other frames only the changed ones, as byte differences to the
+ * previous frame (mostly runs of zero). An index at the end of the file
+ * gives the record of any frame & its keyframe without reading the others.
+ *
+ * header: "qoiv", u32 width, u32 height, u8 channels, 3 zero bytes, u64
+ *         offset of the index (0 until finished)
+ * record: u32 size (of the rest), u8 key, changed tile bitmap, u32 length of
+ *         each changed tile, their chunks
+ * index:  u32 count, entry_t per frame
+ */
+
+#include "parallel.h"
+#include "qoi.h"
+#include "reader.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <string.h>
+
+#define HEADER 24
+#define RECORD 5 // size & key
+
+// Pixels of a tile & its chunks (5 bytes per pixel at most & the closing
+// run)
+#define TILE_PIXELS (IMAGE_TILE * IMAGE_TILE * 4)
+#define TILE_CHUNKS (IMAGE_TILE * IMAGE_TILE * 5 + 1)
+
+typedef struct {
+  u64 offset;   // of the record
+  u32 size;     // of the record
+  u32 keyframe; // frame to start decoding from
+} entry_t;
+
+// Tiles per row & in total
+static u32 tile_columns(u32 width) {
+  return (width + IMAGE_TILE - 1) / IMAGE_TILE;
+}
+
+static u32 tile_count(u32 width, u32 height) {
+  return tile_columns(width) * ((height + IMAGE_TILE - 1) / IMAGE_TILE);
+}
+
+// Origin & size of tile t
+static void tile_rect(image_t image, u32 t, u32 *x, u32 *y, u32 *w, u32 *h) {
+  u32 columns = tile_columns(image.width);
+  *x = t % columns * IMAGE_TILE, *y = t / columns * IMAGE_TILE;
+  *w = image.width - *x < IMAGE_TILE ? image.width - *x : IMAGE_TILE;
+  *h = image.height - *y < IMAGE_TILE ? image.height - *y : IMAGE_TILE;
+}
+
+// Workers for count tiles, each claiming tiles into its own heap buffers
+static u32 tile_workers(u32 count) {
+  unsigned threads = image_parallel_count();
+  return count < threads ? count : threads;
+}
+
+//////////////////////////////// Writing
+
+struct image_sequence_writer {
+  FILE *f;
+  u64 offset; // of the next record
+  u32 keyframes;
+
+  image_t *prev; // last frame appended
+  u32 tiles;
+  uc **chunks;  // per tile of the frame being appended
+  u32 *lengths; // 0 for unchanged tiles
+  uc *record;   // size, key & bitmap of the frame being appended
+  u32 *changed; // lengths of its changed tiles
+
+  entry_t *entries;
+  u32 count, capacity;
+};
+
+typedef struct {
+  image_sequence_writer_t *w;
+  image_t frame;
+  int key, failed;
+  u32 next; // tile to claim
+} encode_t;
+
+// Chunks of tile t when it changed (pixels & out are the worker's)
+static void encode_tile(encode_t *e, u32 t, uc *pixels, uc *out) {
+  image_t frame = e->frame, prev = *e->w->prev;
+  u8 ch = frame.channels;
+
+  u32 x, y, w, h;
+  tile_rect(frame, t, &x, &y, &w, &h);
+  size_t stride = (size_t)frame.width * ch, offset = y * stride + x * ch;
+
+  int changed = e->key;
+  for (u32 r = 0; r < h && !changed; r++)
+    changed = memcmp(&frame.data[offset + r * stride],
+                     &prev.data[offset + r * stride], w * ch) != 0;
+  if (!changed)
+    return;
+
+  // the tile, or its difference to the previous frame, as one run of pixels
+  for (u32 r = 0; r < h; r++) {
+    const uc *src = &frame.data[offset + r * stride];
+    const uc *ref = &prev.data[offset + r * stride];
+    uc *dst = &pixels[r * w * ch];
+    if (e->key)
+      memcpy(dst, src, w * ch);
+    else
+      for (u32 i = 0; i < w * ch; i++)
+        dst[i] = src[i] - ref[i];
+  }
+
+  qoi_state_t q;
+  qoi_init(&q);
+  u32 n = qoi_encode_chunks(&q, out, pixels, w * h, ch);
+  n += qoi_encode_end(&q, &out[n]);
+
+  uc *chunks = malloc(n);
+  HANDLE(chunks, "failed to allocate tile", {
+    __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+    return;
+  });
+  memcpy(chunks, out, n);
+  e->w->chunks[t] = chunks, e->w->lengths[t] = n;
+}
+
+static void encode_worker(u32 i, void *arg) {
+  encode_t *e = arg;
+  uc *pixels = malloc(TILE_PIXELS + TILE_CHUNKS);
+  HANDLE(pixels, "failed to allocate tile buffers", {
+    __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+    return;
+  });
+  trace_alloc(TILE_PIXELS + TILE_CHUNKS);
+
+  u32 t;
+  while ((t = __atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED)) <
+         e->w->tiles)
+    encode_tile(e, t, pixels, &pixels[TILE_PIXELS]);
+
+  free(pixels);
+}
+
+static void writer_free(image_sequence_writer_t *w) {
+  if (w->f)
+    fclose(w->f);
+  image_free(w->prev);
+  free(w->chunks);
+  free(w->lengths);
+  free(w->record);
+  free(w->changed);
+  free(w->entries);
+  free(w);
+}
+
+image_sequence_writer_t *image_sequence_create(const char *path,
+                                               uint32_t width, uint32_t height,
+                                               uint8_t channels,
+                                               uint32_t keyframes) {
+  TRACE_CALL();
+  HANDLE(path && width && height && channels && channels <= 4,
+         "invalid value(s)", return NULL);
+
+  image_sequence_writer_t *w = calloc(1, sizeof(image_sequence_writer_t));
+  HANDLE(w, "failed to allocate sequence", return NULL);
+
+// Current Exit Procedure
+#define EXIT                                                                   \
+  {                                                                            \
+    writer_free(w);                                                            \
+    return NULL;                                                               \
+  }
+
+  w->keyframes = keyframes;
+  w->tiles = tile_count(width, height);
+  w->prev = image_allocate(width, height, channels);
+  w->chunks = calloc(w->tiles, sizeof(uc *));
+  w->lengths = calloc(w->tiles, sizeof(u32));
+  w->record = malloc(RECORD + (w->tiles + 7) / 8);
+  w->changed = malloc(w->tiles * sizeof(u32));
+  HANDLE(w->prev && w->chunks && w->lengths && w->record && w->changed,
+         "failed to allocate sequence", EXIT);
+  trace_alloc(sizeof(image_sequence_writer_t) + RECORD + (w->tiles + 7) / 8 +
+              (size_t)w->tiles * (sizeof(uc *) + 2 * sizeof(u32)));
+
+  w->f = trace_fopen(path, "wb");
+  HANDLE(w->f, "failed to create file", EXIT);
+
+  // Write Header (index offset filled in by image_sequence_finish)
+  uc header[HEADER] = "qoiv";
+  *(u32 *)&header[4] = width;
+  *(u32 *)&header[8] = height;
+  header[12] = channels;
+  HANDLE(fwrite(header, HEADER, 1, w->f), "failed to write header", EXIT);
+  w->offset = HEADER;
+
+#undef EXIT
+
+  return w;
+}
+
+int image_sequence_append(image_sequence_writer_t *writer, image_t frame) {
+  TRACE_CALL();
+  HANDLE(writer && image_is_valid(frame), "invalid value(s)", return 1);
+  const image_t *prev = writer->prev;
+  HANDLE(frame.width == prev->width && frame.height == prev->height &&
+             frame.channels == prev->channels,
+         "frame differs in size from the sequence", return 1);
+
+  if (writer->count == writer->capacity) {
+    u32 capacity = writer->capacity ? writer->capacity * 2 : 64;
+    entry_t *entries = realloc(writer->entries, capacity * sizeof(entry_t));
+    HANDLE(entries, "failed to grow frame index", return 1);
+    trace_alloc((capacity - writer->capacity) * sizeof(entry_t));
+    writer->entries = entries, writer->capacity = capacity;
+  }
+
+  u32 count = writer->count, keyframes = writer->keyframes;
+  int key = count == 0 || (keyframes && count % keyframes == 0);
+  encode_t e = {writer, frame, key, 0, 0};
+
+  // unclaimed tiles (workers that failed to start) stay unchanged
+  memset(writer->lengths, 0, writer->tiles * sizeof(u32));
+  trace_begin(IMAGE_STAGE_ENCODE);
+  parallel_range(tile_workers(writer->tiles), encode_worker, &e);
+  trace_end();
+
+  // Record of the changed tiles
+  u32 bitmap = (writer->tiles + 7) / 8, changed = 0;
+  uc *record = writer->record;
+  memset(record, 0, RECORD + bitmap);
+  record[4] = key;
+
+  u64 size = RECORD + bitmap;
+  for (u32 t = 0; t < writer->tiles; t++)
+    if (writer->lengths[t]) {
+      record[RECORD + t / 8] |= 1 << t % 8;
+      size += sizeof(u32) + writer->lengths[t], changed++;
+    }
+  *(u32 *)record = size - sizeof(u32);
+
+  u32 *lengths = writer->changed;
+  for (u32 t = 0, i = 0; t < writer->tiles; t++)
+    if (writer->lengths[t])
+      lengths[i++] = writer->lengths[t];
+
+  int failed = e.failed || size > UINT32_MAX;
+  if (!failed) {
+    failed = !fwrite(record, RECORD + bitmap, 1, writer->f) ||
+             (changed && !fwrite(lengths, sizeof(u32), changed, writer->f));
+    for (u32 t = 0; t < writer->tiles && !failed; t++)
+      if (writer->lengths[t])
+        failed = !fwrite(writer->chunks[t], writer->lengths[t], 1, writer->f);
+  }
+
+  for (u32 t = 0; t < writer->tiles; t++)
+    if (writer->lengths[t])
+      free(writer->chunks[t]);
+  HANDLE(!failed, "failed to write frame", {
+    fseek(writer->f, writer->offset, SEEK_SET); // the next one overwrites it
+    return 1;
+  });
+
+  u32 keyframe = key ? count : writer->entries[count - 1].keyframe;
+  writer->entries[writer->count++] = (entry_t){writer->offset, size, keyframe};
+  writer->offset += size;
+
+  memcpy(prev->data, frame.data,
+         (size_t)frame.width * frame.height * frame.channels);
+
+  return 0;
+}
+
+int image_sequence_finish(image_sequence_writer_t *writer) {
+  TRACE_CALL();
+  HANDLE(writer, "invalid value(s)", return 1);
+
+  // Write Index & its offset into the header
+  FILE *f = writer->f;
+  u32 count = writer->count;
+  int failed = !fwrite(&count, sizeof(u32), 1, f) ||
+               (count && !fwrite(writer->entries, sizeof(entry_t), count, f)) ||
+               fseek(f, HEADER - sizeof(u64), SEEK_SET) ||
+               !fwrite(&writer->offset, sizeof(u64), 1, f);
+
+  failed |= fclose(f) != 0;
+  writer->f = NULL;
+  writer_free(writer);
+
+  HANDLE(!failed, "failed to write index", return 1);
+  return 0;
+}
+
+//////////////////////////////// Reading
+
+struct image_sequence {
+  reader_t r;
+  image_t *frame;
+  u32 current; // frame held in frame (count when none)
+
+  entry_t *entries;
+  u32 count;
+
+  u32 tiles;
+  uc *changed;
+  u32 *order;      // changed tiles of a record
+  size_t *offsets; // of their chunks in the record, & its end
+
+  uc *record;
+  size_t capacity;
+};
+
+// Index of a sequence that was never finished, from its records
+static int sequence_scan(image_sequence_t *s) {
+  reader_seek(&s->r, 0, SEEK_END);
+  u64 end = reader_tell(&s->r), offset = HEADER;
+
+  u32 capacity = 0;
+  for (;;) {
+    uc record[RECORD];
+    if (reader_seek(&s->r, offset, SEEK_SET) ||
+        !reader_read(&s->r, record, RECORD, 1))
+      break;
+
+    u64 size = (u64)*(u32 *)record + sizeof(u32);
+    if (size < RECORD || offset + size > end)
+      break;
+
+    if (s->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      entry_t *entries = realloc(s->entries, capacity * sizeof(entry_t));
+      HANDLE(entries, "failed to grow frame index", return 1);
+      s->entries = entries;
+    }
+
+    HANDLE(record[4] || s->count, "first frame is not a keyframe", return 1);
+    u32 keyframe = record[4] ? s->count : s->entries[s->count - 1].keyframe;
+    s->entries[s->count++] = (entry_t){offset, size, keyframe};
+    offset += size;
+  }
+
+  WARNING("sequence was not finished, index rebuilt");
+  return 0;
+}
+
+// Index written by image_sequence_finish
+static int sequence_index(image_sequence_t *s, u64 offset) {
+  HANDLE(!reader_seek(&s->r, offset, SEEK_SET) &&
+             reader_read(&s->r, &s->count, sizeof(u32), 1),
+         "failed to read index", return 1);
+
+  s->entries = malloc((s->count ? s->count : 1) * sizeof(entry_t));
+  HANDLE(s->entries, "failed to allocate index", return 1);
+  HANDLE(reader_read(&s->r, s->entries, sizeof(entry_t), s->count) ==
+             s->count,
+         "failed to read index", return 1);
+
+  for (u32 i = 0; i < s->count; i++) {
+    const entry_t *e = &s->entries[i];
+    HANDLE(e->offset >= HEADER && e->size >= RECORD &&
+               e->offset + e->size <= offset && e->keyframe <= i &&
+               s->entries[e->keyframe].keyframe == e->keyframe,
+           "invalid index", return 1);
+  }
+
+  return 0;
+}
+
+image_sequence_t *image_sequence_open(const char *path) {
+  TRACE_CALL();
+  image_sequence_t *s = calloc(1, sizeof(image_sequence_t));
+  HANDLE(s, "failed to allocate sequence", return NULL);
+  HANDLE(!reader_open(&s->r, path), "no such file", {
+    free(s);
+    return NULL;
+  });
+
+// Current Exit Procedure
+#define EXIT                                                                   \
+  {                                                                            \
+    image_sequence_free(s);                                                    \
+    return NULL;                                                               \
+  }
+
+  // Read Header
+  trace_begin(IMAGE_STAGE_HEADER);
+  uc header[HEADER];
+  HANDLE(reader_read(&s->r, header, HEADER, 1), "failed to read header",
+         EXIT);
+  HANDLE(!memcmp(header, "qoiv", 4), "invalid file", EXIT);
+
+  u32 width = *(u32 *)&header[4], height = *(u32 *)&header[8];
+  u8 channels = header[12];
+  u64 index = *(u64 *)&header[16];
+  HANDLE(channels >= 1 && channels <= 4, "invalid channel count", EXIT);
+
+  s->frame = image_allocate(width, height, channels);
+  HANDLE(s->frame, "failed to create image", EXIT);
+
+  s->tiles = tile_count(width, height);
+  s->changed = calloc(s->tiles, 1);
+  s->order = malloc(s->tiles * sizeof(u32));
+  s->offsets = malloc((s->tiles + 1) * sizeof(size_t));
+  HANDLE(s->changed && s->order && s->offsets, "failed to allocate sequence",
+         EXIT);
+
+  if (index ? sequence_index(s, index) : sequence_scan(s))
+    EXIT;
+  s->current = s->count;
+  trace_alloc(sizeof(image_sequence_t) + s->count * sizeof(entry_t) +
+              (size_t)s->tiles * (1 + sizeof(u32) + sizeof(size_t)));
+  trace_end();
+
+#undef EXIT
+
+  return s;
+}
+
+uint32_t image_sequence_count(const image_sequence_t *sequence) {
+  return sequence ? sequence->count : 0;
+}
+
+typedef struct {
+  image_sequence_t *s;
+  int key, failed;
+  u32 count, next; // changed tiles, the one to claim
+} decode_t;
+
+// The i-th changed tile (pixels are the worker's)
+static void decode_tile(decode_t *d, u32 i, uc *pixels) {
+  image_sequence_t *s = d->s;
+  image_t frame = *s->frame;
+  u8 ch = frame.channels;
+
+  u32 t = s->order[i], x, y, w, h;
+  tile_rect(frame, t, &x, &y, &w, &h);
+
+  reader_t r;
+  reader_memory(&r, &s->record[s->offsets[i]],
+                s->offsets[i + 1] - s->offsets[i]);
+
+  qoi_state_t q;
+  qoi_init(&q);
+  if (qoi_decode_chunks(&q, &r, pixels, w * h, ch) || q.eof ||
+      r.cursor != r.size) {
+    __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  size_t stride = (size_t)frame.width * ch, offset = y * stride + x * ch;
+  for (u32 row = 0; row < h; row++) {
+    uc *dst = &frame.data[offset + row * stride];
+    const uc *src = &pixels[row * w * ch];
+    if (d->key)
+      memcpy(dst, src, w * ch);
+    else
+      for (u32 j = 0; j < w * ch; j++)
+        dst[j] += src[j];
+  }
+}
+
+static void decode_worker(u32 i, void *arg) {
+  decode_t *d = arg;
+  uc *pixels = malloc(TILE_PIXELS);
+  HANDLE(pixels, "failed to allocate tile buffer", {
+    __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+    return;
+  });
+  trace_alloc(TILE_PIXELS);
+
+  u32 k;
+  while ((k = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED)) < d->count)
+    decode_tile(d, k, pixels);
+
+  free(pixels);
+}
+
+// Apply the record of frame i to the frame held
+static int sequence_decode(image_sequence_t *s, u32 i) {
+  const entry_t *e = &s->entries[i];
+
+  if (e->size > s->capacity) {
+    uc *record = realloc(s->record, e->size);
+    HANDLE(record, "failed to allocate record", return 1);
+    trace_alloc(e->size - s->capacity);
+    s->record = record, s->capacity = e->size;
+  }
+
+  trace_begin(IMAGE_STAGE_READ);
+  int read = !reader_seek(&s->r, e->offset, SEEK_SET) &&
+             reader_read(&s->r, s->record, e->size, 1);
+  trace_end();
+  HANDLE(read, "failed to read frame", return 1);
+
+  // Changed tiles & where their chunks start
+  u32 bitmap = (s->tiles + 7) / 8, changed = 0;
+  int key = s->record[4];
+  HANDLE(*(u32 *)s->record == e->size - sizeof(u32) &&
+             RECORD + bitmap <= e->size && (key || i != e->keyframe),
+         "invalid frame", return 1);
+
+  const uc *bits = &s->record[RECORD];
+  for (u32 t = 0; t < s->tiles; t++)
+    if (bits[t / 8] >> t % 8 & 1)
+      s->order[changed++] = t;
+
+  size_t offset = RECORD + bitmap + (size_t)changed * sizeof(u32);
+  HANDLE(offset <= e->size, "invalid frame", return 1);
+  const uc *lengths = &s->record[RECORD + bitmap];
+  for (u32 k = 0; k < changed; k++) {
+    s->offsets[k] = offset;
+    u32 length;
+    memcpy(&length, &lengths[k * sizeof(u32)], sizeof(u32));
+    offset += length;
+    s->changed[s->order[k]] = 1;
+  }
+  HANDLE(offset == e->size && (!key || changed == s->tiles), "invalid frame",
+         return 1);
+  s->offsets[changed] = offset;
+
+  decode_t d = {s, key, 0, changed, 0};
+  trace_begin(IMAGE_STAGE_DECODE);
+  parallel_range(tile_workers(changed), decode_worker, &d);
+  trace_end();
+  HANDLE(!d.failed, "failed to decode tile", return 1);
+
+  return 0;
+}
+
+const image_t *image_sequence_frame(image_sequence_t *sequence,
+                                    uint32_t index) {
+  TRACE_CALL();
+  HANDLE(sequence && index < sequence->count, "invalid value(s)",
+         return NULL);
+
+  memset(sequence->changed, 0, sequence->tiles);
+  if (sequence->current == index)
+    return sequence->frame;
+
+  // on from the frame held when that is between the keyframe & index
+  u32 keyframe = sequence->entries[index].keyframe;
+  u32 current = sequence->current;
+  u32 start = current < sequence->count && current >= keyframe &&
+                      current < index
+                  ? current + 1
+                  : keyframe;
+
+  for (u32 i = start; i <= index; i++)
+    if (sequence_decode(sequence, i)) {
+      sequence->current = sequence->count;
+      return NULL;
+    }
+
+  sequence->current = index;
+  return sequence->frame;
+}
+
+const uint8_t *image_sequence_changed(const image_sequence_t *sequence) {
+  return sequence ? sequence->changed : NULL;
+}
+
+void image_sequence_free(image_sequence_t *sequence) {
+  if (!sequence)
+    return;
+
+  reader_close(&sequence->r);
+  image_free(sequence->frame);
+  free(sequence->entries);
+  free(sequence->changed);
+  free(sequence->order);
+  free(sequence->offsets);
+  free(sequence->record);
+  free(sequence);
+}
@@ -0,0 +1,205 @@
+/**
+ * @brief Shared Memory Images
+ *
+ * Pixels live in a memfd after a small header, so another process maps the
+ * same pages from the fd instead of receiving a copy. Mappings are tracked
+ * by their data pointer, which is how image_free tells them from heap data.
+ * The geometry is fixed at creation, every mapping trusting its header.
+ */
+
+#define _GNU_SOURCE // memfd_create
+
+#include "shared.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Pixels start this far into the memfd
+#define HEADER_SIZE 64
+
+// Start of the memfd
+typedef struct {
+  char magic[4]; // "IMGS"
+  u32 width, height;
+  u8 channels;
+} header_t;
+
+typedef struct mapping {
+  uc *data;
+  void *base;
+  size_t length;
+  int fd;
+
+  struct mapping *next;
+} mapping_t;
+
+static struct {
+  pthread_mutex_t lock;
+  mapping_t *head;
+} mappings = {PTHREAD_MUTEX_INITIALIZER};
+
+void data_free(uc *data) {
+  // heap data, unless shared images exist
+  if (!__atomic_load_n(&mappings.head, __ATOMIC_ACQUIRE)) {
+    free(data);
+    return;
+  }
+
+  pthread_mutex_lock(&mappings.lock);
+  mapping_t **m = &mappings.head;
+  while (*m && (*m)->data != data)
+    m = &(*m)->next;
+
+  mapping_t *found = *m;
+  if (found)
+    __atomic_store_n(m, found->next, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&mappings.lock);
+
+  if (!found) {
+    free(data);
+    return;
+  }
+
+#ifdef __linux__
+  munmap(found->base, found->length);
+  close(found->fd);
+#endif
+  free(found);
+}
+
+int data_pinned(image_t image, u32 width, u32 height, u8 channels) {
+  int same = width == image.width && height == image.height &&
+             channels == image.channels;
+  return !same && image_shared_fd(image) >= 0;
+}
+
+void data_replace(image_t *image, uc *data, u32 width, u32 height,
+                  u8 channels) {
+  if (image_shared_fd(*image) >= 0) {
+    memcpy(image->data, data, (size_t)width * height * channels);
+    free(data);
+  } else {
+    data_free(image->data);
+    image->data = data;
+  }
+
+  image->width = width, image->height = height, image->channels = channels;
+}
+
+int image_shared_fd(image_t image) {
+  pthread_mutex_lock(&mappings.lock);
+  mapping_t *m = mappings.head;
+  while (m && m->data != image.data)
+    m = m->next;
+
+  int fd = m ? m->fd : -1;
+  pthread_mutex_unlock(&mappings.lock);
+
+  return fd;
+}
+
+#ifdef __linux__
+
+// Map length bytes of fd (owned from here on) as an image
+static image_t *map(int fd, size_t length, int create, u32 width, u32 height,
+                    u8 channels) {
+#define EXIT                                                                   \
+  {                                                                            \
+    if (base != MAP_FAILED)                                                    \
+      munmap(base, length);                                                    \
+    free(out);                                                                 \
+    free(m);                                                                   \
+    close(fd);                                                                 \
+    return NULL;                                                               \
+  }
+
+  image_t *out = malloc(sizeof(image_t));
+  mapping_t *m = malloc(sizeof(mapping_t));
+  void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  HANDLE(out && m, "failed to allocate image", EXIT);
+  HANDLE(base != MAP_FAILED, "failed to map image data", EXIT);
+
+  header_t *header = base;
+  if (create) {
+    *header = (header_t){{'I', 'M', 'G', 'S'}, width, height, channels};
+  } else {
+    HANDLE(!memcmp(header->magic, "IMGS", 4), "not a shared image", EXIT);
+    width = header->width, height = header->height;
+    channels = header->channels;
+
+    HANDLE(width && height && channels && channels <= 4 &&
+               length - HEADER_SIZE >= (size_t)width * height * channels,
+           "invalid shared image header", EXIT);
+  }
+
+  *out = (image_t){width, height, channels, (uc *)base + HEADER_SIZE};
+  *m = (mapping_t){out->data, base, length, fd};
+
+  pthread_mutex_lock(&mappings.lock);
+  m->next = mappings.head;
+  __atomic_store_n(&mappings.head, m, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&mappings.lock);
+
+  return out;
+#undef EXIT
+}
+
+image_t *image_allocate_shared(uint32_t width, uint32_t height,
+                               uint32_t channels) {
+  TRACE_CALL();
+  HANDLE(width != 0 && height != 0 && channels != 0 && channels <= 4,
+         "invalid value(s)", return NULL);
+
+  size_t length = HEADER_SIZE + (size_t)width * height * channels;
+  int fd = memfd_create("image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  HANDLE(fd >= 0, "failed to create memfd", return NULL);
+
+  // the size is fixed, so no process can make the others' mappings fault
+  HANDLE(!ftruncate(fd, length) &&
+             !fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW),
+         "failed to size memfd", {
+           close(fd);
+           return NULL;
+         });
+  trace_alloc(length);
+
+  return map(fd, length, 1, width, height, channels);
+}
+
+image_t *image_map_shared(int fd) {
+  TRACE_CALL();
+  struct stat st;
+  HANDLE(fd >= 0 && !fstat(fd, &st), "invalid file descriptor", return NULL);
+  HANDLE(st.st_size >= HEADER_SIZE, "not a shared image", return NULL);
+
+  int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  HANDLE(own >= 0, "failed to duplicate file descriptor", return NULL);
+
+  return map(own, st.st_size, 0, 0, 0, 0);
+}
+
+#else
+
+image_t *image_allocate_shared(uint32_t width, uint32_t height,
+                               uint32_t channels) {
+  ERROR("shared images need memfd (Linux)");
+  return NULL;
+}
+
+image_t *image_map_shared(int fd) {
+  ERROR("shared images need memfd (Linux)");
+  return NULL;
+}
+
+#endif
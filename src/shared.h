@@ -0,0 +1,20 @@
+/**
+ * @brief Shared Memory Images
+ */
+
+#pragma once
+
+#include "types.h"
+#include <image.h>
+
+// Release pixel data, unmapping it when it belongs to a shared image
+void data_free(uc *data);
+
+// Whether image is shared and width x height x channels differs from its
+// geometry, which other processes read from the header once when mapping
+int data_pinned(image_t image, u32 width, u32 height, u8 channels);
+
+// New pixels for image (data is taken over), copied into a shared image's
+// mapping (same geometry, see data_pinned)
+void data_replace(image_t *image, uc *data, u32 width, u32 height,
+                  u8 channels);
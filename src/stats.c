@@ -0,0 +1,245 @@
+/**
+ * @brief Image Statistics & Comparison
+ *
+ * Everything runs in parallel row bands. Histograms count into four copies
+ * taken in turn, so runs of one value do not wait on their own increments;
+ * the statistics are read off the histogram. SSIM sums each 4x4 block once
+ * and adds four of them per 8x8 window.
+ */
+
+#include "kernel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <math.h>
+#include <string.h>
+
+// 4x4 blocks per SSIM column strip
+#define SSIM_BLOCKS 64
+
+//////////////////////////////// Histogram
+
+static void histogram_band(image_t image, u32 y0, u32 y1, void *arg) {
+  image_histogram_t *out = arg;
+  u8 ch = image.channels;
+
+  // [copy][channel][value], pixel i counts into copy i % 4
+  u32 counts[4][4][256];
+  memset(counts, 0, sizeof(counts));
+
+  size_t length = (size_t)(y1 - y0) * image.width, i = 0;
+  const uc *p = &image.data[(size_t)y0 * image.width * ch];
+  for (; i + 4 <= length; i += 4, p += ch * 4)
+    for (u8 c = 0; c < ch; c++) {
+      counts[0][c][p[c]]++;
+      counts[1][c][p[ch + c]]++;
+      counts[2][c][p[ch * 2 + c]]++;
+      counts[3][c][p[ch * 3 + c]]++;
+    }
+  for (; i < length; i++, p += ch)
+    for (u8 c = 0; c < ch; c++)
+      counts[0][c][p[c]]++;
+
+  for (u8 c = 0; c < ch; c++)
+    for (int v = 0; v < 256; v++) {
+      u64 n = (u64)counts[0][c][v] + counts[1][c][v] + counts[2][c][v] +
+              counts[3][c][v];
+      if (n)
+        __atomic_fetch_add(&out->counts[c][v], n, __ATOMIC_RELAXED);
+    }
+}
+
+int image_histogram(image_t image, image_histogram_t *histogram) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image) && image.channels <= 4, "invalid image",
+         return 1);
+  HANDLE(histogram, "invalid value(s)", return 1);
+
+  memset(histogram, 0, sizeof(image_histogram_t));
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  image_parallel_for(image, 0, histogram_band, histogram);
+  trace_end();
+
+  return 0;
+}
+
+int image_statistics(image_t image, image_statistics_t *statistics) {
+  TRACE_CALL();
+  HANDLE(statistics, "invalid value(s)", return 1);
+
+  image_histogram_t h;
+  if (image_histogram(image, &h))
+    return 1;
+
+  memset(statistics, 0, sizeof(image_statistics_t));
+  for (u8 c = 0; c < image.channels; c++) {
+    const u64 *counts = h.counts[c];
+
+    u64 n = 0, sum = 0;
+    int lo = -1, hi = 0;
+    for (int v = 0; v < 256; v++)
+      if (counts[v]) {
+        lo = lo < 0 ? v : lo, hi = v;
+        n += counts[v], sum += counts[v] * v;
+      }
+
+    double mean = (double)sum / n, variance = 0;
+    for (int v = lo; v <= hi; v++)
+      variance += counts[v] * (v - mean) * (v - mean);
+
+    statistics->min[c] = lo, statistics->max[c] = hi;
+    statistics->mean[c] = mean;
+    statistics->stddev[c] = sqrt(variance / n);
+  }
+
+  return 0;
+}
+
+//////////////////////////////// MSE & PSNR
+
+typedef struct {
+  image_t b;
+  u64 sum;
+} mse_t;
+
+static void mse_band(image_t a, u32 y0, u32 y1, void *arg) {
+  mse_t *m = arg;
+  size_t stride = (size_t)a.width * a.channels, offset = y0 * stride;
+
+  u64 sum = kernels.sse(&a.data[offset], &m->b.data[offset],
+                        (y1 - y0) * stride);
+  __atomic_fetch_add(&m->sum, sum, __ATOMIC_RELAXED);
+}
+
+// Both images valid & the same size
+static int same_size(image_t a, image_t b) {
+  HANDLE(image_is_valid(a) && image_is_valid(b), "invalid image", return 0);
+  HANDLE(a.width == b.width && a.height == b.height &&
+             a.channels == b.channels,
+         "images differ in size", return 0);
+  return 1;
+}
+
+int image_mse(image_t a, image_t b, double *mse, double *psnr) {
+  TRACE_CALL();
+  if (!same_size(a, b))
+    return 1;
+
+  mse_t m = {b, 0};
+  trace_begin(IMAGE_STAGE_CONVERT);
+  image_parallel_for(a, 0, mse_band, &m);
+  trace_end();
+
+  double error = (double)m.sum / ((double)a.width * a.height * a.channels);
+  if (mse)
+    *mse = error;
+  if (psnr)
+    *psnr = error ? 10 * log10(255.0 * 255.0 / error) : INFINITY;
+
+  return 0;
+}
+
+//////////////////////////////// SSIM
+
+typedef struct {
+  image_t b;
+  u32 band;
+  double *totals; // window SSIM sum per band
+} ssim_t;
+
+// SSIM of one 8x8 window from its sums (as x264)
+static double window(double s1, double s2, double ss, double s12) {
+  const double c1 = .01 * .01 * 255 * 255 * 64;
+  const double c2 = .03 * .03 * 255 * 255 * 64 * 63;
+
+  double vars = ss * 64 - s1 * s1 - s2 * s2;
+  double covar = s12 * 64 - s1 * s2;
+  return (2 * s1 * s2 + c1) * (2 * covar + c2) /
+         ((s1 * s1 + s2 * s2 + c1) * (vars + c2));
+}
+
+// Sums of count 4x4 blocks from block column bx of block row by,
+// [block][channel][a, b, a * a + b * b, a * b]
+static void block_row(u32 (*out)[4][4], image_t a, image_t b, u32 by, u32 bx,
+                      u32 count) {
+  u8 ch = a.channels;
+  size_t stride = (size_t)a.width * ch;
+  size_t offset = (size_t)by * 4 * stride + (size_t)bx * 4 * ch;
+  size_t length = (size_t)count * 4 * ch;
+
+  u32 columns[4][(SSIM_BLOCKS + 1) * 16];
+  u32 *sums[4] = {columns[0], columns[1], columns[2], columns[3]};
+  kernels.ssim_sums(sums, &a.data[offset], &b.data[offset], stride, length);
+
+  for (u32 x = 0; x < count; x++)
+    for (u8 c = 0; c < ch; c++)
+      for (int q = 0; q < 4; q++) {
+        const u32 *s = &columns[q][x * 4 * ch + c];
+        out[x][c][q] = s[0] + s[ch] + s[ch * 2] + s[ch * 3];
+      }
+}
+
+// Windows starting on the block rows of the band (bands are whole blocks)
+static void ssim_band(image_t a, u32 y0, u32 y1, void *arg) {
+  const ssim_t *s = arg;
+  u32 bw = a.width / 4, bh = a.height / 4;
+  u32 w0 = y0 / 4, w1 = y1 / 4 < bh - 1 ? y1 / 4 : bh - 1;
+
+  double total = 0;
+  u32 blocks[2][SSIM_BLOCKS + 1][4][4];
+  for (u32 bx = 0; bx + 1 < bw; bx += SSIM_BLOCKS) {
+    u32 n = bw - 1 - bx < SSIM_BLOCKS ? bw - 1 - bx : SSIM_BLOCKS;
+
+    // block rows wy & wy + 1, the second is the next one's first
+    for (u32 wy = w0; wy < w1; wy++) {
+      if (wy == w0)
+        block_row(blocks[wy & 1], a, s->b, wy, bx, n + 1);
+      block_row(blocks[(wy + 1) & 1], a, s->b, wy + 1, bx, n + 1);
+
+      u32(*top)[4][4] = blocks[wy & 1], (*bottom)[4][4] = blocks[~wy & 1];
+      for (u32 x = 0; x < n; x++)
+        for (u8 c = 0; c < a.channels; c++) {
+          u32 v[4];
+          for (int q = 0; q < 4; q++)
+            v[q] = top[x][c][q] + top[x + 1][c][q] + bottom[x][c][q] +
+                   bottom[x + 1][c][q];
+          total += window(v[0], v[1], v[2], v[3]);
+        }
+    }
+  }
+
+  s->totals[y0 / s->band] = total;
+}
+
+int image_ssim(image_t a, image_t b, double *ssim) {
+  TRACE_CALL();
+  if (!same_size(a, b))
+    return 1;
+  HANDLE(a.width >= 8 && a.height >= 8, "images smaller than 8x8", return 1);
+  HANDLE(ssim, "invalid value(s)", return 1);
+
+  // a few bands per thread, whole block rows each
+  unsigned threads = image_parallel_count();
+  u32 band = (a.height + threads * 4 - 1) / (threads * 4);
+  band = (band + 3) / 4 * 4;
+
+  u32 bands = (a.height + band - 1) / band;
+  double totals[bands];
+  ssim_t s = {b, band, totals};
+
+  trace_begin(IMAGE_STAGE_CONVERT);
+  image_parallel_for(a, band, ssim_band, &s);
+  trace_end();
+
+  // summed in band order, so repeated calls agree
+  double total = 0;
+  for (u32 i = 0; i < bands; i++)
+    total += totals[i];
+
+  u64 windows = (u64)(a.width / 4 - 1) * (a.height / 4 - 1) * a.channels;
+  *ssim = total / windows;
+
+  return 0;
+}
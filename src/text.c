@@ -0,0 +1,514 @@
+/**
+ * @brief Bitmap Font Text
+ *
+ * Fonts hold glyph coverage at their own size. Each glyph is rendered once
+ * per color & scale into an R-G-B-A atlas kept by the font, and a batch of
+ * texts is laid out up front, then the inked part of every glyph is blended
+ * straight from the atlas by the blend kernel, in parallel row bands.
+ */
+
+#include "kernel.h"
+#include "trace.h"
+#include "util.h"
+#include <image.h>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+
+// Atlases kept by a font
+#define ATLASES 16
+
+#define MAX_SCALE 16
+
+// Built-in font, ASCII 32 to 126, lowest bit leftmost
+static const u8 font8x8[95][8] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+    {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00}, // !
+    {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // "
+    {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}, // #
+    {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00}, // $
+    {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}, // %
+    {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00}, // &
+    {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // '
+    {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00}, // (
+    {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00}, // )
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, // *
+    {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}, // +
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // ,
+    {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // .
+    {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00}, // /
+    {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00}, // 0
+    {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00}, // 1
+    {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00}, // 2
+    {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00}, // 3
+    {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00}, // 4
+    {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00}, // 5
+    {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00}, // 6
+    {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00}, // 7
+    {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00}, // 8
+    {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00}, // 9
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // :
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // ;
+    {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00}, // <
+    {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}, // =
+    {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00}, // >
+    {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00}, // ?
+    {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}, // @
+    {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00}, // A
+    {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00}, // B
+    {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00}, // C
+    {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00}, // D
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00}, // E
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00}, // F
+    {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00}, // G
+    {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00}, // H
+    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // I
+    {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00}, // J
+    {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00}, // K
+    {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00}, // L
+    {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00}, // M
+    {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00}, // N
+    {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00}, // O
+    {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00}, // P
+    {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00}, // Q
+    {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00}, // R
+    {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00}, // S
+    {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // T
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00}, // U
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // V
+    {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00}, // W
+    {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00}, // X
+    {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00}, // Y
+    {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // Z
+    {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00}, // [
+    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00}, // backslash
+    {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00}, // ]
+    {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00}, // ^
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, // _
+    {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, // `
+    {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00}, // a
+    {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00}, // b
+    {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00}, // c
+    {0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00}, // d
+    {0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00}, // e
+    {0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00}, // f
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // g
+    {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00}, // h
+    {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // i
+    {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E}, // j
+    {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00}, // k
+    {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // l
+    {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00}, // m
+    {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00}, // n
+    {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00}, // o
+    {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F}, // p
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78}, // q
+    {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00}, // r
+    {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00}, // s
+    {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00}, // t
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00}, // u
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // v
+    {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00}, // w
+    {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00}, // x
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // y
+    {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00}, // z
+    {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00}, // {
+    {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00}, // |
+    {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00}, // }
+    {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ~
+};
+
+// Glyphs of one color & scale, each rendered on first use
+typedef struct {
+  uc color[4];
+  u8 scale;
+  int cached; // kept by the font (freed on release otherwise)
+  u32 refs;   // draws using it
+  u64 used;   // font clock at the last use
+
+  uc *pixels; // glyph g from row g * height * scale on
+  u8 *ready;
+} atlas_t;
+
+struct image_font {
+  u32 width, height; // of a glyph
+  u32 first, count;  // code points
+  int builtin;
+
+  uc *coverage;  // width * height per glyph
+  u32 (*ink)[4]; // x0, y0, x1, y1 of the covered part of each glyph
+
+  pthread_mutex_t lock; // of the atlases
+  atlas_t *atlases[ATLASES];
+  u64 clock;
+};
+
+//////////////////////////////// Fonts
+
+// Bounds of nonzero coverage
+static void font_ink(image_font_t *font) {
+  for (u32 g = 0; g < font->count; g++) {
+    const uc *c = &font->coverage[(size_t)g * font->width * font->height];
+    u32 *ink = font->ink[g];
+    ink[0] = font->width, ink[1] = font->height, ink[2] = ink[3] = 0;
+
+    for (u32 y = 0; y < font->height; y++)
+      for (u32 x = 0; x < font->width; x++)
+        if (c[y * font->width + x]) {
+          ink[0] = x < ink[0] ? x : ink[0], ink[1] = y < ink[1] ? y : ink[1];
+          ink[2] = x >= ink[2] ? x + 1 : ink[2], ink[3] = y + 1;
+        }
+  }
+}
+
+// Coverage from rows of (width + 7) / 8 bytes
+static void font_bits(image_font_t *font, const u8 *bits) {
+  u32 stride = (font->width + 7) / 8;
+  for (u32 g = 0; g < font->count; g++)
+    for (u32 y = 0; y < font->height; y++) {
+      const u8 *row = &bits[((size_t)g * font->height + y) * stride];
+      uc *c = &font->coverage[((size_t)g * font->height + y) * font->width];
+      for (u32 x = 0; x < font->width; x++)
+        c[x] = row[x / 8] >> (x % 8) & 1 ? 255 : 0;
+    }
+}
+
+static image_font_t *font_allocate(u32 width, u32 height, u32 first,
+                                   u32 count) {
+  HANDLE(width && height && count && first + (u64)count <= 0x110000,
+         "invalid value(s)", return NULL);
+
+  image_font_t *font = calloc(1, sizeof(image_font_t));
+  HANDLE(font, "failed to allocate font", return NULL);
+
+  size_t size = (size_t)width * height * count;
+  font->width = width, font->height = height;
+  font->first = first, font->count = count;
+  font->coverage = malloc(size);
+  font->ink = malloc(count * sizeof(*font->ink));
+  pthread_mutex_init(&font->lock, NULL);
+  trace_alloc(sizeof(image_font_t) + size + count * sizeof(*font->ink));
+
+  HANDLE(font->coverage && font->ink, "failed to allocate font", {
+    image_font_free(font);
+    return NULL;
+  });
+
+  return font;
+}
+
+static image_font_t builtin = {.builtin = 1,
+                               .lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static void builtin_init(void) {
+  static uc coverage[95 * 8 * 8];
+  static u32 ink[95][4];
+
+  builtin.width = builtin.height = 8;
+  builtin.first = 32, builtin.count = 95;
+  builtin.coverage = coverage, builtin.ink = ink;
+  font_bits(&builtin, &font8x8[0][0]);
+  font_ink(&builtin);
+}
+
+image_font_t *image_font_default(void) {
+  pthread_once(&builtin_once, builtin_init);
+  return &builtin;
+}
+
+image_font_t *image_font_bitmap(const uint8_t *bits, uint32_t width,
+                                uint32_t height, uint32_t first,
+                                uint32_t count) {
+  TRACE_CALL();
+  HANDLE(bits, "invalid value(s)", return NULL);
+
+  image_font_t *font = font_allocate(width, height, first, count);
+  if (!font)
+    return NULL;
+
+  font_bits(font, bits);
+  font_ink(font);
+
+  return font;
+}
+
+image_font_t *image_font_sheet(image_t sheet, uint32_t width, uint32_t height,
+                               uint32_t first, uint32_t count) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(sheet) && sheet.channels <= 4, "invalid image",
+         return NULL);
+  HANDLE(width && height && width <= sheet.width && height <= sheet.height,
+         "invalid glyph size", return NULL);
+
+  u32 columns = sheet.width / width;
+  HANDLE(count <= (u64)columns * (sheet.height / height),
+         "sheet holds fewer glyphs", return NULL);
+
+  image_font_t *font = font_allocate(width, height, first, count);
+  if (!font)
+    return NULL;
+
+  // alpha when there is one, else the first channel
+  u8 ch = sheet.channels, c = ch == 2 || ch == 4 ? ch - 1 : 0;
+  for (u32 g = 0; g < count; g++)
+    for (u32 y = 0; y < height; y++) {
+      size_t row = (size_t)(g / columns * height + y) * sheet.width +
+                   g % columns * width;
+      uc *out = &font->coverage[((size_t)g * height + y) * width];
+      for (u32 x = 0; x < width; x++)
+        out[x] = sheet.data[(row + x) * ch + c];
+    }
+  font_ink(font);
+
+  return font;
+}
+
+static void atlas_free(atlas_t *atlas) {
+  if (!atlas)
+    return;
+
+  free(atlas->pixels);
+  free(atlas->ready);
+  free(atlas);
+}
+
+void image_font_free(image_font_t *font) {
+  if (!font || font->builtin)
+    return;
+
+  for (u32 i = 0; i < ATLASES; i++)
+    atlas_free(font->atlases[i]);
+  pthread_mutex_destroy(&font->lock);
+  free(font->coverage);
+  free(font->ink);
+  free(font);
+}
+
+// Next code point of UTF-8 text (a byte of a bad sequence stands for itself)
+static u32 next_code(const uc **text) {
+  const uc *p = *text;
+  u32 code = p[0], n = code >= 0xF0 ? 3 : code >= 0xE0 ? 2 : code >= 0xC0;
+  for (u32 i = 1; i <= n; i++)
+    if ((p[i] & 0xC0) != 0x80)
+      n = 0;
+
+  if (n) {
+    code &= 0x3F >> n;
+    for (u32 i = 1; i <= n; i++)
+      code = code << 6 | (p[i] & 0x3F);
+  }
+
+  *text = p + n + 1;
+  return code;
+}
+
+void image_text_size(const image_font_t *font, const char *text,
+                     uint8_t scale, uint32_t *width, uint32_t *height) {
+  u32 w = 0, h = 0;
+  if (font && text) {
+    u32 columns = 0, lines = *text != 0;
+    for (const uc *p = (const uc *)text; *p;)
+      if (next_code(&p) == '\n')
+        lines++, columns = 0;
+      else
+        w = ++columns > w ? columns : w;
+
+    w *= font->width * scale, h = lines * font->height * scale;
+  }
+
+  if (width)
+    *width = w;
+  if (height)
+    *height = h;
+}
+
+//////////////////////////////// Atlases
+
+// Atlas of color & scale, kept in an empty slot or in place of the least
+// recently used one no draw is using (font locked)
+static atlas_t *atlas_acquire(image_font_t *font, const uc *color, u8 scale) {
+  int slot = -1;
+  for (int i = 0; i < ATLASES; i++) {
+    atlas_t *a = font->atlases[i], *s = slot < 0 ? NULL : font->atlases[slot];
+    if (a && a->scale == scale && !memcmp(a->color, color, 4)) {
+      a->refs++, a->used = ++font->clock;
+      return a;
+    }
+
+    if (!a) {
+      if (slot < 0 || s)
+        slot = i;
+    } else if (!a->refs && (slot < 0 || (s && a->used < s->used))) {
+      slot = i;
+    }
+  }
+
+  size_t glyph = (size_t)font->width * font->height * scale * scale * 4;
+  atlas_t *atlas = calloc(1, sizeof(atlas_t));
+  HANDLE(atlas, "failed to allocate atlas", return NULL);
+  atlas->pixels = calloc(font->count, glyph);
+  atlas->ready = calloc(font->count, 1);
+  HANDLE(atlas->pixels && atlas->ready, "failed to allocate atlas", {
+    atlas_free(atlas);
+    return NULL;
+  });
+  trace_alloc(sizeof(atlas_t) + font->count * (glyph + 1));
+
+  memcpy(atlas->color, color, 4);
+  atlas->scale = scale, atlas->refs = 1, atlas->used = ++font->clock;
+  if (slot >= 0) {
+    atlas_free(font->atlases[slot]);
+    font->atlases[slot] = atlas, atlas->cached = 1;
+  }
+
+  return atlas;
+}
+
+static void atlas_release(atlas_t *atlas) {
+  if (atlas && !--atlas->refs && !atlas->cached)
+    atlas_free(atlas);
+}
+
+// Pixels of glyph g, rendered when first asked for (font locked)
+static const uc *atlas_glyph(const image_font_t *font, atlas_t *atlas, u32 g) {
+  u32 s = atlas->scale, w = font->width * s, h = font->height * s;
+  uc *out = &atlas->pixels[(size_t)g * w * h * 4];
+  if (atlas->ready[g])
+    return out;
+
+  const uc *coverage = &font->coverage[(size_t)g * font->width * font->height];
+  for (u32 y = 0; y < h; y++)
+    for (u32 x = 0; x < w; x++) {
+      uc *p = &out[((size_t)y * w + x) * 4];
+      memcpy(p, atlas->color, 3);
+      p[3] = div255(coverage[y / s * font->width + x / s] * atlas->color[3]);
+    }
+  atlas->ready[g] = 1;
+
+  return out;
+}
+
+//////////////////////////////// Drawing
+
+// Covered part of a glyph placed in the image (clipped)
+typedef struct {
+  u32 x, y, width, height;
+  const uc *src; // atlas pixel of x, y
+  u32 stride;    // atlas row bytes
+} placed_t;
+
+typedef struct {
+  const placed_t *placed;
+  size_t count;
+} layout_t;
+
+static void text_band(image_t image, u32 y0, u32 y1, void *arg) {
+  const layout_t *l = arg;
+  u8 ch = image.channels;
+
+  for (size_t i = 0; i < l->count; i++) {
+    const placed_t *p = &l->placed[i];
+    u32 top = p->y > y0 ? p->y : y0;
+    u32 bottom = p->y + p->height < y1 ? p->y + p->height : y1;
+
+    for (u32 y = top; y < bottom; y++)
+      kernels.blend(&image.data[((size_t)y * image.width + p->x) * ch],
+                    &p->src[(size_t)(y - p->y) * p->stride], p->width, ch);
+  }
+}
+
+// Place the glyphs of text (font locked), returns how many
+static size_t place(placed_t *out, image_t image, const image_font_t *font,
+                    atlas_t *atlas, const image_text_t *text) {
+  u32 s = atlas->scale, w = font->width * s, h = font->height * s;
+  i64 pen_x = text->x, pen_y = text->y;
+  size_t n = 0;
+
+  for (const uc *p = (const uc *)text->text; *p;) {
+    u32 code = next_code(&p);
+    if (code == '\n') {
+      pen_x = text->x, pen_y += h;
+      continue;
+    }
+
+    u32 g = code - font->first;
+    i64 x = pen_x;
+    pen_x += w;
+    if (code < font->first || g >= font->count)
+      continue;
+
+    // covered part, clipped to the image
+    const u32 *ink = font->ink[g];
+    i64 left = x + (i64)ink[0] * s, right = x + (i64)ink[2] * s;
+    i64 top = pen_y + (i64)ink[1] * s, bottom = pen_y + (i64)ink[3] * s;
+    left = left > 0 ? left : 0, top = top > 0 ? top : 0;
+    right = right < image.width ? right : image.width;
+    bottom = bottom < image.height ? bottom : image.height;
+    if (left >= right || top >= bottom)
+      continue;
+
+    const uc *pixels = atlas_glyph(font, atlas, g);
+    out[n++] = (placed_t){
+        left, top, right - left, bottom - top,
+        &pixels[((size_t)(top - pen_y) * w + (left - x)) * 4], w * 4};
+  }
+
+  return n;
+}
+
+int image_draw_text(image_t image, image_font_t *font,
+                    const image_text_t *texts, size_t count) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+  HANDLE(image.channels == 3 || image.channels == 4,
+         "text needs an RGB(A) image", return 1);
+  HANDLE(font && (texts || !count), "invalid value(s)", return 1);
+
+  // at most a glyph per byte
+  size_t length = 0;
+  for (size_t i = 0; i < count; i++) {
+    HANDLE(texts[i].text, "invalid value(s)", return 1);
+    HANDLE(texts[i].scale >= 1 && texts[i].scale <= MAX_SCALE,
+           "scale must be 1 to 16", return 1);
+    length += strlen(texts[i].text);
+  }
+
+  placed_t *placed = malloc((length ? length : 1) * sizeof(placed_t));
+  atlas_t **atlases = calloc(count ? count : 1, sizeof(atlas_t *));
+  HANDLE(placed && atlases, "failed to allocate layout", {
+    free(placed);
+    free(atlases);
+    return 1;
+  });
+  trace_alloc(length * sizeof(placed_t) + count * sizeof(atlas_t *));
+
+  // Layout (& any glyph not rendered yet)
+  trace_begin(IMAGE_STAGE_CONVERT);
+  layout_t l = {placed, 0};
+  int failed = 0;
+  pthread_mutex_lock(&font->lock);
+  for (size_t i = 0; i < count && !failed; i++) {
+    atlases[i] = atlas_acquire(font, texts[i].color, texts[i].scale);
+    failed = !atlases[i];
+    if (!failed)
+      l.count += place(&placed[l.count], image, font, atlases[i], &texts[i]);
+  }
+  pthread_mutex_unlock(&font->lock);
+
+  if (!failed)
+    image_parallel_for(image, 0, text_band, &l);
+  trace_end();
+
+  pthread_mutex_lock(&font->lock);
+  for (size_t i = 0; i < count; i++)
+    atlas_release(atlases[i]);
+  pthread_mutex_unlock(&font->lock);
+
+  free(placed);
+  free(atlases);
+
+  return failed;
+}
@@ -3,208 +3,335 @@
  * @source https://www.fileformat.info/format/tiff/egff.htm
  */
 
+#include "reader.h"
+#include "scale.h"
+#include "trace.h"
 #include "util.h"
 #include <image.h>
 
-#include <byteswap.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <string.h>
 
+// Read 16/32 bit value in file byte order
+static u16 get16(const uc *p, int big) {
+  return big ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+}
+
+static u32 get32(const uc *p, int big) {
+  return big ? (u32)get16(p, big) << 16 | get16(p + 2, big)
+             : (u32)get16(p + 2, big) << 16 | get16(p, big);
+}
+
+// Read the SHORT/LONG values of an IFD entry (inline when they fit in 4 bytes)
+static u32 *tiff_values(reader_t *r, int big, const uc *entry) {
+  u16 type = get16(&entry[2], big);
+  u32 count = get32(&entry[4], big);
+  HANDLE(type == 3 || type == 4, "unsupported field type", return NULL);
+  HANDLE(count > 0 && count < 1 << 24, "invalid field count", return NULL);
+
+  u32 size = type == 3 ? 2 : 4;
+  u32 *out = malloc(count * sizeof(u32));
+  uc *raw = malloc(count * size);
+  trace_alloc(count * (sizeof(u32) + size));
+  HANDLE(out && raw, "failed to allocate field", {
+    free(out);
+    free(raw);
+    return NULL;
+  });
+
+  if (count * size <= 4) {
+    memcpy(raw, &entry[8], count * size);
+  } else {
+    reader_seek(r, get32(&entry[8], big), SEEK_SET);
+    HANDLE(reader_read(r, raw, size, count) == count, "failed to read field", {
+      free(out);
+      free(raw);
+      return NULL;
+    });
+  }
+
+  for (u32 i = 0; i < count; i++)
+    out[i] = size == 2 ? get16(&raw[i * 2], big) : get32(&raw[i * 4], big);
+
+  free(raw);
+  return out;
+}
+
 image_t *image_load_tiff(const char *path) {
-  FILE *f = fopen(path, "rb");
-  HANDLE(f, "no such file", return NULL);
+  TRACE_CALL();
+  return image_load_tiff_scaled(path, 1);
+}
+
+static image_t *tiff_decode(reader_t *r, u8 scale) {
+  HANDLE(scaler_valid(scale), "scale must be 1, 2, 4 or 8", return NULL);
 
 // Current Exit Procedure
 #define EXIT                                                                   \
   {                                                                            \
-    fclose(f);                                                                 \
+    free(entries);                                                             \
+    free(offsets);                                                             \
     return NULL;                                                               \
   }
 
+  uc *entries = NULL;
+  u32 *offsets = NULL;
+
   // Read File Header
+  trace_begin(IMAGE_STAGE_HEADER);
   uc header[8];
-  HANDLE(fread(header, 8, 1, f), "failed to read header", EXIT);
-
-  int endian = 0; // 0 -> little endian, 1 -> big endian
-  if (strncasecmp((char *)header, "II", 2)) {
-    if (strncasecmp((char *)header, "MM", 2))
-      endian = 1;
-    else {
-      ERROR("invalid file");
-      EXIT
-    }
-  }
+  HANDLE(reader_read(r, header, 8, 1), "failed to read header", EXIT);
 
-  HANDLE(endian == 0, "big endian is unsupported", EXIT);
+  int big = 0; // 0 -> little endian, 1 -> big endian
+  if (!strncmp((char *)header, "MM", 2))
+    big = 1;
+  else
+    HANDLE(!strncmp((char *)header, "II", 2), "invalid file", EXIT);
 
-  u16 id_num = *(u16 *)&header[2];
+  u16 id_num = get16(&header[2], big);
   HANDLE(id_num == 42, "invalid version number", EXIT);
 
-  u32 p = *(u32 *)&header[4];
+  u32 p = get32(&header[4], big);
   HANDLE(p != 0, "invalid offset", EXIT);
 
-  // Read first IFD Entry (only one for this reader)
-  fseek(f, p, SEEK_SET); // TODO check
-  u16 count;
-  fread(&count, 2, 1, f); // TODO check
+  // Read first IFD (only one for this reader)
+  uc raw[2];
+  reader_seek(r, p, SEEK_SET);
+  HANDLE(reader_read(r, raw, 2, 1), "failed to read IFD", EXIT);
+
+  u16 count = get16(raw, big);
+  entries = malloc(count * 12);
+  HANDLE(entries, "failed to allocate IFD", EXIT);
+  trace_alloc(count * 12);
+  HANDLE(reader_read(r, entries, 12, count) == count, "failed to read IFD",
+         EXIT);
+
+  struct {
+    u32 width, height;
+    u32 bps;
+    u32 compression;
+    u32 photometric;
+    u32 spp; // samples per pixel
+    u32 rps; // rows per strip
+    u32 planar;
+    u32 strips;
+  } info = {0, 0, 1, 1, 0, 1, 0xFFFFFFFF, 1, 0};
+
   for (u16 i = 0; i < count; i++) {
-    uc tag[12];
-    fread(&tag, 12, 1, f);
-    u16 id = *(u16 *)&tag[0];
-    u16 type = *(u16 *)&tag[2];
-    u32 count = *(u32 *)&tag[4];
-    u32 offset = *(u32 *)&tag[8];
-
-    if (id != 256 && id != 257)
+    const uc *entry = &entries[i * 12];
+    u16 id = get16(&entry[0], big);
+
+    // Fields this reader cares about are all SHORT/LONG
+    if (id != 256 && id != 257 && id != 258 && id != 259 && id != 262 &&
+        id != 273 && id != 277 && id != 278 && id != 284)
       continue;
 
-    u32 cursor = ftell(f);
-    fseek(f, offset, SEEK_SET);
-    u16 val;
-    fread(&val, 2, 1, f);
-    fseek(f, cursor, SEEK_SET);
+    u32 *values = tiff_values(r, big, entry);
+    HANDLE(values, "failed to read IFD entry", EXIT);
+
+    switch (id) {
+    case 256:
+      info.width = values[0];
+      break;
+    case 257:
+      info.height = values[0];
+      break;
+    case 258:
+      info.bps = values[0]; // checked for every sample below
+      for (u32 j = 1; j < get32(&entry[4], big); j++)
+        if (values[j] != info.bps)
+          info.bps = 0;
+      break;
+    case 259:
+      info.compression = values[0];
+      break;
+    case 262:
+      info.photometric = values[0];
+      break;
+    case 273:
+      free(offsets);
+      offsets = values, values = NULL;
+      info.strips = get32(&entry[4], big);
+      break;
+    case 277:
+      info.spp = values[0];
+      break;
+    case 278:
+      info.rps = values[0];
+      break;
+    case 284:
+      info.planar = values[0];
+      break;
+    }
 
-    if (id == 256)
-      printf("width %u\n", *(u16 *)&offset);
-    if (id == 257)
-      printf("height %u\n", *(u16 *)&offset);
+    free(values);
   }
 
-  //   u16 tag = *(u16 *)&entry[0];
-  //   u16 type = *(u16 *)&entry[2];
-  //   u32 count = *(u32 *)&entry[4];
-  //   p = *(u32 *)&entry[8];
+  // Check Values
+  HANDLE(info.width != 0 && info.height != 0, "invalid image size", EXIT);
+  HANDLE(info.bps == 8, "only 8 bits per sample is supported", EXIT);
+  HANDLE(info.compression == 1, "compression is not supported", EXIT);
+  HANDLE(info.photometric <= 2, "unsupported photometric interpretation",
+         EXIT);
+  HANDLE(info.spp >= 1 && info.spp <= 4, "unsupported samples per pixel",
+         EXIT);
+  HANDLE(info.planar == 1, "planar configuration is not supported", EXIT);
+  HANDLE(offsets && info.rps != 0, "missing strips", EXIT);
+
+  u32 stride = info.width * info.spp;
+  HANDLE((u64)info.strips * info.rps >= info.height, "missing strips", EXIT);
+
+  // Rows are read straight from their strips and reduced on the fly
+  scaler_t s;
+  HANDLE(!scaler_init(&s, info.width, info.height, info.spp, scale),
+         "failed to create image", EXIT);
+  trace_end();
+
+  while (!scaler_done(&s)) {
+    trace_begin(IMAGE_STAGE_DECODE);
+    u32 y = s.y;
+    if (y % info.rps == 0)
+      reader_seek(r, offsets[y / info.rps], SEEK_SET);
+
+    uc *row = scaler_row(&s);
+    size_t read = reader_read(r, row, stride, 1);
+    trace_end();
+    HANDLE(read, "failed to read image data", break);
+
+    trace_begin(IMAGE_STAGE_CONVERT);
+    if (info.photometric == 0)
+      for (u32 x = 0; x < stride; x++)
+        row[x] = 255 - row[x];
+
+    scaler_push(&s);
+    trace_end();
+  }
 
-  fclose(f);
+#undef EXIT
 
-  return NULL;
+  free(entries);
+  free(offsets);
+
+  return scaler_finish(&s);
+}
+
+image_t *image_load_tiff_scaled(const char *path, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  HANDLE(!reader_open(&r, path), "no such file", return NULL);
+
+  image_t *out = tiff_decode(&r, scale);
+  reader_close(&r);
+
+  return out;
+}
+
+image_t *image_decode_tiff(const void *data, size_t size, uint8_t scale) {
+  TRACE_CALL();
+  reader_t r;
+  reader_memory(&r, data, size);
+
+  return tiff_decode(&r, scale);
+}
+
+// Fill a little endian IFD entry, returns the next one
+static uc *put_entry(uc *entry, u16 id, u16 type, u32 count, u32 value) {
+  *(u16 *)&entry[0] = id;
+  *(u16 *)&entry[2] = type;
+  *(u32 *)&entry[4] = count;
+  *(u32 *)&entry[8] = 0;
+
+  if (type == 3 && count == 1)
+    *(u16 *)&entry[8] = value;
+  else
+    *(u32 *)&entry[8] = value;
+
+  return entry + 12;
 }
 
-// int image_save_qoi(image_t image, const char *path) {
-//   HANDLE(image_is_valid(image), "invalid image", return 1);
-
-//   FILE *f = fopen(path, "wb");
-//   HANDLE(f, "failed to create file", return 1);
-
-//   // Write Header
-//   unsigned char header[14];
-//   memset(header, 0, 14);
-//   strncpy((char *)header, "qoif", 4);
-//   *(uint32_t *)&header[4] = __builtin_bswap32(image.width);
-//   *(uint32_t *)&header[8] = __builtin_bswap32(image.height);
-//   *(uint8_t *)&header[12] = image.channels <= 3 ? 3 : 4;
-//   *(uint8_t *)&header[13] = 0; // TODO
-
-//   HANDLE(fwrite(header, 14, 1, f), "failed to write header", {
-//     fclose(f);
-//     return 1;
-//   });
-
-//   // Start Writing Chunks
-//   uint32_t array[64] = {};
-//   unsigned char prev[4] = {0, 0, 0, 255}; // previous color
-//   uint32_t cursor = 0;
-//   while (cursor <= image.width * image.height) {
-//     unsigned char *current = &image.data[cursor * image.channels];
-
-//     // Try encoding by repetition
-//     {
-//       uint8_t count = 0;
-//       while (
-//           !memcmp(&image.data[cursor * image.channels], prev, image.channels)
-//           && count < 62) {
-//         count++;
-//         cursor++;
-//       }
-
-//       if (count > 0) {
-//         uint8_t run = 0b11000000 | ((count - 1) & 0b00111111);
-//         fwrite(&run, 1, 1, f);
-//         continue;
-//       }
-//     }
-
-//     // Try encoding by indexing
-//     {
-//       uint32_t id = HASH(current[0], current[1], current[2],
-//                          image.channels == 3 ? prev[3] : current[3]);
-
-//       if (!memcmp(&image.data[array[id] * image.channels], current,
-//                   image.channels)) {
-//         uint8_t index = 0b00000000 | (id & 0b00111111);
-//         unsigned char *d = &image.data[array[id] * image.channels];
-//         printf("%u %u %u\n", d[0], d[1], d[2]);
-//         HANDLE(fwrite(&index, 1, 1, f), "failed to write index", continue);
-
-//         memcpy(prev, current, image.channels);
-//         array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-//         cursor++;
-//         continue;
-//       }
-//     }
-
-//     // Try encoding by difference
-//     {
-//       if (image.channels == 3 ||
-//           (image.channels == 4 && current[3] == prev[3])) {
-//         // Diff
-//         int raw[3] = {current[0] - prev[0], current[1] - prev[1],
-//                       current[2] - prev[2]};
-//         if ((raw[0] >= -2 && raw[0] <= 1) && (raw[1] >= -2 && raw[1] <= 1) &&
-//             (raw[2] >= -2 && raw[2] <= 1)) {
-//           uint8_t dr = raw[0] + 2, dg = raw[1] + 2, db = raw[2] + 2;
-//           uint8_t diff = 0b01000000 | ((dr & 0b00000011) << 4) |
-//                          ((dg & 0b00000011) << 2) | (db & 0b00000011);
-//           fwrite(&diff, 1, 1, f);
-
-//           memcpy(prev, current, image.channels);
-//           array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-//           cursor++;
-//           continue;
-//         }
-
-//         // Luma
-//         raw[0] = raw[0] - raw[1], raw[2] = raw[2] - raw[1];
-//         if ((raw[1] >= -32 && raw[1] <= 31) && (raw[0] >= -8 && raw[0] <= 7)
-//         &&
-//             (raw[2] >= -8 && raw[2] <= 7)) {
-//           uint8_t dr = raw[0] + 8, dg = raw[1] + 32, db = raw[2] + 8;
-//           uint8_t diffg = 0b10000000 | (dg & 0b00111111);
-//           uint8_t drb = ((dr & 0b00001111) << 4) | (db & 0b00001111);
-//           fwrite(&diffg, 1, 1, f);
-//           fwrite(&drb, 1, 1, f);
-
-//           memcpy(prev, current, image.channels);
-//           array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-//           cursor++;
-//           continue;
-//         }
-//       }
-//     }
-
-//     // encode RGB(A)
-//     {
-//       uint8_t tag = 0b11111110;
-//       if (image.channels == 4 && current[3] != prev[3])
-//         tag = 0b11111111;
-//       HANDLE(fwrite(&tag, 1, 1, f), "failed to write RGB(A) tag", continue);
-//       HANDLE(fwrite(current, (tag == 0b11111110) ? 3 : 4, 1, f),
-//              "failed to write RGB(A) data", continue);
-
-//       memcpy(prev, current, image.channels);
-//       array[HASH(prev[0], prev[1], prev[2], prev[3])] = cursor;
-//       cursor++;
-//     }
-//   }
-
-//   // Write End Sequence
-//   uint8_t end = 0b00000000;
-//   for (int i = 0; i < 7; i++)
-//     fwrite(&end, 1, 1, f);
-//   end = 0b00000001;
-//   fwrite(&end, 1, 1, f);
-
-//   fclose(f);
-
-//   return 0;
-// }
\ No newline at end of file
+int image_save_tiff(image_t image, const char *path) {
+  TRACE_CALL();
+  HANDLE(image_is_valid(image), "invalid image", return 1);
+  HANDLE(image.channels <= 4, "too many channels", return 1);
+
+  FILE *f = trace_fopen(path, "wb");
+  HANDLE(f, "failed to create file", return 1);
+
+  // Layout: header, strips, IFD, out of line values
+  u32 stride = image.width * image.channels;
+  u32 rps = stride < 8192 ? 8192 / stride : 1; // ~8K strips
+  u32 strips = (image.height + rps - 1) / rps;
+  u32 size = stride * image.height;
+
+  u16 count = image.channels == 2 || image.channels == 4 ? 11 : 10;
+  u32 ifd = 8 + size + (size & 1);       // word aligned
+  u32 extra = ifd + 2 + count * 12 + 4; // after IFD & next IFD offset
+
+  // Write Header
+  uc header[8] = {'I', 'I', 42, 0};
+  *(u32 *)&header[4] = ifd;
+  HANDLE(fwrite(header, 8, 1, f), "failed to write header", {
+    fclose(f);
+    return 1;
+  });
+
+  // Write Strips
+  HANDLE(fwrite(image.data, size, 1, f) && (size % 2 == 0 || fputc(0, f) == 0),
+         "failed to write image data", {
+           fclose(f);
+           return 1;
+         });
+
+  // Out of line values
+  u16 bps[4] = {8, 8, 8, 8};
+  u32 *offsets = malloc((size_t)strips * 2 * sizeof(u32)),
+      *counts = &offsets[strips];
+  HANDLE(offsets, "failed to allocate strips", {
+    fclose(f);
+    return 1;
+  });
+
+  for (u32 i = 0; i < strips; i++) {
+    offsets[i] = 8 + i * rps * stride;
+    counts[i] = (i + 1 < strips ? rps : image.height - i * rps) * stride;
+  }
+
+  u32 bps_at = image.channels > 2 ? extra : 0;
+  u32 offsets_at = extra + (bps_at ? 8 : 0);
+  u32 counts_at = offsets_at + strips * 4;
+
+  // Write IFD (entries sorted by tag)
+  uc entries[count * 12 + 6];
+  uc *e = &entries[2];
+  *(u16 *)&entries[0] = count;
+
+  int color = image.channels >= 3;
+  e = put_entry(e, 256, 4, 1, image.width);
+  e = put_entry(e, 257, 4, 1, image.height);
+  e = put_entry(e, 258, 3, image.channels, bps_at ? bps_at : 8 | 8 << 16);
+  e = put_entry(e, 259, 3, 1, 1);             // no compression
+  e = put_entry(e, 262, 3, 1, color ? 2 : 1); // RGB / BlackIsZero
+  e = put_entry(e, 273, 4, strips, strips > 1 ? offsets_at : offsets[0]);
+  e = put_entry(e, 277, 3, 1, image.channels);
+  e = put_entry(e, 278, 4, 1, rps);
+  e = put_entry(e, 279, 4, strips, strips > 1 ? counts_at : counts[0]);
+  e = put_entry(e, 284, 3, 1, 1); // chunky
+  if (count == 11)
+    e = put_entry(e, 338, 3, 1, 2); // unassociated alpha
+  *(u32 *)e = 0; // no next IFD
+
+  int written =
+      fwrite(entries, sizeof(entries), 1, f) &&
+      (!bps_at || fwrite(bps, 8, 1, f)) &&
+      (strips == 1 || fwrite(offsets, 4, (size_t)strips * 2, f) == strips * 2);
+  free(offsets);
+
+  HANDLE(written, "failed to write IFD", {
+    fclose(f);
+    return 1;
+  });
+
+  fclose(f);
+
+  return 0;
+}
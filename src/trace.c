@@ -0,0 +1,314 @@
+/**
+ * @brief Instrumentation (counters, stage timing & Chrome traces)
+ *
+ * Counters live per thread and are only touched while the outermost public
+ * call of that thread started with instrumentation enabled, so disabled
+ * builds pay one thread local load per counted event. Tasks a call hands to
+ * other threads count into a share that the call merges when they are done
+ * (their stage times add up across threads).
+ */
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+_Thread_local trace_thread_t trace_thread;
+
+static int enabled;
+
+static struct {
+  image_trace_fn fn;
+  void *user;
+} callback;
+
+// Chrome trace-event output
+static struct {
+  pthread_mutex_t lock;
+  FILE *f;
+  u64 events;
+} chrome = {PTHREAD_MUTEX_INITIALIZER};
+
+static const char *stage_names[IMAGE_STAGES] = {
+    "header", "read", "decode", "unfilter", "convert", "encode", "write"};
+
+static u64 now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (u64)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+const char *image_stage_name(image_stage_t stage) {
+  return stage < IMAGE_STAGES ? stage_names[stage] : "unknown";
+}
+
+void image_trace_enable(int enable) {
+  __atomic_store_n(&enabled, enable != 0, __ATOMIC_RELAXED);
+}
+
+void image_trace_callback(image_trace_fn fn, void *user) {
+  callback.fn = fn, callback.user = user;
+}
+
+void image_trace_counters(image_counters_t *out) {
+  HANDLE(out, "invalid value(s)", return);
+  *out = trace_thread.total;
+}
+
+void image_trace_reset(void) {
+  memset(&trace_thread.total, 0, sizeof(trace_thread.total));
+}
+
+int image_trace_open(const char *path) {
+  FILE *f = fopen(path, "w");
+  HANDLE(f, "failed to create file", return 1);
+
+  pthread_mutex_lock(&chrome.lock);
+  if (chrome.f) {
+    pthread_mutex_unlock(&chrome.lock);
+    fclose(f);
+    ERROR("trace already open");
+    return 1;
+  }
+
+  fputs("{\"traceEvents\":[", f);
+  chrome.f = f, chrome.events = 0;
+  pthread_mutex_unlock(&chrome.lock);
+
+  image_trace_enable(1);
+  return 0;
+}
+
+void image_trace_close(void) {
+  pthread_mutex_lock(&chrome.lock);
+  if (chrome.f) {
+    fputs("\n]}\n", chrome.f);
+    fclose(chrome.f);
+    chrome.f = NULL;
+  }
+  pthread_mutex_unlock(&chrome.lock);
+}
+
+// One complete ("X") event per outermost call, counters as arguments
+static void chrome_event(const char *name, u64 start,
+                         const image_counters_t *c) {
+  static _Thread_local long tid;
+  if (!tid)
+    tid = syscall(SYS_gettid);
+
+  pthread_mutex_lock(&chrome.lock);
+  if (chrome.f) {
+    fprintf(chrome.f,
+            "%s\n{\"name\":\"%s\",\"cat\":\"image\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{"
+            "\"bytes_read\":%lu,\"bytes_written\":%lu,\"syscalls\":%lu,"
+            "\"alloc_bytes\":%lu",
+            chrome.events++ ? "," : "", name, start / 1e3, c->total_ns / 1e3,
+            getpid(), tid, (unsigned long)c->bytes_read,
+            (unsigned long)c->bytes_written, (unsigned long)c->syscalls,
+            (unsigned long)c->alloc_bytes);
+
+    for (int i = 0; i < IMAGE_STAGES; i++)
+      fprintf(chrome.f, ",\"%s_us\":%.3f", stage_names[i],
+              c->stage_ns[i] / 1e3);
+    fputs("}}", chrome.f);
+  }
+  pthread_mutex_unlock(&chrome.lock);
+}
+
+static void counters_add(image_counters_t *to, const image_counters_t *from) {
+  to->calls += from->calls;
+  to->total_ns += from->total_ns;
+  to->bytes_read += from->bytes_read;
+  to->bytes_written += from->bytes_written;
+  to->syscalls += from->syscalls;
+  to->alloc_bytes += from->alloc_bytes;
+  for (int i = 0; i < IMAGE_STAGES; i++)
+    to->stage_ns[i] += from->stage_ns[i];
+}
+
+trace_call_t trace_call_begin(const char *name) {
+  trace_thread_t *t = &trace_thread;
+
+  if (t->calls++ == 0 && __atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    t->active = 1;
+    t->name = name;
+    memset(&t->call, 0, sizeof(t->call));
+    t->start = now();
+  }
+
+  return (trace_call_t){t->depth};
+}
+
+void trace_call_end(trace_call_t *call) {
+  trace_thread_t *t = &trace_thread;
+
+  // close stages left open by early returns
+  while (t->active && t->depth > call->depth)
+    trace_pop();
+
+  if (--t->calls > 0 || !t->active)
+    return;
+
+  image_counters_t *c = &t->call;
+  c->calls = 1;
+  c->total_ns = now() - t->start;
+  t->active = 0;
+
+  counters_add(&t->total, c);
+
+  if (callback.fn)
+    callback.fn(t->name, c, callback.user);
+
+  chrome_event(t->name, t->start, c);
+}
+
+void trace_share_begin(trace_share_t *share) {
+  memset(share, 0, sizeof(*share));
+  share->active = trace_thread.active;
+}
+
+void trace_share_end(trace_share_t *share) {
+  if (!share->active || !trace_thread.active)
+    return;
+
+  // the tasks are done, their adds ordered before by the caller's wait
+  counters_add(&trace_thread.call, &share->counters);
+}
+
+trace_task_t trace_task_begin(const trace_share_t *share) {
+  trace_thread_t *t = &trace_thread;
+  if (!share->active || t->active)
+    return (trace_task_t){0, t->depth};
+
+  // counted like a nested call of the sharing one
+  t->active = 1;
+  t->calls++;
+  memset(&t->call, 0, sizeof(t->call));
+  return (trace_task_t){1, t->depth};
+}
+
+void trace_task_end(trace_share_t *share, trace_task_t *task) {
+  trace_thread_t *t = &trace_thread;
+  if (!task->adopted)
+    return;
+
+  while (t->depth > task->depth)
+    trace_pop();
+
+  // tasks of one share finish concurrently
+  image_counters_t *to = &share->counters, *from = &t->call;
+  __atomic_add_fetch(&to->bytes_read, from->bytes_read, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&to->bytes_written, from->bytes_written,
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&to->syscalls, from->syscalls, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&to->alloc_bytes, from->alloc_bytes, __ATOMIC_RELAXED);
+  for (int i = 0; i < IMAGE_STAGES; i++)
+    __atomic_add_fetch(&to->stage_ns[i], from->stage_ns[i], __ATOMIC_RELAXED);
+
+  t->active = 0;
+  t->calls--;
+}
+
+void trace_push(image_stage_t stage) {
+  trace_thread_t *t = &trace_thread;
+
+  if (t->depth < TRACE_DEPTH) {
+    t->stack[t->depth].stage = stage;
+    t->stack[t->depth].start = now();
+    t->stack[t->depth].nested = 0;
+  }
+  t->depth++;
+}
+
+void trace_pop(void) {
+  trace_thread_t *t = &trace_thread;
+  if (t->depth == 0)
+    return;
+
+  // deeper than tracked, counted in the parent
+  if (--t->depth >= TRACE_DEPTH)
+    return;
+
+  u64 elapsed = now() - t->stack[t->depth].start;
+  t->call.stage_ns[t->stack[t->depth].stage] +=
+      elapsed - t->stack[t->depth].nested;
+
+  if (t->depth > 0)
+    t->stack[t->depth - 1].nested += elapsed;
+}
+
+#ifdef __GLIBC__
+// File descriptor behind a counted FILE, syscalls run in the calling thread
+static ssize_t cookie_read(void *cookie, char *buffer, size_t size) {
+  trace_begin(IMAGE_STAGE_READ);
+  ssize_t n = read((int)(intptr_t)cookie, buffer, size);
+  trace_end();
+
+  trace_syscalls(1);
+  if (n > 0)
+    trace_read(n);
+  return n;
+}
+
+static ssize_t cookie_write(void *cookie, const char *buffer, size_t size) {
+  trace_begin(IMAGE_STAGE_WRITE);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = write((int)(intptr_t)cookie, &buffer[done], size - done);
+    trace_syscalls(1);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  trace_end();
+
+  if (trace_thread.active)
+    trace_thread.call.bytes_written += done;
+  return done;
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+  trace_syscalls(1);
+  off64_t result = lseek64((int)(intptr_t)cookie, *offset, whence);
+  if (result < 0)
+    return -1;
+
+  *offset = result;
+  return 0;
+}
+
+static int cookie_close(void *cookie) {
+  trace_syscalls(1);
+  return close((int)(intptr_t)cookie);
+}
+#endif
+
+FILE *trace_fopen(const char *path, const char *mode) {
+#ifdef __GLIBC__
+  if (trace_thread.active) {
+    int flags = mode[0] == 'r' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+
+    trace_syscalls(1);
+    int fd = open(path, flags | O_CLOEXEC, 0666);
+    if (fd < 0)
+      return NULL;
+
+    cookie_io_functions_t io = {cookie_read, cookie_write, cookie_seek,
+                                cookie_close};
+    FILE *f = fopencookie((void *)(intptr_t)fd, mode, io);
+    if (!f)
+      close(fd);
+    return f;
+  }
+#endif
+
+  return fopen(path, mode);
+}
@@ -0,0 +1,102 @@
+/**
+ * @brief Instrumentation (counters, stage timing & Chrome traces)
+ */
+
+#pragma once
+
+#include "types.h"
+#include <image.h>
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define TRACE_DEPTH 8 // nested stages
+
+// Per thread state
+typedef struct {
+  int active;       // inside an instrumented (outermost) call
+  u32 calls;        // nesting of public calls
+  u64 start;        // of the outermost call
+  const char *name; // of the outermost call
+
+  image_counters_t call;  // current outermost call
+  image_counters_t total; // finished calls
+
+  // open stages, time of nested ones is subtracted from their parent
+  struct {
+    image_stage_t stage;
+    u64 start, nested;
+  } stack[TRACE_DEPTH];
+  u32 depth;
+} trace_thread_t;
+
+extern _Thread_local trace_thread_t trace_thread;
+
+// Public call scope, stage depth on entry
+typedef struct {
+  u32 depth;
+} trace_call_t;
+
+trace_call_t trace_call_begin(const char *name);
+void trace_call_end(trace_call_t *call);
+
+// Work of an instrumented call done by tasks on other threads, merged into
+// the call once they are done
+typedef struct {
+  int active; // the calling thread is instrumented
+  image_counters_t counters;
+} trace_share_t;
+
+// Task scope, whether it counts for a share
+typedef struct {
+  int adopted;
+  u32 depth;
+} trace_task_t;
+
+// On the calling thread, before submitting tasks / after they are all done
+void trace_share_begin(trace_share_t *share);
+void trace_share_end(trace_share_t *share);
+
+// Around a task's work (public calls in it are nested, not reported); a
+// no-op on the calling thread, which counts its share itself
+trace_task_t trace_task_begin(const trace_share_t *share);
+void trace_task_end(trace_share_t *share, trace_task_t *task);
+
+// Instrument the enclosing public function (reported when the outermost one
+// returns, stages left open by early returns are closed)
+#define TRACE_CALL()                                                           \
+  trace_call_t trace_call __attribute__((cleanup(trace_call_end))) =          \
+      trace_call_begin(__func__)
+
+void trace_push(image_stage_t stage);
+void trace_pop(void);
+
+// Time a stage (nestable)
+static inline void trace_begin(image_stage_t stage) {
+  if (trace_thread.active)
+    trace_push(stage);
+}
+
+static inline void trace_end(void) {
+  if (trace_thread.active)
+    trace_pop();
+}
+
+// Count bytes consumed from a source / syscalls / allocations
+static inline void trace_read(size_t bytes) {
+  if (trace_thread.active)
+    trace_thread.call.bytes_read += bytes;
+}
+
+static inline void trace_syscalls(u32 count) {
+  if (trace_thread.active)
+    trace_thread.call.syscalls += count;
+}
+
+static inline void trace_alloc(size_t bytes) {
+  if (trace_thread.active)
+    trace_thread.call.alloc_bytes += bytes;
+}
+
+// fopen whose reads, writes & syscalls are counted while instrumented
+FILE *trace_fopen(const char *path, const char *mode);
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdint.h>
 
 // Rust-like types
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "types.h"
 
 #include <stdio.h>
@@ -14,4 +16,4 @@
       ERROR(message);                                                          \
       action;                                                                  \
     }                                                                          \
-  }
\ No newline at end of file
+  }
@@ -0,0 +1,193 @@
+/**
+ * @brief Pixel Kernels Against the Scalar Reference
+ *
+ * Every level the CPU supports is selected in turn and its kernels are run
+ * on random data of many lengths (covering vector tails), the output must
+ * match the scalar one byte for byte.
+ */
+
+#include "kernel.h"
+#include <image.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LENGTHS 80 // every length up to, then a few large ones
+#define MAX (4096 + 64)
+
+static unsigned failures;
+
+// xorshift32, fixed seed so failures reproduce
+static u32 next(void) {
+  static u32 state = 2463534242u;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static void randomize(uc *data, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    data[i] = next();
+}
+
+static size_t length(u32 i) {
+  static const size_t large[] = {255, 256, 257, 1000, 1023, 4096};
+  return i < LENGTHS ? i : large[i - LENGTHS];
+}
+#define TRIALS (LENGTHS + 6)
+
+static void check(int equal, const char *kernel, size_t n, u32 variant) {
+  if (equal)
+    return;
+
+  fprintf(stderr, "%s: %s differs (length %zu, variant %u)\n",
+          image_cpu_name(image_cpu_level()), kernel, n, variant);
+  failures++;
+}
+
+// up to 8 bytes per sample (unfilter bpp, resample taps)
+static uc a[MAX * 8], b[MAX * 8], src[MAX * 8], prev[MAX * 8];
+
+static void test_fill(void) {
+  for (u32 t = 0; t < TRIALS; t++)
+    for (u8 ch = 1; ch <= 4; ch++) {
+      size_t n = length(t);
+      uc pixel[4];
+      randomize(pixel, 4);
+      memset(a, 0, n * ch + 64), memset(b, 0, n * ch + 64);
+
+      scalar_fill(a, n, pixel, ch);
+      kernels.fill(b, n, pixel, ch);
+      check(!memcmp(a, b, n * ch + 64), "fill", n, ch);
+    }
+}
+
+static void test_swizzle(void) {
+  for (u32 t = 0; t < TRIALS; t++)
+    for (u8 ch = 3; ch <= 4; ch++) {
+      size_t n = length(t);
+      randomize(src, n * ch);
+      memset(a, 0, n * 3 + 64), memset(b, 0, n * 3 + 64);
+
+      scalar_swizzle(a, src, n, ch);
+      kernels.swizzle(b, src, n, ch);
+      check(!memcmp(a, b, n * 3 + 64), "swizzle", n, ch);
+    }
+}
+
+static void test_run(void) {
+  for (u32 t = 0; t < TRIALS; t++)
+    for (u8 ch = 1; ch <= 4; ch++) {
+      // a run of the pixel, broken at a random spot (or not at all)
+      size_t n = length(t), at = n ? next() % (n + 1) : 0;
+      uc pixel[4];
+      randomize(pixel, 4);
+      scalar_fill(src, n, pixel, ch);
+      if (at < n)
+        src[at * ch + next() % ch] ^= 1 + next() % 255;
+
+      check(scalar_run(src, n, ch, pixel) == kernels.run(src, n, ch, pixel),
+            "run", n, ch);
+    }
+}
+
+static void test_unfilter(void) {
+  static const char *names[5] = {"", "unfilter sub", "unfilter up",
+                                 "unfilter average", "unfilter paeth"};
+  static void (*const scalar[5])(uc *, const uc *, u32, u32) = {
+      NULL, scalar_unfilter_sub, scalar_unfilter_up, scalar_unfilter_average,
+      scalar_unfilter_paeth};
+
+  for (u32 t = 0; t < TRIALS; t++)
+    for (u32 bpp = 1; bpp <= 8; bpp++)
+      for (int f = 1; f < 5; f++) {
+        u32 n = length(t) * bpp;
+        randomize(a, n);
+        randomize(prev, n);
+        memcpy(b, a, n);
+
+        scalar[f](a, prev, n, bpp);
+        kernels.unfilter[f](b, prev, n, bpp);
+        check(!memcmp(a, b, n), names[f], n, bpp);
+      }
+}
+
+static void test_blend(void) {
+  for (u32 t = 0; t < TRIALS; t++)
+    for (u8 ch = 3; ch <= 4; ch++) {
+      size_t n = length(t);
+      randomize(src, n * 4);
+      // opaque & transparent pixels take shortcuts
+      for (size_t i = 0; i < n; i++)
+        if (next() % 4 == 0)
+          src[i * 4 + 3] = next() % 2 ? 255 : 0;
+      randomize(a, n * ch);
+      memcpy(b, a, n * ch);
+
+      scalar_blend(a, src, n, ch);
+      kernels.blend(b, src, n, ch);
+      check(!memcmp(a, b, n * ch), "blend", n, ch);
+    }
+}
+
+// Random taps weights summing to one (WEIGHT_BITS fixed point), like the
+// triangle filter's
+static void weights(i32 *w, u32 taps) {
+  i32 sum = 0;
+  for (u32 k = 0; k < taps; k++)
+    sum += w[k] = next() % (1 << WEIGHT_BITS) / taps;
+  w[0] += (1 << WEIGHT_BITS) - sum;
+}
+
+static void test_resample(void) {
+  static u32 start[MAX], count[MAX];
+  static i32 w[MAX * 8];
+
+  for (u32 t = 0; t < TRIALS; t++)
+    for (u32 taps = 1; taps <= 8; taps++) {
+      // vertical: taps rows of n bytes
+      size_t n = length(t);
+      randomize(src, n * taps);
+      weights(w, taps);
+
+      scalar_resample_rows(a, src, n, n, w, taps);
+      kernels.resample_rows(b, src, n, n, w, taps);
+      check(!memcmp(a, b, n), "resample rows", n, taps);
+
+      // horizontal: n output pixels from a row of n + taps
+      for (u8 ch = 1; ch <= 4; ch++) {
+        u32 width = n, source = n + taps;
+        randomize(src, (size_t)source * ch);
+        for (u32 x = 0; x < width; x++) {
+          count[x] = 1 + next() % taps;
+          start[x] = next() % (source - count[x] + 1);
+          weights(&w[(size_t)x * taps], count[x]);
+        }
+
+        scalar_resample_row(a, src, width, ch, start, count, w, taps);
+        kernels.resample_row(b, src, width, ch, start, count, w, taps);
+        check(!memcmp(a, b, (size_t)width * ch), "resample row", n,
+              taps * 10 + ch);
+      }
+    }
+}
+
+int main(void) {
+  image_cpu_t best = image_cpu_level();
+
+  for (image_cpu_t cpu = IMAGE_CPU_SCALAR; cpu <= best; cpu++) {
+    image_cpu_select(cpu);
+    test_fill();
+    test_swizzle();
+    test_run();
+    test_unfilter();
+    test_blend();
+    test_resample();
+    printf("%s: done\n", image_cpu_name(cpu));
+  }
+
+  image_cpu_select(best);
+  return failures != 0;
+}
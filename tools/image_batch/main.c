@@ -0,0 +1,328 @@
+/**
+ * @brief Concurrent Batch Transcoder
+ *
+ * Every file goes through load -> process -> save stages, each a task for
+ * the worker threads; new files are only admitted while the decoded images
+ * in flight fit in the memory budget. The library runs its own parallel work
+ * on the same workers.
+ */
+
+#define _GNU_SOURCE
+
+#include "workers.h"
+#include <image.h>
+
+#include <dirent.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static const char *usage =
+    "usage: image-batch -f <qoi|bmp|png|tiff> [options] <file|dir>...\n"
+    "  -f <format>  output format\n"
+    "  -o <dir>     output directory (default: next to the input)\n"
+    "  -r <W>x<H>   resize (0 for one side keeps the aspect ratio)\n"
+    "  -c <1-4>     convert to channel count\n"
+    "  -j <n>       worker threads (default: one per core)\n"
+    "  -m <MiB>     decoded images in flight (default: 512)\n";
+
+static struct {
+  const char *format;
+  const char *output;
+  uint32_t width, height, channels;
+  unsigned threads;
+  size_t budget;
+} options = {NULL, NULL, 0, 0, 0, 0, 512};
+
+// Bytes of decoded images in flight
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  size_t used;
+
+  unsigned long done, failed;
+  uint64_t pixels;
+} state = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+typedef struct {
+  workers_t *workers;
+  char *input, *output;
+  image_t *image;
+  size_t charged; // bytes counted against the budget
+} job_t;
+
+static void charge(job_t *job, size_t bytes) {
+  pthread_mutex_lock(&state.lock);
+  state.used = state.used - job->charged + bytes;
+  job->charged = bytes;
+  pthread_cond_broadcast(&state.freed);
+  pthread_mutex_unlock(&state.lock);
+}
+
+static void count_failure(void) {
+  pthread_mutex_lock(&state.lock);
+  state.failed++;
+  pthread_mutex_unlock(&state.lock);
+}
+
+static void job_finish(job_t *job, int failed) {
+  if (failed) {
+    count_failure();
+  } else {
+    pthread_mutex_lock(&state.lock);
+    state.done++;
+    state.pixels += (uint64_t)job->image->width * job->image->height;
+    pthread_mutex_unlock(&state.lock);
+  }
+
+  charge(job, 0);
+
+  image_free(job->image);
+  free(job->input);
+  free(job->output);
+  free(job);
+}
+
+// Stage 3: encode & write
+static void job_save(void *arg) {
+  job_t *job = arg;
+
+  int failed = image_save(*job->image, job->output);
+  if (failed)
+    fprintf(stderr, "failed to save %s\n", job->output);
+
+  job_finish(job, failed);
+}
+
+// Stage 2: resize / convert
+static void job_process(void *arg) {
+  job_t *job = arg;
+  image_t *im = job->image;
+
+  uint32_t width = options.width, height = options.height;
+  if (width == 0 && height == 0)
+    width = im->width, height = im->height;
+  else if (width == 0)
+    width = (uint64_t)im->width * height / im->height;
+  else if (height == 0)
+    height = (uint64_t)im->height * width / im->width;
+
+  image_resize(im, width ? width : 1, height ? height : 1,
+               options.channels ? options.channels : im->channels);
+  charge(job, (size_t)im->width * im->height * im->channels);
+
+  workers_submit(job->workers, job_save, job);
+}
+
+// Stage 1: read & decode
+static void job_load(void *arg) {
+  job_t *job = arg;
+
+  job->image = image_load(job->input);
+  if (!job->image) {
+    fprintf(stderr, "failed to load %s\n", job->input);
+    job_finish(job, 1);
+    return;
+  }
+
+  image_t *im = job->image;
+  charge(job, (size_t)im->width * im->height * im->channels);
+
+  if (options.width || options.height || options.channels)
+    workers_submit(job->workers, job_process, job);
+  else
+    workers_submit(job->workers, job_save, job);
+}
+
+static int is_image(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot && (!strcasecmp(dot, ".qoi") || !strcasecmp(dot, ".bmp") ||
+                 !strcasecmp(dot, ".png") || !strcasecmp(dot, ".tif") ||
+                 !strcasecmp(dot, ".tiff"));
+}
+
+// Output path: <dir>/<name>.<format>
+static char *output_path(const char *input) {
+  const char *slash = strrchr(input, '/');
+  const char *name = slash ? slash + 1 : input;
+  const char *dot = strrchr(name, '.');
+  int length = dot ? dot - name : (int)strlen(name);
+
+  char *out = NULL;
+  int result;
+  if (options.output)
+    result = asprintf(&out, "%s/%.*s.%s", options.output, length, name,
+                      options.format);
+  else
+    result = asprintf(&out, "%.*s.%s", (int)(name - input) + length, input,
+                      options.format);
+
+  return result < 0 ? NULL : out;
+}
+
+// Library work goes to the same workers as the jobs
+static void executor(image_task_fn task, void *arg, void *workers) {
+  workers_submit(workers, task, arg);
+}
+
+// Wait for budget, then start the pipeline of one file
+static void submit(workers_t *workers, const char *input) {
+  struct stat st;
+  if (stat(input, &st)) {
+    fprintf(stderr, "no such file %s\n", input);
+    count_failure();
+    return;
+  }
+
+  job_t *job = calloc(1, sizeof(job_t));
+  if (!job || !(job->input = strdup(input)) ||
+      !(job->output = output_path(input))) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  if (!strcmp(job->input, job->output)) {
+    fprintf(stderr, "refusing to overwrite %s\n", input);
+    free(job->input);
+    free(job->output);
+    free(job);
+    count_failure();
+    return;
+  }
+
+  job->workers = workers;
+
+  // the decoded size from the header is charged up front (the file size
+  // when it can't be read); one file is always allowed so a huge image
+  // can't stall the batch
+  uint32_t width, height;
+  uint8_t channels;
+  size_t bytes = st.st_size;
+  if (!image_info(input, &width, &height, &channels))
+    bytes = (size_t)width * height * channels;
+
+  pthread_mutex_lock(&state.lock);
+  while (state.used > 0 && state.used + bytes > options.budget)
+    pthread_cond_wait(&state.freed, &state.lock);
+  state.used += bytes;
+  job->charged = bytes;
+  pthread_mutex_unlock(&state.lock);
+
+  workers_submit(workers, job_load, job);
+}
+
+static void submit_path(workers_t *workers, const char *path) {
+  struct stat st;
+  if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+    submit(workers, path);
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.' || !is_image(entry->d_name))
+      continue;
+
+    char *file = NULL;
+    if (asprintf(&file, "%s/%s", path, entry->d_name) < 0)
+      continue;
+
+    submit(workers, file);
+    free(file);
+  }
+
+  closedir(dir);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "f:o:r:c:j:m:h")) != -1) {
+    switch (opt) {
+    case 'f':
+      options.format = optarg;
+      break;
+    case 'o':
+      options.output = optarg;
+      break;
+    case 'r':
+      if (sscanf(optarg, "%ux%u", &options.width, &options.height) != 2) {
+        fprintf(stderr, "invalid size %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'c':
+      options.channels = atoi(optarg);
+      if (options.channels < 1 || options.channels > 4) {
+        fprintf(stderr, "invalid channel count %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'j':
+      options.threads = atoi(optarg);
+      break;
+    case 'm':
+      options.budget = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      fputs(usage, stderr);
+      return opt != 'h';
+    }
+  }
+
+  if (!options.format || optind >= argc) {
+    fputs(usage, stderr);
+    return 1;
+  }
+
+  char probe[16];
+  snprintf(probe, sizeof(probe), ".%s", options.format);
+  if (!is_image(probe)) {
+    fprintf(stderr, "unknown format %s\n", options.format);
+    return 1;
+  }
+
+  options.budget <<= 20;
+
+  workers_t *workers = workers_create(options.threads);
+  if (!workers) {
+    fprintf(stderr, "failed to start threads\n");
+    return 1;
+  }
+
+  image_parallel_threads(workers_count(workers));
+  image_parallel_executor(executor, workers);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = optind; i < argc; i++)
+    submit_path(workers, argv[i]);
+
+  workers_wait(workers);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr,
+          "%lu done, %lu failed, %.1f MP in %.2fs (%.1f MP/s, %u threads)\n",
+          state.done, state.failed, state.pixels / 1e6, seconds,
+          seconds > 0 ? state.pixels / 1e6 / seconds : 0,
+          workers_count(workers));
+
+  image_parallel_executor(NULL, NULL);
+  workers_destroy(workers);
+
+  return state.failed != 0;
+}
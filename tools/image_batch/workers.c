@@ -0,0 +1,147 @@
+/**
+ * @brief Worker Threads of the Batch Transcoder
+ *
+ * One locked queue is enough here: tasks are whole pipeline stages, and the
+ * library's own bands are also worked on by the thread that submits them.
+ */
+
+#include "workers.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct task {
+  workers_fn fn;
+  void *arg;
+  struct task *next;
+} task_t;
+
+struct workers {
+  pthread_t *threads;
+  unsigned count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signaled on submit & stop
+  pthread_cond_t idle; // signaled when pending reaches 0
+  task_t *head, *tail;
+  unsigned long pending; // queued or running
+  int stop;
+};
+
+static void finished(workers_t *w) {
+  pthread_mutex_lock(&w->lock);
+  if (--w->pending == 0)
+    pthread_cond_broadcast(&w->idle);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void *worker(void *arg) {
+  workers_t *w = arg;
+
+  while (1) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->head && !w->stop)
+      pthread_cond_wait(&w->work, &w->lock);
+
+    task_t *task = w->head;
+    if (!task) {
+      pthread_mutex_unlock(&w->lock);
+      break;
+    }
+
+    w->head = task->next;
+    if (!w->head)
+      w->tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    task->fn(task->arg);
+    free(task);
+    finished(w);
+  }
+
+  return NULL;
+}
+
+workers_t *workers_create(unsigned threads) {
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+
+  workers_t *w = calloc(1, sizeof(workers_t));
+  if (!w)
+    return NULL;
+
+  w->threads = calloc(threads, sizeof(pthread_t));
+  if (!w->threads) {
+    free(w);
+    return NULL;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->idle, NULL);
+
+  for (; w->count < threads; w->count++)
+    if (pthread_create(&w->threads[w->count], NULL, worker, w))
+      break;
+
+  if (!w->count) {
+    workers_destroy(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+void workers_destroy(workers_t *w) {
+  if (!w)
+    return;
+
+  workers_wait(w);
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+
+  for (unsigned i = 0; i < w->count; i++)
+    pthread_join(w->threads[i], NULL);
+
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->work);
+  pthread_cond_destroy(&w->idle);
+
+  free(w->threads);
+  free(w);
+}
+
+unsigned workers_count(const workers_t *w) { return w->count; }
+
+void workers_submit(workers_t *w, workers_fn fn, void *arg) {
+  task_t *task = malloc(sizeof(task_t));
+
+  pthread_mutex_lock(&w->lock);
+  w->pending++;
+  if (task) {
+    *task = (task_t){fn, arg, NULL};
+    *(w->tail ? &w->tail->next : &w->head) = task;
+    w->tail = task;
+    pthread_cond_signal(&w->work);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  // run inline rather than lose the task
+  if (!task) {
+    fn(arg);
+    finished(w);
+  }
+}
+
+void workers_wait(workers_t *w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->pending > 0)
+    pthread_cond_wait(&w->idle, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+}
@@ -0,0 +1,24 @@
+/**
+ * @brief Worker Threads of the Batch Transcoder
+ */
+
+#pragma once
+
+typedef struct workers workers_t;
+
+typedef void (*workers_fn)(void *arg);
+
+// Start threads workers (0 -> one per core)
+workers_t *workers_create(unsigned threads);
+
+// Wait for pending tasks, stop workers and free them
+void workers_destroy(workers_t *w);
+
+// Number of workers
+unsigned workers_count(const workers_t *w);
+
+// Queue task (first in, first out), from any thread
+void workers_submit(workers_t *w, workers_fn fn, void *arg);
+
+// Wait until every submitted task (and the tasks they submitted) finished
+void workers_wait(workers_t *w);